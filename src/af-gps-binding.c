@@ -17,22 +17,84 @@
 
 #define _GNU_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <limits.h>
 #include <netdb.h>
+#include <pthread.h>
 #include <fcntl.h>
+#include <dlfcn.h>
 #include <math.h>
+#include <time.h>
+#include <sched.h>
+#include <poll.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/can.h>
+#include <linux/can/raw.h>
 
 #include <json-c/json.h>
 
 #include <systemd/sd-event.h>
 
+#define AFB_BINDING_VERSION 2
 #include <afb/afb-binding.h>
-#include <afb/afb-service-itf.h>
+
+#include "af-gps-plugin.h"
+#include "geodesy.h"
+#include "arrow-ipc.h"
+
+#if WITH_IO_URING
+# include <liburing.h>
+#endif
+
+/*
+ * static tracepoints (USDT) of the binding
+ *
+ * when WITH_SDT is set, the probes are nops in the code that
+ * tools like perf, bpftrace or systemtap can activate at runtime:
+ *
+ *     bpftrace -e 'usdt:./af-gps-binding.so:afb_gps:fix { @[arg0] = count(); }'
+ */
+#if WITH_SDT
+# include <sys/sdt.h>
+# define TRACE(...)  STAP_PROBEV(afb_gps, __VA_ARGS__)
+#else
+# define TRACE(...)  do{}while(0)
+#endif
+
+/*
+ * compile time gate of the logging
+ *
+ * LOG_LEVEL is the highest level of messages compiled in:
+ * 0 for errors, 1 for warnings and notices, 2 for infos, 3 for debug
+ */
+#if !defined(LOG_LEVEL)
+# define LOG_LEVEL 3
+#endif
+#define LOG_LEVEL_INFO  2
+#define LOG_LEVEL_DEBUG 3
+
+#if LOG_LEVEL < LOG_LEVEL_DEBUG
+# undef AFB_DEBUG
+# define AFB_DEBUG(...)  do{}while(0)
+#endif
+#if LOG_LEVEL < LOG_LEVEL_INFO
+# undef AFB_INFO
+# define AFB_INFO(...)   do{}while(0)
+#endif
 
 #define NAUTICAL_MILE_IN_METER                     1852
 #define MILE_IN_METER                              1609.344
@@ -40,8 +102,56 @@
 #define METER_PER_SECOND_TO_KNOT                   1.943844492          /* 3600 / 1852 */
 #define METER_PER_SECOND_TO_KILOMETER_PER_HOUR     3.6                  /* 3600 / 1000 */
 #define METER_PER_SECOND_TO_MILE_PER_HOUR          2.236936292          /* 3600 / 1609.344 */
+#define METER_PER_DEGREE                           111319.4908          /* 6378137 * pi / 180 */
+#define RADIAN_PER_DEGREE                          0.01745329252        /* pi / 180 */
+#define MILLISECOND_PER_DAY                        86400000
 
 #define DEFAULT_PERIOD   2000   /* 2 seconds */
+#define DEFAULT_KEYFRAME   10   /* pushes between keyframes of delta events */
+#define MAX_DEFERRALS       4   /* deferrals of a push before it ignores the budget */
+
+#define DEFAULT_LOG_SAMPLING  100    /* default sampling of per sentence debug messages */
+
+#define METRICS_TIMEOUT       2000   /* time in ms given to the clients of the metrics endpoint */
+
+#define DEFAULT_MAX_PERIODS   64     /* default maximum count of periods */
+#define DEFAULT_MAX_EVENTS    256    /* default maximum count of events */
+#define SLAB_COUNT            16     /* count of items allocated together */
+
+#define PLUGIN_DECODERS_MAX   16     /* maximum count of decoders of plugins */
+
+#define DEFAULT_HISTORY       600    /* default count of epochs in the history */
+#define HISTORY_CHUNK         64     /* count of records copied in one hold of fix_lock */
+
+#define FUSION_WINDOW         500    /* maximum age in ms of the fused fixes */
+#define DEFAULT_HDOP          2.0    /* HDOP assumed for the fixes not reporting it */
+
+#define DEFAULT_CAN_PERIOD    100    /* default period of dead reckoning in ms */
+#define DEFAULT_CAN_OUTAGE    1500   /* default delay in ms without fix before reckoning */
+#define CAN_FRESHNESS         500    /* maximum age in ms of the CAN values used */
+#define RECKON_UERE           5.0    /* accuracy in m of a fix of HDOP 1 */
+#define RECKON_DRIFT          0.05   /* growth of the accuracy per m travelled */
+
+#define DEFAULT_STOP_SPEED    0.5    /* default maximum speed of stops in m/s */
+#define DEFAULT_STOP_RADIUS   30     /* default radius of stops in m */
+#define DEFAULT_STOP_DURATION 120000 /* default minimum duration of stops in ms */
+
+#define DEFAULT_CORRIDOR      50     /* default half width in m of the corridor of routes */
+#define ROUTE_BEHIND          1      /* segments searched behind the last matched one */
+#define ROUTE_AHEAD           8      /* segments searched ahead of the last matched one */
+#define ROUTE_SMOOTHING       0.2    /* weight of the new speed in the speed of the ETA */
+#define ROUTE_MIN_SPEED       0.5    /* minimal speed in m/s for computing the ETA */
+
+#define DEFAULT_TILE_ZOOM     16     /* default zoom of the tiles */
+#define DEFAULT_TILE_CAPACITY 65536  /* default count of entries of the table of tiles */
+#define TILE_MAX_ZOOM         28     /* maximum zoom of the tiles */
+#define TILE_MAX_LATITUDE     85.0511287798 /* latitude of the edges of the web maps */
+#define TILE_MAX_DWELL        10000  /* maximum dwell time in ms given between two fixes */
+
+#define DEFAULT_TRACK_PERIOD  60000  /* default period in ms of the blocks of the track */
+#define DEFAULT_NEAR_LIMIT    1000   /* default maximum count of points of the verb near */
+
+#define EXPORT_BATCH          4096   /* count of fixes of the exported record batches, multiple of 8 */
 
 /*
  * references:
@@ -50,28 +160,6 @@
  *       http://www.gpsinformation.org/dale/nmea.htm
  */
 
-/* flags for recording what field is set */
-struct flags {
-	unsigned time: 1;
-	unsigned latitude: 1;
-	unsigned longitude: 1;
-	unsigned altitude: 1;
-	unsigned speed: 1;
-	unsigned track: 1;
-};
-
-/* the gps data converted */
-struct gps {
-	struct flags set;
-
-	uint32_t time;
-	double latitude;
-	double longitude;
-	double altitude;
-	double speed;
-	double track;
-};
-
 /*
  * the type of position expected
  *
@@ -82,11 +170,40 @@ enum type {
 	type_dms_kmh,	/* longitude, latitude: degre°minute'second.xxx"X, track: degre, altitude: m, speed: km/h */
 	type_dms_mph,	/* longitude, latitude: degre°minute'second.xxx"X, track: degre, altitude: m, speed: mph  */
 	type_dms_kn,	/* longitude, latitude: degre°minute'second.xxx"X, track: degre, altitude: m, speed: kn   */
+	type_fused,	/* as WGS84 but fusing the fixes of the sources */
 	type_COUNT,
 	type_DEFAULT = type_wgs84,
 	type_INVALID = -1
 };
 
+/*
+ * the fields of the positions
+ */
+enum field {
+	field_time,
+	field_latitude,
+	field_longitude,
+	field_altitude,
+	field_speed,
+	field_track,
+	field_COUNT
+};
+
+#define FIELD_BIT(f)  (1u << (f))			/* bit of the field f in masks */
+#define FIELDS_ALL    (FIELD_BIT(field_COUNT) - 1)	/* mask of all the fields */
+
+/*
+ * the priority classes of the events, pushed in that order
+ */
+enum priority {
+	priority_high,		/* never deferred */
+	priority_normal,
+	priority_low,
+	priority_COUNT,
+	priority_DEFAULT = priority_normal,
+	priority_INVALID = -1
+};
+
 struct event;
 
 /*
@@ -97,6 +214,7 @@ struct period {
 	struct event *events;	/* events for the period */
 	uint32_t period;	/* value of the period in ms */
 	uint32_t last;		/* last update of the period */
+	int due;		/* is the period refreshed by the current sending? */
 };
 
 /*
@@ -107,7 +225,15 @@ struct event {
 	const char *name;	/* name of the event */
 	struct afb_event event;	/* the event for the binder */
 	enum type type;		/* the type of data expected */
+	unsigned fields;	/* mask of the fields expected */
+	unsigned keyframe;	/* pushes between keyframes or 0 if not delta */
+	unsigned countdown;	/* pushes before the next keyframe */
+	struct afb_gps_data sent;	/* the last fix pushed for delta events */
+	enum priority priority;	/* the priority class */
+	unsigned deferred;	/* count of deferrals of the pending push */
+	uint64_t due;		/* commit time in ns of the fix of the deferred push */
 	int id;			/* id of the event for unsubscribe */
+	int listeners;		/* count of the subscriptions not unsubscribed */
 };
 
 /*
@@ -117,41 +243,330 @@ static const char * const type_NAMES[type_COUNT] = {
 	"WGS84",
 	"DMS.km/h",
 	"DMS.mph",
-	"DMS.kn"
+	"DMS.kn",
+	"FUSED"
+};
+
+/*
+ * names of the fields
+ */
+static const char * const field_NAMES[field_COUNT] = {
+	"time",
+	"latitude",
+	"longitude",
+	"altitude",
+	"speed",
+	"track"
+};
+
+/*
+ * names of the priority classes
+ */
+static const char * const priority_NAMES[priority_COUNT] = {
+	"high",
+	"normal",
+	"low"
+};
+
+/*
+ * a fix whose fields can be decoded lazily
+ *
+ * the fields not decoded are pending: their text is recorded
+ * in text at offsets and decoded by fix_decode when needed
+ */
+struct fix {
+	struct afb_gps_data gps;	/* the decoded fields */
+	unsigned pending;		/* mask of the fields not yet decoded */
+	unsigned south: 1;		/* is the pending latitude south? */
+	unsigned west: 1;		/* is the pending longitude west? */
+	unsigned reckoned: 1;		/* is the fix dead-reckoned? */
+	double hdop;			/* horizontal dilution of precision or 0 if unknown */
+	unsigned char quality;		/* fix quality of GGA or 0 if unknown */
+	double accuracy;		/* estimated accuracy in m of reckoned fixes */
+	uint32_t seq;			/* sequence number of the committed fix or 0 */
+	unsigned char offsets[field_COUNT];	/* offsets of the pending texts */
+	char text[96];			/* texts of the pending fields, must be last */
+};
+
+/*
+ * the sources of NMEA streams
+ */
+struct source {
+	char *host;		/* host of the stream */
+	char *service;		/* service (or port) of the stream */
+	int index;		/* index of the source */
+	int fd;			/* file descriptor of the stream or -1 */
+	int pos;		/* length of the current line */
+	int overflow;		/* is the current line too long? */
+	char buffer[160];	/* the current line */
+	int lost;		/* was the stream lost by the real-time thread? */
+	uint64_t stamp;		/* stamp of the last fix or 0, protected by fix_lock */
+	struct fix fix;		/* the sentences of the last epoch merged, protected by fix_lock */
+	int open;		/* is the last epoch not yet closed? protected by fix_lock */
+};
+
+/*
+ * the JSON objects built for sending the positions of a fix
+ */
+struct cache {
+	struct json_object *time_ms;		/* time as double in millisecond */
+	struct json_object *latitude_wgs;	/* latitude as double in degree */
+	struct json_object *longitude_wgs;	/* longitude as double in degree */
+	struct json_object *latitude_dms;	/* latitude as string in d°m's.s"X */
+	struct json_object *longitude_dms;	/* longitude as string in d°m's.s"X */
+	struct json_object *altitude_m;		/* altitude as double in meter */
+	struct json_object *speed_ms;		/* speed as double in m/s */
+	struct json_object *speed_kmh;		/* speed as double in km/h */
+	struct json_object *speed_mph;		/* speed as double in mph */
+	struct json_object *speed_kn;		/* speed as double in kn */
+	struct json_object *track_d;		/* heading track as double in degree */
+	struct json_object *positions[type_COUNT];	/* computed positions by type */
+};
+
+/*
+ * records the last committed fix
+ *
+ * it is written by the input path that runs in the event loop.
+ * the verbs, that can run concurrently in any thread, read it
+ * by copying it under the lock: the copy is an immutable
+ * snapshot of the fix.
+ */
+static struct fix last_fix;		/* the last fix */
+static uint32_t fix_generation;		/* incremented on each commit, read without lock atomically */
+static uint64_t fix_nanos;		/* monotonic time in ns of the last commit, read atomically */
+static pthread_mutex_t fix_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * records the history of the fixes
+ *
+ * it is a ring of the last committed epochs, allocated at init,
+ * ordered by their time since the epoch and protected by fix_lock.
+ * the fixes of the same time, the sentences of an epoch, are merged
+ * in one record that keeps the sequence numbers of its first and last
+ * fixes.
+ */
+struct record {
+	uint64_t stamp;		/* time of the fix in ms since the epoch */
+	uint32_t first;		/* sequence number of the first fix merged */
+	struct fix fix;		/* the fix, of the sequence number of the last one */
 };
+static struct record *history;		/* the ring of records */
+static unsigned history_size;		/* size of the ring */
+static unsigned history_first;		/* index of the oldest record */
+static unsigned history_count;		/* count of records */
 
 /*
- * the interface to afb-daemon
+ * records the fix fusing the last epochs of the sources
+ * computed on need once per closed epoch and protected by fix_lock
+ */
+static struct fix fused_fix;		/* the fused fix */
+static uint32_t fused_epochs;		/* count of the epochs closed by the sources */
+static uint32_t fused_epoch;		/* count of the epochs closed of the fused fix */
+
+/*
+ * records the JSON objects for publishing positions
+ *
+ * these are only used by the event loop
  */
-const struct afb_binding_interface *afbitf;
+static struct fix publish_fix;		/* copy of the last fix being published */
+static struct cache publish_cache;	/* objects for the last fix */
+static struct fix publish_fused;		/* copy of the fused fix being published */
+static struct cache publish_fused_cache;	/* objects for the fused fix */
+static int publish_fused_ready;		/* is publish_fused copied? */
+static uint32_t published_generation;	/* generation of the last published fix */
+static uint64_t push_budget;		/* time in ns for pushing before deferring, 0 for ever */
+static int publish_pending;		/* are pushes deferred? */
+static sd_event_source *publish_timer;	/* timer pushing the deferred events */
 
 /*
- * records the raw frames
+ * sampling of debug messages emitted for each sentence
+ *
+ * each site of messages is sampled on its own, so that
+ * the messages of a site don't hide those of the others
  */
-static struct gps frames[10];	/* a short memory for further computation if needed */
-static int frameidx;		/* index of the last frame (frames are in the reverse order) */
-static int newframes;		/* boolean indication of wether new frames are availables */
+enum log_site {
+	log_site_sentence,	/* the fields of the sentences */
+	log_site_position,	/* the building of the positions */
+	log_site_COUNT
+};
+static unsigned log_sampling = DEFAULT_LOG_SAMPLING;	/* one message logged every log_sampling */
+static __thread unsigned log_countdowns[log_site_COUNT];	/* count of messages to skip per site */
+static __thread int log_muted;		/* is the thread never logging the sampled messages? */
 
 /*
- * records the JSON object for sending positions
+ * the decoders of proprietary sentences registered by plugins
  */
-static struct json_object *time_ms;		/* time as double in millisecond */
-static struct json_object *latitude_wgs;	/* latitude as double in degree */
-static struct json_object *longitude_wgs;	/* longitude as double in degree */
-static struct json_object *latitude_dms;	/* latitude as string in d°m's.s"X */
-static struct json_object *longitude_dms;	/* longitude as string in d°m's.s"X */
-static struct json_object *altitude_m;		/* altitude as double in meter */
-static struct json_object *speed_ms;		/* speed as double in m/s */
-static struct json_object *speed_kmh;		/* speed as double in km/h */
-static struct json_object *speed_mph;		/* speed as double in mph */
-static struct json_object *speed_kn;		/* speed as double in kn */
-static struct json_object *track_d;		/* heading track as double in degree */
+static struct {
+	const char *id;			/* the prefix of the sentences */
+	size_t length;			/* length of the id */
+	afb_gps_decoder_t decode;	/* the decoder */
+} plugin_decoders[PLUGIN_DECODERS_MAX];
+static int plugin_decoder_count;
 
-static struct json_object *positions[type_COUNT];	/* computed positions by type */
+/*
+ * the sources
+ */
+static struct source *sources;	/* array of the sources */
+static int source_count;	/* count of sources */
+static int isgpsd;		/* are the sources gpsd daemons? */
 
 /* head of the list of periods */
 static struct period *list_of_periods;
 
+/* lock of the periods, of the events and of their pools */
+static pthread_mutex_t events_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* mask of the fields expected by the events, written with events_lock held */
+static unsigned fields_demand;
+
+/*
+ * the derived events, computed from the fixes and watched by name
+ */
+enum derived {
+	derived_stop,
+	derived_route,
+	derived_COUNT
+};
+static const char * const derived_NAMES[derived_COUNT] = {
+	"stop",
+	"route"
+};
+static struct {
+	struct afb_event event;	/* the event, created at first watch */
+	int watched;		/* is it possibly watched? accessed atomically */
+} derived_events[derived_COUNT];
+
+/*
+ * pool of items of same size
+ *
+ * items are allocated by slabs of SLAB_COUNT items that are
+ * never released: released items are put in a free list
+ * for being recycled. The first field of the items must
+ * be a pointer that is used to link the free items.
+ */
+struct pool {
+	const char *name;	/* name of the pool for reports */
+	void *free;		/* list of the free items */
+	size_t size;		/* size of one item */
+	unsigned inuse;		/* count of items in use */
+	unsigned count;		/* count of allocated items */
+	unsigned max;		/* maximum count of items */
+	unsigned slabs;		/* count of allocated slabs */
+};
+
+/* pools for periods and events */
+static struct pool pool_of_periods = { .name = "periods", .size = sizeof(struct period), .max = DEFAULT_MAX_PERIODS };
+static struct pool pool_of_events = { .name = "events", .size = sizeof(struct event), .max = DEFAULT_MAX_EVENTS };
+
+/*
+ * upper bounds of the buckets of the latency histograms in nanoseconds
+ */
+static const uint64_t histogram_BOUNDS[] = {
+	1000, 2000, 5000, 10000, 20000, 50000, 100000,
+	200000, 500000, 1000000, 2000000, 5000000, 10000000
+};
+#define HISTOGRAM_COUNT  ((int)(sizeof histogram_BOUNDS / sizeof *histogram_BOUNDS) + 1)
+
+/*
+ * histogram of latencies
+ */
+struct histogram {
+	uint64_t buckets[HISTOGRAM_COUNT];	/* counts per bucket, the last is +Inf */
+	uint64_t sum;				/* sum of the latencies in nanoseconds */
+};
+
+/*
+ * the metrics of one thread
+ *
+ * each thread only writes its own metrics, so the hot path
+ * never locks. Reading sums the metrics of all the threads.
+ */
+struct metrics {
+	struct metrics *next;		/* link to the metrics of an other thread */
+	uint64_t bytes;			/* count of bytes read */
+	uint64_t reads;			/* count of reads of the streams */
+	uint64_t overflows;		/* count of too long lines */
+	uint64_t sentences;		/* count of received sentences */
+	uint64_t rejected;		/* count of unknown or invalid sentences */
+	uint64_t fixes;			/* count of committed fixes */
+	uint64_t hits;			/* count of positions found in cache */
+	uint64_t builds;		/* count of positions built */
+	uint64_t wakeups;		/* count of scans of the periods */
+	uint64_t pushes;		/* count of pushed events */
+	uint64_t drops;			/* count of events dropped without listener */
+	uint64_t deferrals;		/* count of pushes deferred by the budget */
+	uint64_t requests;		/* count of verb requests */
+	uint64_t blocks_read;		/* count of blocks of the track read by queries */
+	uint64_t blocks_skipped;	/* count of blocks of the track skipped by queries */
+	struct histogram parse;		/* latencies of parsing a sentence */
+	struct histogram publish;	/* latencies of scanning and pushing the events */
+	struct histogram delivery[priority_COUNT];	/* latencies from the commits to the pushes */
+};
+
+/* the metrics used when allocation fails and head of the list of metrics */
+static struct metrics metrics_fallback;
+static struct metrics *list_of_metrics = &metrics_fallback;
+
+/* the metrics of the current thread */
+static __thread struct metrics *thread_metrics;
+
+/*
+ * get the metrics of the current thread
+ */
+static struct metrics *metrics_get()
+{
+	struct metrics *m;
+
+	m = thread_metrics;
+	if (m == NULL) {
+		m = calloc(1, sizeof *m);
+		if (m == NULL)
+			m = &metrics_fallback;
+		else {
+			m->next = __atomic_load_n(&list_of_metrics, __ATOMIC_RELAXED);
+			while (!__atomic_compare_exchange_n(&list_of_metrics, &m->next, m,
+						0, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+		}
+		thread_metrics = m;
+	}
+	return m;
+}
+
+/*
+ * adds value to the counter written only by the current thread
+ */
+static inline void counter_add(uint64_t *counter, uint64_t value)
+{
+	__atomic_store_n(counter, *counter + value, __ATOMIC_RELAXED);
+}
+
+/*
+ * records the latency in nanoseconds in the histogram
+ */
+static void histogram_add(struct histogram *h, uint64_t latency)
+{
+	int i;
+
+	for (i = 0 ; i < HISTOGRAM_COUNT - 1 && latency > histogram_BOUNDS[i] ; i++);
+	counter_add(&h->buckets[i], 1);
+	counter_add(&h->sum, latency);
+}
+
+/* increment the metric of name */
+#define METRIC_ADD(name,value)  counter_add(&metrics_get()->name, (uint64_t)(value))
+#define METRIC_INC(name)        METRIC_ADD(name,1)
+
+/*
+ * get the monotonic time in nanoseconds
+ */
+static uint64_t nanonow()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
 /***************************************************************************************/
 /***************************************************************************************/
 /**                                                                                   **/
@@ -177,10 +592,11 @@ static struct json_object *new_dms(double a, int islat)
 			pos = 'S';
 		}
 	} else {
-		if (a <= 180)
+		/* the longitudes west are either negative or above 180 */
+		if (a >= 0 && a <= 180)
 			pos = 'E';
 		else {
-			a = 360 - a;
+			a = a < 0 ? -a : 360 - a;
 			pos = 'W';
 		}
 	}
@@ -211,198 +627,514 @@ static void clear(struct json_object **obj)
 }
 
 /*
- * get the last/current position of type
+ * tells whether the per sentence debug message of site must be logged
+ * or not, accordingly to the verbosity and to the sampling
+ */
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+static int log_sampled(enum log_site site)
+{
+	if (afbBindingV2verbosity < LOG_LEVEL_DEBUG || log_muted)
+		return 0;
+	if (log_countdowns[site]) {
+		log_countdowns[site]--;
+		return 0;
+	}
+	log_countdowns[site] = log_sampling - 1;
+	return 1;
+}
+#else
+# define log_sampled(site)  0
+#endif
+
+/*
+ * release the objects of the cache
+ */
+static void cache_clear(struct cache *cache)
+{
+	enum type type;
+
+	clear(&cache->time_ms);
+	clear(&cache->latitude_wgs);
+	clear(&cache->longitude_wgs);
+	clear(&cache->latitude_dms);
+	clear(&cache->longitude_dms);
+	clear(&cache->altitude_m);
+	clear(&cache->speed_ms);
+	clear(&cache->speed_kmh);
+	clear(&cache->speed_mph);
+	clear(&cache->speed_kn);
+	clear(&cache->track_d);
+	for (type = 0 ; type < type_COUNT ; type++)
+		clear(&cache->positions[type]);
+}
+
+/*
+ * get the position of type with the fields for the fix using the cache
  */
-static struct json_object *position(enum type type)
+static struct json_object *position(struct cache *cache, const struct fix *fix, enum type type, unsigned fields)
 {
+	const struct afb_gps_data *g0 = &fix->gps;
 	struct json_object *result;
-	struct gps *g0;
-
-	/* clean on new frame */
-	if (newframes) {
-		clear(&time_ms);
-		clear(&latitude_wgs);
-		clear(&longitude_wgs);
-		clear(&latitude_dms);
-		clear(&longitude_dms);
-		clear(&altitude_m);
-		clear(&speed_ms);
-		clear(&speed_kmh);
-		clear(&speed_mph);
-		clear(&speed_kn);
-		clear(&track_d);
-		clear(&positions[type_wgs84]);
-		clear(&positions[type_dms_kmh]);
-		clear(&positions[type_dms_mph]);
-		clear(&positions[type_dms_kn]);
-		newframes = 0;
-	}
-
-	/* get the result */
-	result = positions[type];
-	if (result == NULL) {
-		DEBUG(afbitf, "building position for type %s", type_NAMES[type]);
-
-		/* should build the result */
-		g0 = &frames[frameidx];
-		result = json_object_new_object();
-		if (result == NULL)
-			return NULL;
-		positions[type] = result;
-
-		/* set the result type */
-		json_object_object_add(result, "type", json_object_new_string(type_NAMES[type]));
-
-		/* build time, altitude and track */
-		if (time_ms == NULL && g0->set.time)
-			time_ms = json_object_new_double (g0->time);
-		addif(result, "time", time_ms);
-		if (altitude_m == NULL && g0->set.altitude)
-			altitude_m = json_object_new_double (g0->altitude);
-		addif(result, "altitude", altitude_m);
-		if (track_d == NULL && g0->set.track)
-			track_d = json_object_new_double (g0->track);
-		addif(result, "track", track_d);
-
-		/* build position */
-		switch (type) {
-		default:
-		case type_wgs84:
-			if (latitude_wgs == NULL && g0->set.latitude)
-				latitude_wgs = json_object_new_double (g0->latitude);
-			addif(result, "latitude", latitude_wgs);
-			if (longitude_wgs == NULL && g0->set.longitude)
-				longitude_wgs = json_object_new_double (g0->longitude);
-			addif(result, "longitude", longitude_wgs);
-			break;
-		case type_dms_kmh:
-		case type_dms_mph:
-		case type_dms_kn:
-			if (latitude_dms == NULL && g0->set.latitude)
-				latitude_dms = new_dms (g0->latitude, 1);
-			addif(result, "latitude", latitude_dms);
-			if (longitude_dms == NULL && g0->set.longitude)
-				longitude_dms = new_dms (g0->longitude, 0);
-			addif(result, "longitude", longitude_dms);
-			break;
+	struct afb_gps_flags set;
+
+	/* get the result, only positions with all fields are cached */
+	result = fields == FIELDS_ALL ? cache->positions[type] : NULL;
+	TRACE(position, (int)type, result != NULL);
+	if (result != NULL) {
+		METRIC_INC(hits);
+		return json_object_get(result);
+	}
+
+	METRIC_INC(builds);
+	if (log_sampled(log_site_position))
+		AFB_DEBUG("building position for type %s", type_NAMES[type]);
+
+	/* should build the result */
+	result = json_object_new_object();
+	if (result == NULL)
+		return NULL;
+	if (fields == FIELDS_ALL)
+		cache->positions[type] = json_object_get(result);
+
+	/* the fields to set */
+	set = g0->set;
+	set.time &= (fields & FIELD_BIT(field_time)) != 0;
+	set.latitude &= (fields & FIELD_BIT(field_latitude)) != 0;
+	set.longitude &= (fields & FIELD_BIT(field_longitude)) != 0;
+	set.altitude &= (fields & FIELD_BIT(field_altitude)) != 0;
+	set.speed &= (fields & FIELD_BIT(field_speed)) != 0;
+	set.track &= (fields & FIELD_BIT(field_track)) != 0;
+
+	/* set the result type and sequence */
+	json_object_object_add(result, "type", json_object_new_string(type_NAMES[type]));
+	if (fix->seq != 0)
+		json_object_object_add(result, "seq", json_object_new_int64(fix->seq));
+
+	/* build time, altitude and track */
+	if (set.time) {
+		if (cache->time_ms == NULL)
+			cache->time_ms = json_object_new_double (g0->time);
+		addif(result, "time", cache->time_ms);
+	}
+	if (set.altitude) {
+		if (cache->altitude_m == NULL)
+			cache->altitude_m = json_object_new_double (g0->altitude);
+		addif(result, "altitude", cache->altitude_m);
+	}
+	if (set.track) {
+		if (cache->track_d == NULL)
+			cache->track_d = json_object_new_double (g0->track);
+		addif(result, "track", cache->track_d);
+	}
+
+	/* build position */
+	switch (type) {
+	default:
+	case type_wgs84:
+		if (set.latitude) {
+			if (cache->latitude_wgs == NULL)
+				cache->latitude_wgs = json_object_new_double (g0->latitude);
+			addif(result, "latitude", cache->latitude_wgs);
+		}
+		if (set.longitude) {
+			if (cache->longitude_wgs == NULL)
+				cache->longitude_wgs = json_object_new_double (g0->longitude);
+			addif(result, "longitude", cache->longitude_wgs);
+		}
+		break;
+	case type_dms_kmh:
+	case type_dms_mph:
+	case type_dms_kn:
+		if (set.latitude) {
+			if (cache->latitude_dms == NULL)
+				cache->latitude_dms = new_dms (g0->latitude, 1);
+			addif(result, "latitude", cache->latitude_dms);
 		}
+		if (set.longitude) {
+			if (cache->longitude_dms == NULL)
+				cache->longitude_dms = new_dms (g0->longitude, 0);
+			addif(result, "longitude", cache->longitude_dms);
+		}
+		break;
+	}
 
-		/* build speed */
+	/* build speed */
+	if (set.speed) {
 		switch (type) {
 		default:
 		case type_wgs84:
-			if (speed_ms == NULL && g0->set.speed)
-				speed_ms = json_object_new_double (g0->speed);
-			addif(result, "speed", speed_ms);
+			if (cache->speed_ms == NULL)
+				cache->speed_ms = json_object_new_double (g0->speed);
+			addif(result, "speed", cache->speed_ms);
 			break;
 		case type_dms_kmh:
-			if (speed_kmh == NULL && g0->set.speed)
-				speed_kmh = json_object_new_double (g0->speed * METER_PER_SECOND_TO_KILOMETER_PER_HOUR);
-			addif(result, "speed", speed_kmh);
+			if (cache->speed_kmh == NULL)
+				cache->speed_kmh = json_object_new_double (g0->speed * METER_PER_SECOND_TO_KILOMETER_PER_HOUR);
+			addif(result, "speed", cache->speed_kmh);
 			break;
 		case type_dms_mph:
-			if (speed_mph == NULL && g0->set.speed)
-				speed_mph = json_object_new_double (g0->speed * METER_PER_SECOND_TO_MILE_PER_HOUR);
-			addif(result, "speed", speed_mph);
+			if (cache->speed_mph == NULL)
+				cache->speed_mph = json_object_new_double (g0->speed * METER_PER_SECOND_TO_MILE_PER_HOUR);
+			addif(result, "speed", cache->speed_mph);
 			break;
 		case type_dms_kn:
-			if (speed_kn == NULL && g0->set.speed)
-				speed_kn = json_object_new_double (g0->speed * METER_PER_SECOND_TO_KNOT);
-			addif(result, "speed", speed_kn);
+			if (cache->speed_kn == NULL)
+				cache->speed_kn = json_object_new_double (g0->speed * METER_PER_SECOND_TO_KNOT);
+			addif(result, "speed", cache->speed_kn);
 			break;
 		}
 	}
 
-	return json_object_get(result);
+
+	/* mark the dead-reckoned positions */
+	if (fix->reckoned) {
+		json_object_object_add(result, "reckoned", json_object_new_boolean(1));
+		json_object_object_add(result, "accuracy", json_object_new_double(fix->accuracy));
+	}
+	return result;
+}
+
+/*
+ * get the mask of the fields that are not set in the fix g
+ */
+static unsigned fields_unset(const struct afb_gps_data *g)
+{
+	unsigned result = 0;
+
+	if (!g->set.time)
+		result |= FIELD_BIT(field_time);
+	if (!g->set.latitude)
+		result |= FIELD_BIT(field_latitude);
+	if (!g->set.longitude)
+		result |= FIELD_BIT(field_longitude);
+	if (!g->set.altitude)
+		result |= FIELD_BIT(field_altitude);
+	if (!g->set.speed)
+		result |= FIELD_BIT(field_speed);
+	if (!g->set.track)
+		result |= FIELD_BIT(field_track);
+	return result;
+}
+
+/*
+ * get the mask of the fields that differ between the fixes g0 and g1
+ */
+static unsigned fields_changed(const struct afb_gps_data *g0, const struct afb_gps_data *g1)
+{
+	unsigned result = 0;
+
+	if (g0->set.time != g1->set.time || g0->time != g1->time)
+		result |= FIELD_BIT(field_time);
+	if (g0->set.latitude != g1->set.latitude || g0->latitude != g1->latitude)
+		result |= FIELD_BIT(field_latitude);
+	if (g0->set.longitude != g1->set.longitude || g0->longitude != g1->longitude)
+		result |= FIELD_BIT(field_longitude);
+	if (g0->set.altitude != g1->set.altitude || g0->altitude != g1->altitude)
+		result |= FIELD_BIT(field_altitude);
+	if (g0->set.speed != g1->set.speed || g0->speed != g1->speed)
+		result |= FIELD_BIT(field_speed);
+	if (g0->set.track != g1->set.track || g0->track != g1->track)
+		result |= FIELD_BIT(field_track);
+	return result;
+}
+
+/*
+ * get in snapshot a copy of the last fix
+ * can be called from any thread
+ * returns the generation of the copied fix
+ */
+static uint32_t fix_snapshot(struct fix *snapshot)
+{
+	uint32_t generation;
+
+	pthread_mutex_lock(&fix_lock);
+	*snapshot = last_fix;
+	generation = fix_generation;
+	pthread_mutex_unlock(&fix_lock);
+	return generation;
 }
 
 /***************************************************************************************/
 /***************************************************************************************/
 /**                                                                                   **/
 /**                                                                                   **/
-/**       SECTION: MANAGING EVENTS                                                    **/
+/**       SECTION: READING CONFIGURATION                                              **/
 /**                                                                                   **/
 /**                                                                                   **/
 /***************************************************************************************/
 /***************************************************************************************/
 /*
- * get the event handler of given id
+ * get the positive floating value of the environment variable
+ * or the default value if not set or invalid
  */
-static struct event *event_of_id(int id)
+static double env_double(const char *envvar, double defval)
 {
-	struct period *p;
-	struct event *e;
+	const char *value;
+	char *end;
+	double result;
 
-	p = list_of_periods;
-	while(p != NULL) {
-		e = p->events;
-		p = p->next;
-		while(e != NULL) {
-			if (e->id == id)
-				return e;
-			e = e->next;
-		}
-	}
-	return NULL;
+	value = getenv(envvar);
+	if (value == NULL)
+		return defval;
+	result = strtod(value, &end);
+	if (end != value && *end == 0 && result >= 0)
+		return result;
+	AFB_ERROR("invalid value %s for %s, using %g", value, envvar, defval);
+	return defval;
 }
 
 /*
- * get the event handler for the type and the period
+ * get the strictly positive value of the environment variable
+ * or the default value if not set or invalid
  */
-static struct event *event_get(enum type type, int period)
+static unsigned env_unsigned(const char *envvar, unsigned defval)
 {
-	static int id;
-	int shift;
-	uint32_t perio;
-	struct period *p, **pp, *np;
-	struct event *e;
-
-	/* normalize the period */
-	period = period <= 100 ? 1 : period > 60000 ? 600 : (period / 100);
-	shift = 0;
-	while((period >> shift) > 31)
-		shift++;
-	perio = (uint32_t)(100 * (((period >> shift) & 31) << shift));
+	const char *value;
+	int result;
 
-	/* search for the period */
-	pp = &list_of_periods;
-	p = *pp;
-	while(p != NULL && p->period < perio) {
-		pp = &p->next;
-		p = *pp;
-	}
+	value = getenv(envvar);
+	if (value == NULL)
+		return defval;
+	result = atoi(value);
+	if (result > 0)
+		return (unsigned)result;
+	AFB_ERROR("invalid value %s for %s, using %u", value, envvar, defval);
+	return defval;
+}
 
-	/* create the period if it misses */
-	if (p == NULL || p->period != perio) {
-		np = calloc(1, sizeof *p);
-		if (np == NULL)
-			return NULL;
-		np->next = p;
-		np->period = perio;
-		*pp = np;
-		p = np;
-	}
+/*
+ * get the positive or null value of the environment variable
+ * or the default value if not set or invalid
+ */
+static unsigned env_count(const char *envvar, unsigned defval)
+{
+	const char *value;
+	char *end;
+	unsigned long result;
 
-	/* search the type */
-	e = p->events;
-	while(e != NULL && e->type != type)
-		e = e->next;
+	value = getenv(envvar);
+	if (value == NULL)
+		return defval;
+	result = strtoul(value, &end, 10);
+	if (end != value && *end == 0 && value[0] != '-' && result <= UINT_MAX)
+		return (unsigned)result;
+	AFB_ERROR("invalid value %s for %s, using %u", value, envvar, defval);
+	return defval;
+}
 
-	/* creates the type if needed */
-	if (e == NULL) {
-		e = calloc(1, sizeof *e);
-		if (e == NULL)
-			return NULL;
+/***************************************************************************************/
+/***************************************************************************************/
+/**                                                                                   **/
+/**                                                                                   **/
+/**       SECTION: MANAGING MEMORY OF POOLS                                           **/
+/**                                                                                   **/
+/**                                                                                   **/
+/***************************************************************************************/
+/***************************************************************************************/
+/*
+ * adds n new items to the free items of the pool
+ * returns 0 or -1 when out of memory
+ */
+static int pool_grow(struct pool *pool, unsigned n)
+{
+	void *item;
+	char *slab;
+	unsigned i;
 
-		e->name = "GPS"; /* TODO */
-		e->event = afb_daemon_make_event(afbitf->daemon, e->name);
-		if (e->event.itf == NULL) {
-			free(e);
+	slab = malloc(n * pool->size);
+	if (slab == NULL)
+		return -1;
+	pool->count += n;
+	pool->slabs++;
+	for (i = n ; i ; ) {
+		item = &slab[--i * pool->size];
+		*(void**)item = pool->free;
+		pool->free = item;
+	}
+	return 0;
+}
+
+/*
+ * allocates now all the items that the pool can have
+ * returns 0 or -1 when out of memory
+ */
+static int pool_reserve(struct pool *pool)
+{
+	unsigned n;
+
+	n = pool->max - pool->count;
+	return n == 0 ? 0 : pool_grow(pool, n);
+}
+
+/*
+ * get a zeroed item from the pool or NULL if the pool is exhausted
+ */
+static void *pool_get(struct pool *pool)
+{
+	void *item;
+	unsigned n;
+
+	/* allocates a new slab if no item is free */
+	if (pool->free == NULL) {
+		n = pool->max - pool->count;
+		if (n == 0)
+			return NULL;
+		if (n > SLAB_COUNT)
+			n = SLAB_COUNT;
+		if (pool_grow(pool, n) < 0)
+			return NULL;
+	}
+
+	/* get the first free item */
+	item = pool->free;
+	pool->free = *(void**)item;
+	pool->inuse++;
+	return memset(item, 0, pool->size);
+}
+
+/*
+ * put the item back to the pool for recycling it
+ */
+static void pool_put(struct pool *pool, void *item)
+{
+	*(void**)item = pool->free;
+	pool->free = item;
+	pool->inuse--;
+}
+
+/*
+ * get the JSON report of the memory used by the pool
+ */
+static struct json_object *pool_report(struct pool *pool)
+{
+	struct json_object *result;
+
+	result = json_object_new_object();
+	json_object_object_add(result, "inuse", json_object_new_int((int)pool->inuse));
+	json_object_object_add(result, "free", json_object_new_int((int)(pool->count - pool->inuse)));
+	json_object_object_add(result, "max", json_object_new_int((int)pool->max));
+	json_object_object_add(result, "slabs", json_object_new_int((int)pool->slabs));
+	json_object_object_add(result, "bytes", json_object_new_int64((int64_t)(pool->count * pool->size)));
+	return result;
+}
+
+/***************************************************************************************/
+/***************************************************************************************/
+/**                                                                                   **/
+/**                                                                                   **/
+/**       SECTION: MANAGING EVENTS                                                    **/
+/**                                                                                   **/
+/**                                                                                   **/
+/***************************************************************************************/
+/***************************************************************************************/
+/*
+ * get the event handler of given id
+ * must be called with events_lock held
+ */
+static struct event *event_of_id(int id)
+{
+	struct period *p;
+	struct event *e;
+
+	p = list_of_periods;
+	while(p != NULL) {
+		e = p->events;
+		p = p->next;
+		while(e != NULL) {
+			if (e->id == id)
+				return e;
+			e = e->next;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * recomputes the mask of the fields expected by the events
+ * must be called with events_lock held
+ */
+static void fields_demand_update()
+{
+	struct period *p;
+	struct event *e;
+	unsigned demand;
+
+	demand = 0;
+	for (p = list_of_periods ; p != NULL ; p = p->next)
+		for (e = p->events ; e != NULL ; e = e->next)
+			demand |= e->fields;
+	__atomic_store_n(&fields_demand, demand, __ATOMIC_RELAXED);
+}
+
+/*
+ * get the normalized period in ms of the period in ms
+ */
+static uint32_t period_normal(int period)
+{
+	int shift;
+
+	period = period <= 100 ? 1 : period > 60000 ? 600 : (period / 100);
+	shift = 0;
+	while((period >> shift) > 31)
+		shift++;
+	return (uint32_t)(100 * (((period >> shift) & 31) << shift));
+}
+
+/*
+ * get the event handler for the type, the fields, the keyframe, the priority
+ * and the normalized period perio, searching the period from the link pp
+ * and updating it to the link of the period for searching greater periods
+ * must be called with events_lock held
+ */
+static struct event *event_get_from(struct period ***pp, enum type type, unsigned fields, unsigned keyframe, enum priority priority, uint32_t perio)
+{
+	static int id;
+	struct period *p, *np;
+	struct event *e;
+
+	/* search for the period */
+	p = **pp;
+	while(p != NULL && p->period < perio) {
+		*pp = &p->next;
+		p = **pp;
+	}
+
+	/* create the period if it misses */
+	if (p == NULL || p->period != perio) {
+		np = pool_get(&pool_of_periods);
+		if (np == NULL)
+			return NULL;
+		np->next = p;
+		np->period = perio;
+		**pp = np;
+		p = np;
+	}
+
+	/* search the type, the fields, the keyframe and the priority */
+	e = p->events;
+	while(e != NULL && (e->type != type || e->fields != fields || e->keyframe != keyframe || e->priority != priority))
+		e = e->next;
+
+	/* creates the type if needed */
+	if (e == NULL) {
+		e = pool_get(&pool_of_events);
+		if (e == NULL)
+			return NULL;
+
+		e->name = "GPS"; /* TODO */
+		e->event = afb_daemon_make_event(e->name);
+		if (!afb_event_is_valid(e->event)) {
+			pool_put(&pool_of_events, e);
 			return NULL;
 		}
 
 		e->next = p->events;
 		e->type = type;
+		e->fields = fields;
+		e->keyframe = keyframe;
+		e->priority = priority;
+		e->deferred = 0;
+		e->listeners = 0;
 		do {
 			id++;
 			if (id < 0)
@@ -410,542 +1142,4445 @@ static struct event *event_get(enum type type, int period)
 		} while(event_of_id(id) != NULL);
 		e->id = id;
 		p->events = e;
+		__atomic_store_n(&fields_demand, fields_demand | fields, __ATOMIC_RELAXED);
 	}
 
 	return e;
 }
 
+/*
+ * accounts the unsubscription of a listener of the event, freeing the
+ * event when it was the last one without waiting its next push
+ * must be called with events_lock held
+ * returns 1 if the event was freed or 0 otherwise
+ */
+static int event_unlisten(struct event *event)
+{
+	struct period *p;
+	struct event **pe;
+
+	if (--event->listeners > 0)
+		return 0;
+	for (p = list_of_periods ; p != NULL ; p = p->next)
+		for (pe = &p->events ; *pe != NULL ; pe = &(*pe)->next)
+			if (*pe == event) {
+				METRIC_INC(drops);
+				*pe = event->next;
+				afb_event_drop(event->event);
+				pool_put(&pool_of_events, event);
+				return 1;
+			}
+	return 0;
+}
+
+/* declare the lazy decoding of the fixes */
+static void fix_decode(struct fix *fix, unsigned fields);
+
+/* declare the merge of the fixes of an epoch */
+static void fix_merge(struct fix *into, const struct fix *fix);
+
+/* declare the copy of the fused fix */
+static void fused_snapshot(struct fix *snapshot);
+
+/* declare the computation of the derived events */
+static void derive(struct fix *fix);
+
+/* declare the counting of the tiles */
+static void tiles_update(struct fix *fix);
+
+/*
+ * get the payload of the event for the fix gps
+ *
+ * the delta events only receive the fields changed since their
+ * previous push, except for keyframes that have all the fields
+ */
+static struct json_object *event_payload(struct event *e, const struct fix *fix)
+{
+	unsigned fields, lost;
+	enum field field;
+	struct cache *cache;
+	struct json_object *result;
+
+	/* the fused events have their own fix */
+	cache = &publish_cache;
+	if (e->type == type_fused) {
+		if (!publish_fused_ready) {
+			fused_snapshot(&publish_fused);
+			publish_fused_ready = 1;
+		}
+		fix = &publish_fused;
+		cache = &publish_fused_cache;
+	}
+
+	fields = e->fields;
+	lost = 0;
+	if (e->keyframe != 0) {
+		if (e->countdown == 0)
+			e->countdown = e->keyframe;
+		else {
+			/* the changed fields that became unknown are sent as null */
+			fields &= fields_changed(&e->sent, &fix->gps);
+			lost = fields & fields_unset(&fix->gps);
+			fields &= ~lost;
+		}
+		e->countdown--;
+		e->sent = fix->gps;
+	}
+	result = position(cache, fix, e->type, fields);
+	for (field = 0 ; lost != 0 && result != NULL && field < field_COUNT ; field++)
+		if (lost & FIELD_BIT(field))
+			json_object_object_add(result, field_NAMES[field], NULL);
+	return result;
+}
+
+/* declare the sending of the events */
+static void event_send();
+
+/*
+ * callback of the timer pushing the deferred events
+ */
+static int event_on_timer(sd_event_source *s, uint64_t usec, void *userdata)
+{
+	event_send();
+	return 0;
+}
+
+/*
+ * arms the timer for pushing the deferred events after one budget
+ * when no new fix comes before
+ */
+static void event_defer()
+{
+	sd_event *loop;
+	uint64_t usec;
+
+	loop = afb_daemon_get_event_loop();
+	sd_event_now(loop, CLOCK_MONOTONIC, &usec);
+	usec += push_budget / 1000;
+	if (publish_timer == NULL) {
+		if (sd_event_add_time(loop, &publish_timer, CLOCK_MONOTONIC, usec, 0, event_on_timer, NULL) < 0) {
+			publish_timer = NULL;
+			return;
+		}
+	} else
+		sd_event_source_set_time(publish_timer, usec);
+	sd_event_source_set_enabled(publish_timer, SD_EVENT_ONESHOT);
+}
+
 /*
  * Sends the events if needed
+ *
+ * the events of the refreshed periods are pushed by priority class.
+ * when the pushes last more than push_budget, the events of the classes
+ * other than high are deferred: they are pushed with the next fix, even
+ * if their period is not refreshed, coalescing the two fixes, or after
+ * one budget without new fix. a push deferred MAX_DEFERRALS times is done
+ * whatever the budget, so that the events late in the lists don't starve.
  */
 static void event_send()
 {
 	struct period *p, **pp;
 	struct event *e, **pe;
 	struct timeval tv;
+	enum priority prio;
 	uint32_t now;
+	uint64_t start, commit;
+	int fresh, dropped, listened;
 
-	/* skip if nothing is new */
-	if (!newframes)
+	/* skip if nothing is new nor deferred */
+	fresh = published_generation != __atomic_load_n(&fix_generation, __ATOMIC_RELAXED);
+	if (!fresh && !publish_pending)
 		return;
+	start = nanonow();
+	METRIC_INC(wakeups);
+
+	/* forget the objects of the previous fix */
+	if (fresh) {
+		cache_clear(&publish_cache);
+		cache_clear(&publish_fused_cache);
+		publish_fused_ready = 0;
+		published_generation = fix_snapshot(&publish_fix);
+		derive(&publish_fix);
+		tiles_update(&publish_fix);
+	}
+	commit = __atomic_load_n(&fix_nanos, __ATOMIC_RELAXED);
+	publish_pending = 0;
+	dropped = 0;
 
 	/* computes now */
 	gettimeofday(&tv, NULL);
 	now = (uint32_t)(tv.tv_sec * 1000) + (uint32_t)(tv.tv_usec / 1000);
 
-	/* iterates over the periods */
+	/* marks the periods to refresh */
+	pthread_mutex_lock(&events_lock);
 	pp = &list_of_periods;
 	p = *pp;
 	while (p != NULL) {
 		if (p->events == NULL) {
 			/* no event for the period, frees it */
 			*pp = p->next;
-			free(p);
+			pool_put(&pool_of_periods, p);
 		} else {
-			if (p->period <= now - p->last) {
-				/* its time to refresh */
+			p->due = fresh && p->period <= now - p->last;
+			if (p->due)
 				p->last = now;
-				pe = &p->events;
-				e = *pe;
-				while (e != NULL) {
+			pp = &p->next;
+		}
+		p = *pp;
+	}
+
+	/* pushes the events by priority */
+	for (prio = 0 ; prio < priority_COUNT ; prio++) {
+		for (p = list_of_periods ; p != NULL ; p = p->next) {
+			pe = &p->events;
+			e = *pe;
+			while (e != NULL) {
+				if (e->priority != prio || (!p->due && !e->deferred))
+					pe = &e->next;
+				else if (prio != priority_high && push_budget && e->deferred < MAX_DEFERRALS
+						&& nanonow() - start > push_budget) {
+					/* over budget, pushed with the next fix */
+					METRIC_INC(deferrals);
+					if (!e->deferred)
+						e->due = commit;
+					e->deferred++;
+					publish_pending = 1;
+					pe = &e->next;
+				} else {
 					/* sends the event */
-					if (afb_event_push(e->event, position(e->type)) != 0)
+					TRACE(push, e->id, (int)e->type, p->period);
+					METRIC_INC(pushes);
+					fix_decode(&publish_fix, e->fields);
+					listened = afb_event_push(e->event, event_payload(e, &publish_fix)) != 0;
+					histogram_add(&metrics_get()->delivery[prio], nanonow() - (e->deferred ? e->due : commit));
+					e->deferred = 0;
+					if (listened)
 						pe = &e->next;
 					else {
 						/* no more listeners, free the event */
+						METRIC_INC(drops);
 						*pe = e->next;
 						afb_event_drop(e->event);
-						free(e);
+						pool_put(&pool_of_events, e);
+						dropped = 1;
 					}
-					e = *pe;
 				}
+				e = *pe;
 			}
-			pp = &p->next;
 		}
-		p = *pp;
 	}
+	if (dropped)
+		fields_demand_update();
+	pthread_mutex_unlock(&events_lock);
+	if (publish_pending)
+		event_defer();
+	histogram_add(&metrics_get()->publish, nanonow() - start);
 }
 
 /***************************************************************************************/
 /***************************************************************************************/
 /**                                                                                   **/
 /**                                                                                   **/
-/**       SECTION: HANDLING NMEA                                                      **/
+/**       SECTION: RECORDING HISTORY                                                  **/
 /**                                                                                   **/
 /**                                                                                   **/
 /***************************************************************************************/
 /***************************************************************************************/
 /*
- * interprets a nmea time
+ * allocates the history for size epochs, none if size is 0
  */
-static int nmea_time(const char *text, uint32_t *result)
+static int history_init(unsigned size)
 {
-	uint32_t x;
-
-	if (text[0] < '0' || text[0] > '2'
-	 || text[1] < '0' || text[1] > (text[0] == '2' ? '3' : '9')
-	 || text[2] < '0' || text[2] > '5'
-	 || text[3] < '0' || text[3] > '9'
-	 || text[4] < '0' || text[4] > '5'
-	 || text[5] < '0' || text[5] > '9'
-	 || (text[6] != 0 && text[6] != '.'))
+	if (size == 0) {
+		history = NULL;
+		history_size = 0;
 		return 0;
-
-	x = (uint32_t)(text[0] - '0');
-	x = x * 10 + (uint32_t)(text[1]-'0');
-	x = x *  6 + (uint32_t)(text[2]-'0');
-	x = x * 10 + (uint32_t)(text[3]-'0');
-	x = x *  6 + (uint32_t)(text[4]-'0');
-	x = x * 10 + (uint32_t)(text[5]-'0');
-	x = x * 1000;
-	if (text[6] == '.') {
-		if (text[7] != 0) {
-			if (text[7] < '0' || text[7] > '9') return 0;
-			x += (uint32_t)(text[7]-'0') * 100;
-			if (text[8] != 0) {
-				if (text[8] < '0' || text[8] > '9') return 0;
-				x += (uint32_t)(text[8]-'0') * 10;
-				if (text[9] != 0) {
-					if (text[9] < '0' || text[9] > '9') return 0;
-					x += (uint32_t)(text[9]-'0');
-					if (text[10] != 0) {
-						if (text[10] < '0' || text[10] > '9') return 0;
-						x += text[10] > '5';
-					}
-				}
-			}
-		}
 	}
-
-	*result = x;
-	return 1;
+	history = calloc(size, sizeof *history);
+	if (history == NULL) {
+		AFB_ERROR("out of memory for the history of %u epochs", size);
+		return -1;
+	}
+	history_size = size;
+	return 0;
 }
 
 /*
- * interprets a nmea angle having minutes
+ * computes the time since the epoch in ms of the fix
+ * from the date of the system and the time of the day of the fix,
+ * taking the nearest day to cope with midnight
  */
-static int nmea_angle(const char *text, double *result)
+static uint64_t history_stamp(const struct afb_gps_data *gps)
 {
-	uint32_t x = 0;
-	double v;
-	int dotidx = (int)(strchrnul(text, '.') - text);
-
-	switch(dotidx) {
-	case 5:
-		if (text[dotidx - 5] < '0' || text[dotidx - 5] > '9')
-			return 0;
-		x = x * 10 + (uint32_t)(text[dotidx - 5] - '0');
-	case 4:
-		if (text[dotidx - 4] < '0' || text[dotidx - 4] > '9')
-			return 0;
-		x = x * 10 + (uint32_t)(text[dotidx - 4] - '0');
-	case 3:
-		if (text[dotidx - 3] < '0' || text[dotidx - 3] > '9')
-			return 0;
-		x = x * 10 + (uint32_t)(text[dotidx - 3] - '0');
-	case 2:
-		v = atof(&text[dotidx - 2]);
-		break;
-	case 1:
-		if (text[dotidx - 1] < '0' || text[dotidx - 1] > '9')
-			return 0;
-	case 0:
-		v = atof(text);
-		break;
-	default:
-		return 0;
-	}
+	struct timespec ts;
+	uint64_t now, stamp;
 
-	*result = (double)x + v * 0.01666666666666666666666; /* 1 / 60 */
+	clock_gettime(CLOCK_REALTIME, &ts);
+	now = (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+	if (!gps->set.time)
+		return now;
 
-	return 1;
+	stamp = now - now % MILLISECOND_PER_DAY + gps->time;
+	if (stamp > now + MILLISECOND_PER_DAY / 2)
+		stamp -= MILLISECOND_PER_DAY;
+	else if (stamp + MILLISECOND_PER_DAY / 2 < now)
+		stamp += MILLISECOND_PER_DAY;
+	return stamp;
 }
 
 /*
- * creates a new position for the given optionnal fields
- * returns 1 if correct or 0 if a format error exists
+ * get the record of index in the history
  */
-static int nmea_set(
-		const char *tim,
-		const char *lat, const char *latu,
-		const char *lon, const char *lonu,
-		const char *alt, const char *altu,
-		const char *spe,
-		const char *tra,
-		const char *dat
-)
+static inline struct record *history_at(unsigned index)
 {
-	struct gps gps;
+	return &history[(history_first + index) % history_size];
+}
 
-	DEBUG(afbitf, "time=%s latitude=%s%s longitude=%s%s altitude=%s%s speed=%s track=%s date=%s",
-		tim, lat, latu, lon, lonu, alt, altu, spe, tra, dat);
+/*
+ * adds the fix of stamp to the history
+ * a fix of the same stamp as the newest is merged in it
+ * and a fix older than the newest is ignored
+ * must be called with fix_lock held
+ */
+static void history_add(const struct fix *fix, uint64_t stamp)
+{
+	struct record *r;
 
-	/* get the time in milliseconds */
-	if (tim == NULL)
-		gps.set.time = 0;
+	if (history_count > 0) {
+		r = history_at(history_count - 1);
+		if (stamp < r->stamp)
+			return;
+		if (stamp == r->stamp) {
+			fix_merge(&r->fix, fix);
+			return;
+		}
+	}
+	if (history_count < history_size)
+		r = history_at(history_count++);
 	else {
-		if (!nmea_time(tim, &gps.time))
-			return 0;
-		gps.set.time = 1;
+		r = history_at(0);
+		history_first = (history_first + 1) % history_size;
 	}
+	r->stamp = stamp;
+	r->first = fix->seq;
+	r->fix = *fix;
+}
 
-	/* get the latitude */
-	if (lat == NULL || latu == NULL)
-		gps.set.latitude = 0;
-	else {
-		if ((latu[0] != 'N' && latu[0] != 'S') || latu[1] != 0)
-			return 0;
-		if (!nmea_angle(lat, &gps.latitude))
-			return 0;
-		if (latu[0] == 'S')
-			gps.latitude = -gps.latitude;
-		gps.set.latitude = 1;
+/*
+ * get the index of the first record stamped from stamp
+ * must be called with fix_lock held
+ */
+static unsigned history_search(uint64_t stamp)
+{
+	unsigned low, high, mid;
+
+	low = 0;
+	high = history_count;
+	while (low < high) {
+		mid = (low + high) / 2;
+		if (history_at(mid)->stamp < stamp)
+			low = mid + 1;
+		else
+			high = mid;
 	}
+	return low;
+}
 
-	/* get the longitude */
-	if (lon == NULL || lonu == NULL)
-		gps.set.longitude = 0;
-	else {
-		if ((lonu[0] != 'E' && lonu[0] != 'W') || lonu[1] != 0)
-			return 0;
-		if (!nmea_angle(lon, &gps.longitude))
-			return 0;
-		if (lonu[0] == 'W')
-			gps.longitude = 360.0 - gps.longitude;
-		gps.set.longitude = 1;
+/*
+ * get the index of the first record of sequence greater than since
+ * must be called with fix_lock held
+ */
+static unsigned history_search_seq(uint32_t since)
+{
+	unsigned low, high, mid;
+
+	low = 0;
+	high = history_count;
+	while (low < high) {
+		mid = (low + high) / 2;
+		if (history_at(mid)->fix.seq <= since)
+			low = mid + 1;
+		else
+			high = mid;
 	}
+	return low;
+}
 
-	/* get the altitude */
-	if (alt == NULL || altu == NULL)
-		gps.set.altitude = 0;
-	else {
-		if (altu[0] != 'M' || altu[1] != 0)
-			return 0;
-		gps.altitude = atof(alt);
-		gps.set.altitude = 1;
+/*
+ * get in before and after the records surrounding stamp
+ * can be called from any thread
+ * returns 1 if found or 0 if stamp is out of the history
+ */
+static int history_find(uint64_t stamp, struct record *before, struct record *after)
+{
+	unsigned low;
+	int found;
+
+	pthread_mutex_lock(&fix_lock);
+	low = history_search(stamp);
+	found = low < history_count && (low > 0 || history_at(low)->stamp == stamp);
+	if (found) {
+		*after = *history_at(low);
+		*before = after->stamp == stamp ? *after : *history_at(low - 1);
 	}
+	pthread_mutex_unlock(&fix_lock);
+	return found;
+}
 
-	/* get the speed */
-	if (spe == NULL)
-		gps.set.speed = 0;
-	else {
-		gps.speed = atof(spe) * KNOT_TO_METER_PER_SECOND;
-		gps.set.speed = 1;
+/*
+ * get the copies of the records of the fixes of sequence greater than since
+ * the count of records is stored in count and complete tells whether
+ * no fix after since is missing from the history, that is false when
+ * fixes were dropped or are no more in the history but also when since
+ * is after the last fix, given by a client of a previous run
+ * the records are copied by chunks of HISTORY_CHUNK, not to hold
+ * fix_lock long, up to the count of the first hold
+ * can be called from any thread
+ * returns the array of the records to be freed or NULL
+ */
+static struct record *history_since(uint32_t since, unsigned *count, int *complete)
+{
+	unsigned low, total, i;
+	uint32_t generation, next;
+	struct record *result;
+
+	pthread_mutex_lock(&fix_lock);
+	total = history_count - history_search_seq(since);
+	generation = fix_generation;
+	pthread_mutex_unlock(&fix_lock);
+
+	*count = 0;
+	*complete = 0;
+	result = malloc((total ? total : 1) * sizeof *result);
+	if (result == NULL)
+		return NULL;
+	while (*count < total) {
+		pthread_mutex_lock(&fix_lock);
+		if (*count > 0)
+			low = history_search(result[*count - 1].stamp + 1);
+		else
+			low = history_search_seq(since);
+		for (i = 0 ; i < HISTORY_CHUNK && *count < total && low + i < history_count ; i++)
+			result[(*count)++] = *history_at(low + i);
+		pthread_mutex_unlock(&fix_lock);
+		if (i == 0)
+			break;
 	}
 
-	/* get the track */
-	if (tra != NULL)
-		gps.set.track = 0;
-	else {
-		gps.track = atof(tra);
-		gps.set.track = 1;
+	/* the records merge the fixes of their sequence range */
+	next = since + 1;
+	for (i = 0 ; i < *count ; i++)
+		if (result[i].first <= next && next <= result[i].fix.seq)
+			next = result[i].fix.seq + 1;
+	*complete = since <= generation && next > generation;
+	return result;
+}
+
+/*
+ * copies in records at most max records stamped from 'from' to 'to' included
+ * can be called from any thread
+ * returns the count of records copied
+ */
+static unsigned history_between(uint64_t from, uint64_t to, struct record *records, unsigned max)
+{
+	unsigned low, i;
+
+	pthread_mutex_lock(&fix_lock);
+	low = history_search(from);
+	for (i = 0 ; i < max && low + i < history_count && history_at(low + i)->stamp <= to ; i++)
+		records[i] = *history_at(low + i);
+	pthread_mutex_unlock(&fix_lock);
+	return i;
+}
+
+/*
+ * get the difference of the angles in degree from a0 to a1 in [-180, 180]
+ */
+static double angle_delta(double a0, double a1)
+{
+	double d = a1 - a0;
+	return d > 180.0 ? d - 360.0 : d < -180.0 ? d + 360.0 : d;
+}
+
+/*
+ * get the angle in degree normalized in [0, 360[
+ */
+static double angle_normal(double a)
+{
+	a = fmod(a, 360.0);
+	return a < 0 ? a + 360.0 : a;
+}
+
+/*
+ * interpolates in result the fixes of the records r0 and r1 at stamp
+ *
+ * the position is interpolated linearly or, if hermite is set and the
+ * speeds and tracks are known, with a cubic Hermite spline whose
+ * tangents are the velocities. the fixes must be decoded.
+ */
+static void history_interpolate(const struct record *r0, const struct record *r1,
+				uint64_t stamp, int hermite, struct afb_gps_data *result)
+{
+	const struct afb_gps_data *g0 = &r0->fix.gps, *g1 = &r1->fix.gps;
+	double u, dt, u2, u3, h01, h10, h11, dlon, t0lat, t0lon, t1lat, t1lon, c0, c1;
+
+	memset(result, 0, sizeof *result);
+	result->set.time = 1;
+	result->time = (uint32_t)(stamp % MILLISECOND_PER_DAY);
+
+	/* the interval in seconds and the position in it */
+	dt = (double)(r1->stamp - r0->stamp) * 0.001;
+	u = r1->stamp == r0->stamp ? 0 : (double)(stamp - r0->stamp) * 0.001 / dt;
+
+	/* altitude, speed and track are linear */
+	if (g0->set.altitude && g1->set.altitude) {
+		result->altitude = g0->altitude + u * (g1->altitude - g0->altitude);
+		result->set.altitude = 1;
+	}
+	if (g0->set.speed && g1->set.speed) {
+		result->speed = g0->speed + u * (g1->speed - g0->speed);
+		result->set.speed = 1;
+	}
+	if (g0->set.track && g1->set.track) {
+		result->track = angle_normal(g0->track + u * angle_delta(g0->track, g1->track));
+		result->set.track = 1;
 	}
 
-	/* push the frame */
-	frameidx = (frameidx ? : (int)(sizeof frames / sizeof *frames)) - 1; 
-	frames[frameidx] = gps;
-	newframes++;
+	/* the position */
+	if (!g0->set.latitude || !g1->set.latitude || !g0->set.longitude || !g1->set.longitude)
+		return;
+	result->set.latitude = result->set.longitude = 1;
+	dlon = angle_delta(g0->longitude, g1->longitude);
+	c0 = cos(g0->latitude * RADIAN_PER_DEGREE);
+	c1 = cos(g1->latitude * RADIAN_PER_DEGREE);
+	if (!hermite || !result->set.speed || !result->set.track || c0 < 1e-6 || c1 < 1e-6) {
+		result->latitude = g0->latitude + u * (g1->latitude - g0->latitude);
+		result->longitude = angle_normal(g0->longitude + u * dlon);
+		return;
+	}
 
-	DEBUG(afbitf, "time:%d=%d latitude:%d=%g longitude:%d=%g altitude:%d=%g speed:%d=%g track:%d=%g",
-		(int)gps.set.time, gps.set.time ? (int)gps.time : 0,
-		(int)gps.set.latitude, gps.set.latitude ? gps.latitude : 0,
-		(int)gps.set.longitude, gps.set.longitude ? gps.longitude : 0,
-		(int)gps.set.altitude, gps.set.altitude ? gps.altitude : 0,
-		(int)gps.set.speed, gps.set.speed ? gps.speed : 0,
-		(int)gps.set.track, gps.set.track ? gps.track : 0
-	);
+	/* the tangents are the velocities in degree for the interval */
+	t0lat = g0->speed * cos(g0->track * RADIAN_PER_DEGREE) * dt / METER_PER_DEGREE;
+	t0lon = g0->speed * sin(g0->track * RADIAN_PER_DEGREE) * dt / (METER_PER_DEGREE * c0);
+	t1lat = g1->speed * cos(g1->track * RADIAN_PER_DEGREE) * dt / METER_PER_DEGREE;
+	t1lon = g1->speed * sin(g1->track * RADIAN_PER_DEGREE) * dt / (METER_PER_DEGREE * c1);
 
-	return 1;
+	/* the basis of the spline, h00 being 1 - h01 */
+	u2 = u * u;
+	u3 = u2 * u;
+	h10 = u3 - 2 * u2 + u;
+	h01 = 3 * u2 - 2 * u3;
+	h11 = u3 - u2;
+	result->latitude = g0->latitude + h10 * t0lat + h01 * (g1->latitude - g0->latitude) + h11 * t1lat;
+	result->longitude = angle_normal(g0->longitude + h10 * t0lon + h01 * dlon + h11 * t1lon);
 }
 
+/***************************************************************************************/
+/***************************************************************************************/
+/**                                                                                   **/
+/**                                                                                   **/
+/**       SECTION: FUSING SOURCES                                                     **/
+/**                                                                                   **/
+/**                                                                                   **/
+/***************************************************************************************/
+/***************************************************************************************/
 /*
- * Splits the nmea sentences in its fields
+ * computes in result the fusion of the last fixes of the sources
+ *
+ * the fixes of the sources, the sentences of their last epoch merged,
+ * connected and not older than FUSION_WINDOW
+ * relatively to the newest are averaged with the weights 1 / HDOP².
+ * must be called with fix_lock held
  */
-static int nmea_split(char *s, char *fields[], int count)
+static void fuse(struct fix *result)
 {
-	int index = 0;
-	while (*s && index < count) {
-		fields[index++] = s;
-		while (*s && *s != ',')
-			s++;
-		if (*s == ',')
-			*s++ = 0;
+	int i;
+	uint64_t newest;
+	struct source *src;
+	const struct afb_gps_data *g;
+	double w, wpos, walt, wspe, wtra, lat, lon, alt, spe, sx, sy, lon0;
+
+	memset(result, 0, offsetof(struct fix, text));
+
+	/* get the newest fix */
+	newest = 0;
+	for (i = 0 ; i < source_count ; i++)
+		if (sources[i].stamp > newest)
+			newest = sources[i].stamp;
+
+	/* weighted sums of the healthy fixes */
+	wpos = walt = wspe = wtra = lat = lon = alt = spe = sx = sy = lon0 = 0;
+	for (i = 0 ; i < source_count ; i++) {
+		src = &sources[i];
+		if (src->stamp == 0 || src->stamp + FUSION_WINDOW < newest || src->fd < 0)
+			continue;
+		fix_decode(&src->fix, FIELDS_ALL);
+		g = &src->fix.gps;
+		w = src->fix.hdop > 0 ? src->fix.hdop : DEFAULT_HDOP;
+		w = 1 / (w * w);
+		if (src->stamp == newest && g->set.time) {
+			result->gps.time = g->time;
+			result->gps.set.time = 1;
+		}
+		if (g->set.latitude && g->set.longitude) {
+			/* longitudes are summed relatively to the first one */
+			if (wpos == 0)
+				lon0 = g->longitude;
+			lat += w * g->latitude;
+			lon += w * angle_delta(lon0, g->longitude);
+			wpos += w;
+		}
+		if (g->set.altitude) {
+			alt += w * g->altitude;
+			walt += w;
+		}
+		if (g->set.speed) {
+			spe += w * g->speed;
+			wspe += w;
+		}
+		if (g->set.track) {
+			sx += w * sin(g->track * RADIAN_PER_DEGREE);
+			sy += w * cos(g->track * RADIAN_PER_DEGREE);
+			wtra += w;
+		}
+	}
+
+	/* the weighted averages */
+	if (wpos > 0) {
+		result->gps.latitude = lat / wpos;
+		result->gps.longitude = angle_normal(lon0 + lon / wpos);
+		result->gps.set.latitude = result->gps.set.longitude = 1;
+		result->hdop = 1 / sqrt(wpos);
+	}
+	if (walt > 0) {
+		result->gps.altitude = alt / walt;
+		result->gps.set.altitude = 1;
+	}
+	if (wspe > 0) {
+		result->gps.speed = spe / wspe;
+		result->gps.set.speed = 1;
+	}
+	if (wtra > 0 && (sx != 0 || sy != 0)) {
+		result->gps.track = angle_normal(atan2(sx, sy) / RADIAN_PER_DEGREE);
+		result->gps.set.track = 1;
 	}
-	return !*s && index == count;
 }
 
 /*
- * interprete one sentence GGA - Fix information
+ * computes the fused fix if an epoch was closed since
+ * must be called with fix_lock held
  */
-static int nmea_gga(char *s)
+static void fused_update()
 {
-	char *f[14];
+	if (fused_epoch != fused_epochs) {
+		fuse(&fused_fix);
+		fused_fix.seq = fix_generation;
+		fused_epoch = fused_epochs;
+	}
+}
 
-	return nmea_split(s, f, (int)(sizeof f / sizeof *f))
-		&& *f[5] != '0'
-		&&  nmea_set(f[0], f[1], f[2], f[3], f[4], f[6], f[7], NULL, NULL, NULL);
+/*
+ * get in snapshot a copy of the fused fix
+ * can be called from any thread
+ */
+static void fused_snapshot(struct fix *snapshot)
+{
+	pthread_mutex_lock(&fix_lock);
+	fused_update();
+	*snapshot = fused_fix;
+	pthread_mutex_unlock(&fix_lock);
 }
 
 /*
- * interprete one sentence RMC - Recommended Minimum
+ * get in one hold of fix_lock copies of the last fix in last, of the
+ * fused fix in fused and of the last fixes of the count sources of
+ * indexes in fixes, any of last and fused can be NULL
+ * can be called from any thread
+ * returns the generation of the copied fixes
  */
-static int nmea_rmc(char *s)
+static uint32_t fixes_snapshot(struct fix *last, struct fix *fused, const int *indexes, int count, struct fix *fixes)
 {
-	char *f[12];
+	int i;
+	uint32_t generation;
 
-	return nmea_split(s, f, (int)(sizeof f / sizeof *f))
-		&& *f[1] == 'A'
-		&&  nmea_set(f[0], f[2], f[3], f[4], f[5], NULL, NULL, f[6], f[7], f[8]);
+	pthread_mutex_lock(&fix_lock);
+	if (last != NULL)
+		*last = last_fix;
+	if (fused != NULL) {
+		fused_update();
+		*fused = fused_fix;
+	}
+	for (i = 0 ; i < count ; i++)
+		fixes[i] = sources[indexes[i]].fix;
+	generation = fix_generation;
+	pthread_mutex_unlock(&fix_lock);
+	return generation;
+}
+
+/***************************************************************************************/
+/***************************************************************************************/
+/**                                                                                   **/
+/**                                                                                   **/
+/**       SECTION: DERIVING EVENTS                                                    **/
+/**                                                                                   **/
+/**                                                                                   **/
+/***************************************************************************************/
+/***************************************************************************************/
+/*
+ * pushes the object to the derived event
+ * the event is not computed anymore when nobody watches it
+ */
+static void derived_push(enum derived d, struct json_object *object)
+{
+	if (afb_event_push(derived_events[d].event, object) == 0)
+		__atomic_store_n(&derived_events[d].watched, 0, __ATOMIC_RELAXED);
 }
 
+/*
+ * the detection of stops
+ *
+ * the slow fixes are clustered while they stay within radius of the
+ * running centroid of the cluster. the cluster becomes a stop when it
+ * lasts at least duration: then the events stop-start and, when a fix
+ * leaves it, stop-end are pushed.
+ */
+static struct {
+	double speed;		/* maximum speed of the fixes of stops in m/s */
+	double radius;		/* radius of stops in m */
+	uint64_t duration;	/* minimum duration of stops in ms */
+	int running;		/* is the detection running? */
+	int stopped;		/* is the cluster a stop? */
+	unsigned count;		/* count of fixes in the cluster or 0 */
+	uint64_t start;		/* stamp of the first fix of the cluster */
+	uint64_t last;		/* stamp of the last fix of the cluster */
+	double latitude;	/* latitude of the centroid */
+	double longitude;	/* longitude of the centroid */
+} stop = {
+	.speed = DEFAULT_STOP_SPEED,
+	.radius = DEFAULT_STOP_RADIUS,
+	.duration = DEFAULT_STOP_DURATION
+};
 
 /*
- * interprete one NMEA sentence
+ * pushes the stop event of the given type
  */
-static int nmea_sentence(char *s)
+static void stop_push(const char *type)
 {
-	if (!s[0] || !s[1])
-		return 0;
+	struct json_object *obj;
 
-	if (s[2] == 'G' && s[3] == 'G' && s[4] == 'A' && s[5] == ',')
-		return nmea_gga(&s[6]);
+	obj = json_object_new_object();
+	json_object_object_add(obj, "type", json_object_new_string(type));
+	json_object_object_add(obj, "latitude", json_object_new_double(stop.latitude));
+	json_object_object_add(obj, "longitude", json_object_new_double(stop.longitude));
+	json_object_object_add(obj, "start", json_object_new_int64((int64_t)stop.start));
+	json_object_object_add(obj, "duration", json_object_new_int64((int64_t)(stop.last - stop.start)));
+	AFB_NOTICE("%s at %g %g", type, stop.latitude, stop.longitude);
+	derived_push(derived_stop, obj);
+}
+
+/*
+ * updates the detection of stops with the fix gps of stamp
+ */
+static void stop_update(const struct afb_gps_data *gps, uint64_t stamp)
+{
+	int slow;
 
-	if (s[2] == 'R' && s[3] == 'M' && s[4] == 'C' && s[5] == ',')
-		return nmea_rmc(&s[6]);
+	if (!gps->set.latitude || !gps->set.longitude)
+		return;
+	slow = !gps->set.speed || gps->speed <= stop.speed;
 
-	return 0;
+	/* stay in the cluster */
+	if (stop.count > 0 && slow && stamp >= stop.last
+	 && geo_haversine(stop.latitude, stop.longitude, gps->latitude, gps->longitude) <= stop.radius) {
+		stop.count++;
+		stop.latitude += (gps->latitude - stop.latitude) / stop.count;
+		stop.longitude = angle_normal(stop.longitude + angle_delta(stop.longitude, gps->longitude) / stop.count);
+		stop.last = stamp;
+		if (!stop.stopped && stop.last - stop.start >= stop.duration) {
+			stop.stopped = 1;
+			stop_push("stop-start");
+		}
+		return;
+	}
+
+	/* leave the cluster */
+	if (stop.stopped)
+		stop_push("stop-end");
+	stop.stopped = 0;
+	stop.count = 0;
+
+	/* start a new cluster */
+	if (slow) {
+		stop.count = 1;
+		stop.start = stop.last = stamp;
+		stop.latitude = gps->latitude;
+		stop.longitude = gps->longitude;
+	}
 }
 
 /*
- * reads the NMEA stream
+ * the following of a route
+ *
+ * each fix is projected on the nearest segment of the polyline of the
+ * route, searched near the last matched segment and on the whole route
+ * only when the fix is out of the corridor there. the progress is pushed
+ * for each fix, the events off-route, on-route and arrival on changes.
+ * the route is set by the verb route, hence the lock.
+ */
+static struct {
+	pthread_mutex_t lock;	/* protects the route */
+	double *lats;		/* latitudes of the points */
+	double *lons;		/* longitudes of the points */
+	double *along;		/* distances in m from the start to the points */
+	unsigned count;		/* count of points, 0 if no route */
+	double corridor;	/* half width in m of the corridor */
+	unsigned segment;	/* index of the last matched segment */
+	int matched;		/* is segment matched? */
+	int off;		/* is the fix off the route? */
+	int arrived;		/* was the arrival pushed? */
+	double speed;		/* smoothed speed in m/s for the ETA */
+} route = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/*
+ * sets the route of the count points, the latitudes and longitudes
+ * alternating in points, or removes the route if count is 0
+ * can be called from any thread
+ * returns the length of the route in m or -1 when out of memory
  */
-static int nmea_read(int fd)
+static double route_set(const double *points, unsigned count, double corridor)
 {
-	static char buffer[160];
-	static int pos = 0;
-	static int overflow = 0;
+	double *lats, length;
+	unsigned i;
 
-	int rc;
+	lats = NULL;
+	if (count > 0) {
+		lats = malloc(3 * count * sizeof *lats);
+		if (lats == NULL)
+			return -1;
+	}
 
-	for(;;) {
-		rc = (int)read(fd, &buffer[pos], sizeof buffer - (size_t)pos);
-		if (rc < 0) {
-			/* its an error if not interrupted */
-			if (errno != EINTR)
-				return rc;
-		} else if (rc == 0) {
-			/* nothing more to be read */
-			return 0;
-		} else {
-			/* scan the buffer */
-			while (pos != rc) {
-				if (buffer[pos] != '\n') {
-					pos++;
-					if (pos == rc) {
-						if (pos == (int)(sizeof buffer)) {
-							overflow = 1;
-							pos = 0;
-							rc = 0;
-						}
-					}
-				} else {
-					if (buffer[0] == '$' && pos > 0 && buffer[pos-1] == '\r' && !overflow) {
-						if (pos > 3 && buffer[pos-4] == '*') {
-							/* TODO: check the cheksum */
-							buffer[pos-4] = 0;
-						} else {
-							buffer[pos-1] = 0;
-						}
-						nmea_sentence(&buffer[1]);
-					}
-					pos++;
-					rc -= pos;
-					if (rc > 0)
-						memmove(buffer, buffer+pos, (size_t)rc);
-					pos = 0;
-					overflow = 0;
-				}
-			}
+	pthread_mutex_lock(&route.lock);
+	free(route.lats);
+	route.lats = lats;
+	route.lons = &lats[count];
+	route.along = &lats[2 * count];
+	route.count = count;
+	route.corridor = corridor;
+	route.matched = route.off = route.arrived = 0;
+	route.speed = 0;
+	for (i = 0 ; i < count ; i++) {
+		route.lats[i] = points[2 * i];
+		route.lons[i] = angle_normal(points[2 * i + 1]);
+		route.along[i] = i == 0 ? 0 : route.along[i - 1]
+			+ geo_haversine(route.lats[i - 1], route.lons[i - 1], route.lats[i], route.lons[i]);
+	}
+	length = count ? route.along[count - 1] : 0;
+	pthread_mutex_unlock(&route.lock);
+	return length;
+}
+
+/*
+ * projects the point on the segment i in the plane tangent at its start
+ * stores in deviation the distance of the point to the segment
+ * returns the distance in m from the start of the route to the projection
+ */
+static double route_project(unsigned i, double lat, double lon, double *deviation)
+{
+	double c, ex, ny, px, py, length2, t;
+
+	c = cos(route.lats[i] * RADIAN_PER_DEGREE) * METER_PER_DEGREE;
+	ex = angle_delta(route.lons[i], route.lons[i + 1]) * c;
+	ny = (route.lats[i + 1] - route.lats[i]) * METER_PER_DEGREE;
+	px = angle_delta(route.lons[i], lon) * c;
+	py = (lat - route.lats[i]) * METER_PER_DEGREE;
+	length2 = ex * ex + ny * ny;
+	t = length2 > 0 ? fmin(fmax((px * ex + py * ny) / length2, 0), 1) : 0;
+	*deviation = hypot(px - t * ex, py - t * ny);
+	return route.along[i] + t * (route.along[i + 1] - route.along[i]);
+}
+
+/*
+ * searches the segments from first to last excluded for the nearest one
+ * stores its index in segment, its deviation in deviation and
+ * returns the distance from the start of the route to the projection
+ */
+static double route_search(unsigned first, unsigned last, double lat, double lon,
+				unsigned *segment, double *deviation)
+{
+	double along, a, d;
+	unsigned i;
+
+	*deviation = INFINITY;
+	along = 0;
+	for (i = first ; i < last ; i++) {
+		a = route_project(i, lat, lon, &d);
+		if (d < *deviation) {
+			*deviation = d;
+			*segment = i;
+			along = a;
 		}
 	}
+	return along;
+}
+
+/*
+ * pushes the route event of the given type
+ */
+static void route_push(const char *type, double along, double deviation, uint64_t stamp)
+{
+	struct json_object *obj;
+	double length, remaining;
+
+	length = route.along[route.count - 1];
+	remaining = length - along;
+	obj = json_object_new_object();
+	json_object_object_add(obj, "type", json_object_new_string(type));
+	json_object_object_add(obj, "progress", json_object_new_double(length > 0 ? along / length : 1));
+	json_object_object_add(obj, "travelled", json_object_new_double(along));
+	json_object_object_add(obj, "remaining", json_object_new_double(remaining));
+	json_object_object_add(obj, "deviation", json_object_new_double(deviation));
+	json_object_object_add(obj, "segment", json_object_new_int((int)route.segment));
+	json_object_object_add(obj, "off-route", json_object_new_boolean(route.off));
+	if (route.speed >= ROUTE_MIN_SPEED)
+		json_object_object_add(obj, "eta",
+			json_object_new_int64((int64_t)stamp + (int64_t)(1000 * remaining / route.speed)));
+	derived_push(derived_route, obj);
+}
+
+/*
+ * updates the following of the route with the fix gps of stamp
+ */
+static void route_update(const struct afb_gps_data *gps, uint64_t stamp)
+{
+	unsigned first, last, segment;
+	double along, deviation;
+	int off;
+
+	if (!gps->set.latitude || !gps->set.longitude)
+		return;
+	pthread_mutex_lock(&route.lock);
+	if (route.count < 2) {
+		pthread_mutex_unlock(&route.lock);
+		return;
+	}
+
+	/* searches near the last matched segment, then on the whole route */
+	segment = 0;
+	deviation = INFINITY;
+	along = 0;
+	if (route.matched) {
+		first = route.segment > ROUTE_BEHIND ? route.segment - ROUTE_BEHIND : 0;
+		last = route.segment + ROUTE_AHEAD + 1 < route.count - 1 ? route.segment + ROUTE_AHEAD + 1 : route.count - 1;
+		along = route_search(first, last, gps->latitude, gps->longitude, &segment, &deviation);
+	}
+	if (deviation > route.corridor)
+		along = route_search(0, route.count - 1, gps->latitude, gps->longitude, &segment, &deviation);
+	route.segment = segment;
+	route.matched = 1;
+
+	if (gps->set.speed)
+		route.speed = route.speed > 0 ? route.speed + ROUTE_SMOOTHING * (gps->speed - route.speed) : gps->speed;
+
+	/* off the corridor, back at half of it */
+	off = route.off ? deviation > route.corridor / 2 : deviation > route.corridor;
+	if (off != route.off) {
+		route.off = off;
+		route_push(off ? "off-route" : "on-route", along, deviation, stamp);
+	}
+	route_push("progress", along, deviation, stamp);
+	if (!route.arrived && !off && route.along[route.count - 1] - along <= route.corridor) {
+		route.arrived = 1;
+		route_push("arrival", along, deviation, stamp);
+	}
+	pthread_mutex_unlock(&route.lock);
+}
+
+/*
+ * computes the derived events for the fix of stamp
+ */
+static void derive_fix(struct fix *fix, uint64_t stamp, int stops, int routes)
+{
+	fix_decode(fix, FIELD_BIT(field_latitude) | FIELD_BIT(field_longitude) | FIELD_BIT(field_speed));
+	if (stops)
+		stop_update(&fix->gps, stamp);
+	if (routes)
+		route_update(&fix->gps, stamp);
+}
+
+/*
+ * computes the derived events for the fixes committed since the previous
+ * call, up to the published fix at least, so that they don't depend on
+ * the coalescing of the fixes by the publishing. the fixes are read from
+ * the history or, without history, only the published fix is used.
+ * called by the event loop for each published fix
+ */
+static void derive(struct fix *fix)
+{
+	static uint32_t derived;	/* sequence of the last fix derived */
+	int stops, routes, complete;
+	unsigned i, count;
+	struct record *records;
+
+	stops = __atomic_load_n(&derived_events[derived_stop].watched, __ATOMIC_RELAXED);
+	routes = __atomic_load_n(&derived_events[derived_route].watched, __ATOMIC_RELAXED);
+	if (!stops)
+		stop.running = 0;
+	if (!stops && !routes) {
+		derived = fix->seq;
+		return;
+	}
+	if (stops && !stop.running) {
+		stop.running = 1;
+		stop.stopped = 0;
+		stop.count = 0;
+	}
+
+	records = history == NULL ? NULL : history_since(derived, &count, &complete);
+	if (records == NULL) {
+		derive_fix(fix, history_stamp(&fix->gps), stops, routes);
+		derived = fix->seq;
+		return;
+	}
+	for (i = 0 ; i < count ; i++) {
+		/* an epoch already derived that got later sentences */
+		if (records[i].first > derived)
+			derive_fix(&records[i].fix, records[i].stamp, stops, routes);
+		derived = records[i].fix.seq;
+	}
+	free(records);
 }
 
 /***************************************************************************************/
 /***************************************************************************************/
 /**                                                                                   **/
 /**                                                                                   **/
-/**       SECTION: HANDLING OF CONNECTION                                             **/
+/**       SECTION: MAPPING TILES                                                      **/
 /**                                                                                   **/
 /**                                                                                   **/
 /***************************************************************************************/
 /***************************************************************************************/
-/* declare the connection routine */
-static int connection();
+/*
+ * counts the fixes and their dwell time per tile
+ *
+ * the tiles are those of the web maps at the zoom AFBGPS_TILE_ZOOM.
+ * they are recorded in a hash table of AFBGPS_TILE_CAPACITY entries
+ * with open addressing, keyed by their packed zoom, x and y. the dwell
+ * time between two fixes is given to the tile of the first one.
+ */
+struct tile {
+	uint64_t key;		/* packed zoom, x and y or TILE_EMPTY */
+	uint64_t dwell;		/* dwell time in ms */
+	uint32_t count;		/* count of fixes */
+};
+
+#define TILE_EMPTY         UINT64_MAX
+#define TILE_KEY(z,x,y)    (((uint64_t)(z) << 56) | ((uint64_t)(x) << 28) | (uint64_t)(y))
+#define TILE_X(key)        ((uint32_t)((key) >> 28) & 0xfffffff)
+#define TILE_Y(key)        ((uint32_t)(key) & 0xfffffff)
+
+static struct {
+	struct tile *entries;	/* the hash table or NULL if disabled */
+	unsigned capacity;	/* count of entries, a power of 2 */
+	unsigned count;		/* count of used entries */
+	unsigned zoom;		/* zoom of the tiles */
+	struct tile *last;	/* the tile of the last fix or NULL */
+	uint64_t stamp;		/* stamp of the last fix */
+	uint32_t seq;		/* sequence of the last fix counted */
+	uint64_t dropped;	/* count of fixes dropped because the table is full */
+	pthread_mutex_t lock;	/* protects the tiles */
+} tiles = { .lock = PTHREAD_MUTEX_INITIALIZER };
 
 /*
- * called on an event on the NMEA stream
+ * allocates the table of the tiles if AFBGPS_TILE_ZOOM is set
  */
-static int on_event(sd_event_source *s, int fd, uint32_t revents, void *userdata)
+static int tiles_init()
 {
-	/* read available data */
-	if ((revents & EPOLLIN) != 0) {
-		nmea_read(fd);
-		event_send();
+	unsigned i, capacity;
+
+	if (getenv("AFBGPS_TILE_ZOOM") == NULL)
+		return 0;
+	tiles.zoom = env_unsigned("AFBGPS_TILE_ZOOM", DEFAULT_TILE_ZOOM);
+	if (tiles.zoom > TILE_MAX_ZOOM) {
+		AFB_ERROR("AFBGPS_TILE_ZOOM can't exceed %d", TILE_MAX_ZOOM);
+		return -1;
+	}
+	capacity = env_unsigned("AFBGPS_TILE_CAPACITY", DEFAULT_TILE_CAPACITY);
+	for (tiles.capacity = 1 ; tiles.capacity < capacity ; tiles.capacity <<= 1);
+	tiles.entries = malloc(tiles.capacity * sizeof *tiles.entries);
+	if (tiles.entries == NULL) {
+		AFB_ERROR("out of memory for %u tiles", tiles.capacity);
+		return -1;
+	}
+	for (i = 0 ; i < tiles.capacity ; i++)
+		tiles.entries[i].key = TILE_EMPTY;
+	return 0;
+}
+
+/*
+ * get the entry of the tile of key, adding it if needed
+ * returns NULL if the table is full
+ */
+static struct tile *tile_get(uint64_t key)
+{
+	unsigned i, mask;
+	struct tile *t;
+
+	mask = tiles.capacity - 1;
+	for (i = (unsigned)((key * 0x9e3779b97f4a7c15ull) >> 32) & mask ; ; i = (i + 1) & mask) {
+		t = &tiles.entries[i];
+		if (t->key == key)
+			return t;
+		if (t->key == TILE_EMPTY)
+			break;
 	}
 
-	/* check if error or hangup */
-	if ((revents & (EPOLLERR|EPOLLRDHUP|EPOLLHUP)) != 0) {
-		sd_event_source_unref(s);
-		close(fd);
-		connection(fd);
+	/* keeps a quarter of the table free for short probes */
+	if (4 * (tiles.count + 1) > 3 * tiles.capacity)
+		return NULL;
+	tiles.count++;
+	t->key = key;
+	t->dwell = 0;
+	t->count = 0;
+	return t;
+}
+
+/*
+ * counts the fix of stamp in its tile
+ */
+static void tile_add(const struct fix *fix, uint64_t stamp)
+{
+	struct fix copy;
+	double lat, lon, n;
+	uint32_t x, y;
+	struct tile *t;
+
+	copy = *fix;
+	fix_decode(&copy, FIELD_BIT(field_latitude) | FIELD_BIT(field_longitude));
+	if (!copy.gps.set.latitude || !copy.gps.set.longitude)
+		return;
+
+	/* the tile of the web mercator projection */
+	n = (double)(1u << tiles.zoom);
+	lat = fmin(fmax(copy.gps.latitude, -TILE_MAX_LATITUDE), TILE_MAX_LATITUDE) * RADIAN_PER_DEGREE;
+	lon = copy.gps.longitude >= 180 ? copy.gps.longitude - 360 : copy.gps.longitude;
+	x = (uint32_t)fmin((lon + 180) / 360 * n, n - 1);
+	y = (uint32_t)fmin((1 - asinh(tan(lat)) / M_PI) / 2 * n, n - 1);
+
+	pthread_mutex_lock(&tiles.lock);
+	if (tiles.last != NULL && stamp > tiles.stamp)
+		tiles.last->dwell += stamp - tiles.stamp > TILE_MAX_DWELL ? TILE_MAX_DWELL : stamp - tiles.stamp;
+	t = tile_get(TILE_KEY(tiles.zoom, x, y));
+	if (t == NULL)
+		tiles.dropped++;
+	else
+		t->count++;
+	tiles.last = t;
+	tiles.stamp = stamp;
+	pthread_mutex_unlock(&tiles.lock);
+}
+
+/*
+ * counts the fixes committed since the previous call, up to the published
+ * fix at least. the fixes are read from the history or, without history,
+ * only the published fix is counted.
+ * called by the event loop for each published fix, not to lock the tiles
+ * in the thread committing the fixes
+ */
+static void tiles_update(struct fix *fix)
+{
+	struct record *records;
+	unsigned i, count;
+	int complete;
+
+	if (tiles.entries == NULL)
+		return;
+	records = history == NULL ? NULL : history_since(tiles.seq, &count, &complete);
+	if (records == NULL) {
+		tile_add(fix, history_stamp(&fix->gps));
+		tiles.seq = fix->seq;
+		return;
+	}
+	for (i = 0 ; i < count ; i++) {
+		/* an epoch already counted that got later sentences */
+		if (records[i].first > tiles.seq)
+			tile_add(&records[i].fix, records[i].stamp);
+		tiles.seq = records[i].fix.seq;
+	}
+	free(records);
+}
+
+/*
+ * get in arrays of object the tiles counting at least min fixes,
+ * resetting the tiles if reset is set
+ * the tiles are copied under the lock and the arrays built after
+ * can be called from any thread
+ * returns 0 or -1 when out of memory
+ */
+static int tiles_get(struct json_object *object, uint32_t min, int reset)
+{
+	struct json_object *xs, *ys, *counts, *dwells;
+	struct tile *copy, *t;
+	unsigned i, n;
+	uint64_t dropped;
+
+	copy = malloc(tiles.capacity * sizeof *copy);
+	if (copy == NULL)
+		return -1;
+	pthread_mutex_lock(&tiles.lock);
+	for (i = n = 0 ; i < tiles.capacity ; i++) {
+		t = &tiles.entries[i];
+		if (t->key != TILE_EMPTY && t->count >= min)
+			copy[n++] = *t;
+		if (reset)
+			t->key = TILE_EMPTY;
+	}
+	dropped = tiles.dropped;
+	if (reset) {
+		tiles.count = 0;
+		tiles.last = NULL;
+		tiles.dropped = 0;
+	}
+	pthread_mutex_unlock(&tiles.lock);
+
+	xs = json_object_new_array();
+	ys = json_object_new_array();
+	counts = json_object_new_array();
+	dwells = json_object_new_array();
+	for (i = 0 ; i < n ; i++) {
+		json_object_array_add(xs, json_object_new_int((int)TILE_X(copy[i].key)));
+		json_object_array_add(ys, json_object_new_int((int)TILE_Y(copy[i].key)));
+		json_object_array_add(counts, json_object_new_int64(copy[i].count));
+		json_object_array_add(dwells, json_object_new_int64((int64_t)copy[i].dwell));
+	}
+	free(copy);
+	json_object_object_add(object, "dropped", json_object_new_int64((int64_t)dropped));
+	json_object_object_add(object, "zoom", json_object_new_int((int)tiles.zoom));
+	json_object_object_add(object, "x", xs);
+	json_object_object_add(object, "y", ys);
+	json_object_object_add(object, "count", counts);
+	json_object_object_add(object, "dwell", dwells);
+	return 0;
+}
+
+/***************************************************************************************/
+/***************************************************************************************/
+/**                                                                                   **/
+/**                                                                                   **/
+/**       SECTION: HANDLING NMEA                                                      **/
+/**                                                                                   **/
+/**                                                                                   **/
+/***************************************************************************************/
+/***************************************************************************************/
+/*
+ * interprets a nmea time
+ */
+static int nmea_time(const char *text, uint32_t *result)
+{
+	uint32_t x;
+
+	if (text[0] < '0' || text[0] > '2'
+	 || text[1] < '0' || text[1] > (text[0] == '2' ? '3' : '9')
+	 || text[2] < '0' || text[2] > '5'
+	 || text[3] < '0' || text[3] > '9'
+	 || text[4] < '0' || text[4] > '5'
+	 || text[5] < '0' || text[5] > '9'
+	 || (text[6] != 0 && text[6] != '.'))
+		return 0;
+
+	x = (uint32_t)(text[0] - '0');
+	x = x * 10 + (uint32_t)(text[1]-'0');
+	x = x *  6 + (uint32_t)(text[2]-'0');
+	x = x * 10 + (uint32_t)(text[3]-'0');
+	x = x *  6 + (uint32_t)(text[4]-'0');
+	x = x * 10 + (uint32_t)(text[5]-'0');
+	x = x * 1000;
+	if (text[6] == '.') {
+		if (text[7] != 0) {
+			if (text[7] < '0' || text[7] > '9') return 0;
+			x += (uint32_t)(text[7]-'0') * 100;
+			if (text[8] != 0) {
+				if (text[8] < '0' || text[8] > '9') return 0;
+				x += (uint32_t)(text[8]-'0') * 10;
+				if (text[9] != 0) {
+					if (text[9] < '0' || text[9] > '9') return 0;
+					x += (uint32_t)(text[9]-'0');
+					if (text[10] != 0) {
+						if (text[10] < '0' || text[10] > '9') return 0;
+						x += text[10] > '5';
+					}
+				}
+			}
+		}
+	}
+
+	*result = x;
+	return 1;
+}
+
+/*
+ * interprets a nmea angle having minutes
+ */
+static int nmea_angle(const char *text, double *result)
+{
+	uint32_t x = 0;
+	double v;
+	int dotidx = (int)(strchrnul(text, '.') - text);
+
+	switch(dotidx) {
+	case 5:
+		if (text[dotidx - 5] < '0' || text[dotidx - 5] > '9')
+			return 0;
+		x = x * 10 + (uint32_t)(text[dotidx - 5] - '0');
+	case 4:
+		if (text[dotidx - 4] < '0' || text[dotidx - 4] > '9')
+			return 0;
+		x = x * 10 + (uint32_t)(text[dotidx - 4] - '0');
+	case 3:
+		if (text[dotidx - 3] < '0' || text[dotidx - 3] > '9')
+			return 0;
+		x = x * 10 + (uint32_t)(text[dotidx - 3] - '0');
+	case 2:
+		v = atof(&text[dotidx - 2]);
+		break;
+	case 1:
+		if (text[dotidx - 1] < '0' || text[dotidx - 1] > '9')
+			return 0;
+	case 0:
+		v = atof(text);
+		break;
+	default:
+		return 0;
+	}
+
+	*result = (double)x + v * 0.01666666666666666666666; /* 1 / 60 */
+
+	return 1;
+}
+
+/*
+ * checks the syntax of the text of the field, cheaper than decoding it:
+ * the angles are digits, at most 5, optionally followed by a dot and
+ * digits, the other fields are decoded whatever they are
+ * returns 1 if correct, the decoding of the field then succeeds, or 0
+ */
+static int field_check(enum field field, const char *text)
+{
+	const char *p;
+
+	switch (field) {
+	case field_latitude:
+	case field_longitude:
+		for (p = text ; *p >= '0' && *p <= '9' ; p++);
+		if (p - text > 5)
+			return 0;
+		if (*p == '.')
+			for (p++ ; *p >= '0' && *p <= '9' ; p++);
+		return *p == 0;
+	default:
+		return 1;
+	}
+}
+
+/*
+ * decodes the text of the field of the fix
+ * returns 1 if correct or 0 if a format error exists
+ */
+static int fix_decode_field(struct fix *fix, enum field field, const char *text)
+{
+	struct afb_gps_data *gps = &fix->gps;
+
+	switch (field) {
+	case field_time:
+		return nmea_time(text, &gps->time);
+	case field_latitude:
+		if (!nmea_angle(text, &gps->latitude))
+			return 0;
+		if (fix->south)
+			gps->latitude = -gps->latitude;
+		return 1;
+	case field_longitude:
+		if (!nmea_angle(text, &gps->longitude))
+			return 0;
+		if (fix->west)
+			gps->longitude = 360.0 - gps->longitude;
+		return 1;
+	case field_altitude:
+		gps->altitude = atof(text);
+		return 1;
+	case field_speed:
+		gps->speed = atof(text) * KNOT_TO_METER_PER_SECOND;
+		return 1;
+	case field_track:
+		gps->track = atof(text);
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * sets the flag of the field of gps to value
+ */
+static void field_flag(struct afb_gps_data *gps, enum field field, unsigned value)
+{
+	switch (field) {
+	case field_time: gps->set.time = value & 1; break;
+	case field_latitude: gps->set.latitude = value & 1; break;
+	case field_longitude: gps->set.longitude = value & 1; break;
+	case field_altitude: gps->set.altitude = value & 1; break;
+	case field_speed: gps->set.speed = value & 1; break;
+	case field_track: gps->set.track = value & 1; break;
+	default: break;
+	}
+}
+
+/*
+ * decodes the pending fields of the fix that are in fields
+ * the fields having a format error are removed
+ */
+static void fix_decode(struct fix *fix, unsigned fields)
+{
+	unsigned todo;
+	enum field field;
+
+	todo = fix->pending & fields;
+	if (todo == 0)
+		return;
+
+	fix->pending &= ~todo;
+	for (field = 0 ; field < field_COUNT ; field++)
+		if ((todo & FIELD_BIT(field))
+		 && !fix_decode_field(fix, field, &fix->text[fix->offsets[field]]))
+			field_flag(&fix->gps, field, 0);
+}
+
+/*
+ * records the text of the field of the fix
+ * the text is decoded now if the field is in demand or
+ * if it can't be recorded, otherwise it is left pending
+ * its syntax is always checked, so that the acceptance of
+ * the sentences doesn't depend on the demand
+ * returns 1 if correct or 0 if a format error exists
+ */
+static int fix_field(struct fix *fix, enum field field, const char *text, unsigned demand, size_t *used)
+{
+	size_t length;
+
+	if (!field_check(field, text))
+		return 0;
+	length = strlen(text) + 1;
+	if ((demand & FIELD_BIT(field)) || *used + length > sizeof fix->text) {
+		if (!fix_decode_field(fix, field, text))
+			return 0;
+	} else {
+		memcpy(&fix->text[*used], text, length);
+		fix->offsets[field] = (unsigned char)*used;
+		fix->pending |= FIELD_BIT(field);
+		*used += length;
+	}
+	field_flag(&fix->gps, field, 1);
+	return 1;
+}
+
+/*
+ * merges in into the fields set in fix, a later fix of the same epoch
+ * the fields of fix are decoded so that into keeps its own texts
+ */
+static void fix_merge(struct fix *into, const struct fix *fix)
+{
+	struct fix f;
+
+	f = *fix;
+	fix_decode(&f, f.pending);
+#define MERGE(name) \
+	if (f.gps.set.name) { \
+		into->gps.name = f.gps.name; \
+		into->gps.set.name = 1; \
+		into->pending &= ~FIELD_BIT(field_##name); \
+	}
+	MERGE(time)
+	MERGE(latitude)
+	MERGE(longitude)
+	MERGE(altitude)
+	MERGE(speed)
+	MERGE(track)
+#undef MERGE
+	if (f.hdop > 0)
+		into->hdop = f.hdop;
+	if (f.quality > 0)
+		into->quality = f.quality;
+	into->reckoned = f.reckoned;
+	into->accuracy = f.accuracy;
+	into->seq = f.seq;
+}
+
+/*
+ * commits the fix of the source, if any, as the last one
+ */
+static void fix_commit(struct source *src, const struct fix *fix)
+{
+	uint64_t stamp, nanos;
+
+	stamp = history_stamp(&fix->gps);
+	nanos = nanonow();
+	pthread_mutex_lock(&fix_lock);
+	last_fix = *fix;
+	last_fix.seq = fix_generation + 1;
+	if (src != NULL) {
+		/* sentences of the epoch of the source are merged in its fix */
+		if (last_fix.gps.set.time && src->fix.gps.set.time
+				&& src->fix.gps.time == last_fix.gps.time) {
+			if (last_fix.hdop == 0)
+				last_fix.hdop = src->fix.hdop;
+			if (last_fix.quality == 0)
+				last_fix.quality = src->fix.quality;
+			fix_merge(&src->fix, &last_fix);
+		} else
+			src->fix = last_fix;
+		src->stamp = stamp;
+		src->open = 1;
+	}
+	if (history != NULL)
+		history_add(&last_fix, stamp);
+	__atomic_store_n(&fix_nanos, nanos, __ATOMIC_RELAXED);
+	__atomic_store_n(&fix_generation, last_fix.seq, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&fix_lock);
+	TRACE(fix, fix->gps.set.time ? fix->gps.time : -1.0, fix_generation);
+	METRIC_INC(fixes);
+}
+
+/*
+ * closes the epoch of the source at the end of the data received,
+ * its sentences being sent together, so that it is fused once
+ */
+static void fix_close(struct source *src)
+{
+	/* only the thread reading the source sets it */
+	if (!src->open)
+		return;
+	pthread_mutex_lock(&fix_lock);
+	if (src->open) {
+		src->open = 0;
+		fused_epochs++;
+	}
+	pthread_mutex_unlock(&fix_lock);
+}
+
+/*
+ * creates a new position for the given optionnal fields
+ * only the time and the fields in demand are decoded,
+ * the others are recorded for being decoded on need
+ * returns 1 if correct or 0 if a format error exists
+ */
+static int nmea_set(
+		struct source *src,
+		const char *tim,
+		const char *lat, const char *latu,
+		const char *lon, const char *lonu,
+		const char *alt, const char *altu,
+		const char *spe,
+		const char *tra,
+		const char *dat,
+		const char *dop,
+		const char *qua
+)
+{
+	struct fix fix;
+	unsigned demand;
+	size_t used;
+	int logit;
+
+	logit = log_sampled(log_site_sentence);
+	if (logit)
+		AFB_DEBUG("source=%d time=%s latitude=%s%s longitude=%s%s altitude=%s%s speed=%s track=%s date=%s hdop=%s",
+			src->index, tim, lat, latu, lon, lonu, alt, altu, spe, tra, dat, dop);
+
+	memset(&fix, 0, offsetof(struct fix, text));
+	demand = FIELD_BIT(field_time) | __atomic_load_n(&fields_demand, __ATOMIC_RELAXED);
+	if (logit)
+		demand = FIELDS_ALL;
+	used = 0;
+
+	/* get the time in milliseconds */
+	if (tim != NULL && !fix_field(&fix, field_time, tim, demand, &used))
+		return 0;
+
+	/* get the latitude */
+	if (lat != NULL && latu != NULL) {
+		if ((latu[0] != 'N' && latu[0] != 'S') || latu[1] != 0)
+			return 0;
+		fix.south = latu[0] == 'S';
+		if (!fix_field(&fix, field_latitude, lat, demand, &used))
+			return 0;
+	}
+
+	/* get the longitude */
+	if (lon != NULL && lonu != NULL) {
+		if ((lonu[0] != 'E' && lonu[0] != 'W') || lonu[1] != 0)
+			return 0;
+		fix.west = lonu[0] == 'W';
+		if (!fix_field(&fix, field_longitude, lon, demand, &used))
+			return 0;
+	}
+
+	/* get the altitude */
+	if (alt != NULL && altu != NULL) {
+		if (altu[0] != 'M' || altu[1] != 0)
+			return 0;
+		fix_field(&fix, field_altitude, alt, demand, &used);
+	}
+
+	/* get the speed */
+	if (spe != NULL)
+		fix_field(&fix, field_speed, spe, demand, &used);
+
+	/* get the track */
+	if (tra != NULL)
+		fix_field(&fix, field_track, tra, demand, &used);
+
+	/* get the horizontal dilution of precision */
+	if (dop != NULL)
+		fix.hdop = atof(dop);
+
+	/* get the fix quality */
+	if (qua != NULL && qua[0] >= '1' && qua[0] <= '9' && qua[1] == 0)
+		fix.quality = (unsigned char)(qua[0] - '0');
+
+	/* commit the fix */
+	fix_commit(src, &fix);
+
+	if (logit)
+		AFB_DEBUG("time:%d=%d latitude:%d=%g longitude:%d=%g altitude:%d=%g speed:%d=%g track:%d=%g",
+			(int)fix.gps.set.time, fix.gps.set.time ? (int)fix.gps.time : 0,
+			(int)fix.gps.set.latitude, fix.gps.set.latitude ? fix.gps.latitude : 0,
+			(int)fix.gps.set.longitude, fix.gps.set.longitude ? fix.gps.longitude : 0,
+			(int)fix.gps.set.altitude, fix.gps.set.altitude ? fix.gps.altitude : 0,
+			(int)fix.gps.set.speed, fix.gps.set.speed ? fix.gps.speed : 0,
+			(int)fix.gps.set.track, fix.gps.set.track ? fix.gps.track : 0
+		);
+
+	return 1;
+}
+
+/*
+ * Splits the nmea sentence in its count first fields
+ * returns 1 if the sentence has at least count fields or 0 otherwise
+ */
+static int nmea_split(char *s, char *fields[], int count)
+{
+	int index = 0;
+	for(;;) {
+		fields[index++] = s;
+		while (*s && *s != ',')
+			s++;
+		if (index == count) {
+			*s = 0;
+			return 1;
+		}
+		if (!*s)
+			return 0;
+		*s++ = 0;
+	}
+}
+
+/*
+ * returns the field or NULL if it is empty
+ */
+static inline const char *nmea_field(const char *field)
+{
+	return *field ? field : NULL;
+}
+
+/*
+ * generates the decoders of the sentences described in nmea-sentences.def
+ *
+ * the decoder nmea_XXX of the sentence XXX splits the needed fields,
+ * checks the validity and sets the fix from the fields of the layout
+ */
+#define NONE              -1
+#define NMEA_F(index)     ((index) < 0 ? NULL : nmea_field(f[(index) < 0 ? 0 : (index)]))
+#define NMEA_IS(index,c)  (f[index][0] == (c))
+#define NMEA_NOT(index,c) (f[index][0] != (c))
+
+#define NMEA_SENTENCE(id,count,check,tim,lat,latu,lon,lonu,alt,altu,spe,tra,dat,dop,qua) \
+	static int nmea_##id(struct source *src, char *s) \
+	{ \
+		char *f[count]; \
+		return nmea_split(s, f, count) \
+			&& (check) \
+			&& nmea_set(src, NMEA_F(tim), NMEA_F(lat), NMEA_F(latu), NMEA_F(lon), NMEA_F(lonu), \
+				NMEA_F(alt), NMEA_F(altu), NMEA_F(spe), NMEA_F(tra), NMEA_F(dat), NMEA_F(dop), \
+				NMEA_F(qua)); \
+	}
+#include "nmea-sentences.def"
+#undef NMEA_SENTENCE
+
+/*
+ * the dispatch table of the decoders
+ */
+static const struct {
+	char id[4];			/* the 3 letters id of the sentence */
+	int (*decode)(struct source *src, char *s);	/* the decoder of the fields */
+} nmea_DECODERS[] = {
+#define NMEA_SENTENCE(id,...) { #id, nmea_##id },
+#include "nmea-sentences.def"
+#undef NMEA_SENTENCE
+};
+
+#undef NONE
+#undef NMEA_F
+#undef NMEA_IS
+#undef NMEA_NOT
+
+/*
+ * interprete one proprietary sentence using the decoders of plugins
+ */
+static int nmea_proprietary(struct source *src, char *s)
+{
+	int i;
+	char *f;
+	struct fix fix;
+
+	for (i = 0 ; i < plugin_decoder_count ; i++) {
+		if (strncmp(s, plugin_decoders[i].id, plugin_decoders[i].length) == 0) {
+			f = &s[plugin_decoders[i].length];
+			if (*f == ',')
+				f++;
+			memset(&fix, 0, offsetof(struct fix, text));
+			if (!plugin_decoders[i].decode(f, &fix.gps))
+				return 0;
+			fix_commit(src, &fix);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * interprete one NMEA sentence
+ */
+static int nmea_sentence(struct source *src, char *s)
+{
+	int i;
+
+	if (s[0] == 'P')
+		return nmea_proprietary(src, s);
+
+	if (!s[0] || !s[1] || !s[2] || !s[3] || !s[4] || s[5] != ',')
+		return 0;
+
+	for (i = 0 ; i < (int)(sizeof nmea_DECODERS / sizeof *nmea_DECODERS) ; i++)
+		if (memcmp(&s[2], nmea_DECODERS[i].id, 3) == 0)
+			return nmea_DECODERS[i].decode(src, &s[6]);
+
+	return 0;
+}
+
+/*
+ * processes the line received by the source
+ */
+static void nmea_line(struct source *src)
+{
+	char *buffer = src->buffer;
+	int pos = src->pos;
+	uint64_t start;
+
+	if (buffer[0] == '$' && pos > 0 && buffer[pos-1] == '\r' && !src->overflow) {
+		if (pos > 3 && buffer[pos-4] == '*') {
+			/* TODO: check the cheksum */
+			buffer[pos-4] = 0;
+		} else {
+			buffer[pos-1] = 0;
+		}
+		TRACE(sentence, &buffer[1], pos - 1);
+		start = nanonow();
+		METRIC_INC(sentences);
+		if (!nmea_sentence(src, &buffer[1]))
+			METRIC_INC(rejected);
+		histogram_add(&metrics_get()->parse, nanonow() - start);
+	} else if (src->overflow)
+		METRIC_INC(overflows);
+	src->pos = 0;
+	src->overflow = 0;
+}
+
+/*
+ * feeds the source with the received data
+ */
+static void nmea_feed(struct source *src, const char *data, size_t length)
+{
+	const char *eol;
+	size_t count;
+
+	while (length) {
+		/* get the data until end of line */
+		eol = memchr(data, '\n', length);
+		count = eol == NULL ? length : (size_t)(eol - data);
+
+		/* append it to the line or mark the line as too long */
+		if (count > sizeof src->buffer - (size_t)src->pos)
+			src->overflow = 1;
+		else {
+			memcpy(&src->buffer[src->pos], data, count);
+			src->pos += (int)count;
+		}
+
+		/* process the line if complete */
+		if (eol == NULL)
+			break;
+		nmea_line(src);
+		data += count + 1;
+		length -= count + 1;
+	}
+	fix_close(src);
+}
+
+/*
+ * reads the NMEA stream of the source
+ */
+static int nmea_read(struct source *src)
+{
+	char buffer[1024];
+	int rc;
+
+	for(;;) {
+		rc = (int)read(src->fd, buffer, sizeof buffer);
+		TRACE(read, src->fd, rc);
+		METRIC_INC(reads);
+		if (rc < 0) {
+			/* its an error if not interrupted */
+			if (errno != EINTR)
+				return rc;
+		} else if (rc == 0) {
+			/* nothing more to be read */
+			return 0;
+		} else {
+			METRIC_ADD(bytes, rc);
+			nmea_feed(src, buffer, (size_t)rc);
+		}
+	}
+}
+
+/***************************************************************************************/
+/***************************************************************************************/
+/**                                                                                   **/
+/**                                                                                   **/
+/**       SECTION: LOADING PLUGINS                                                    **/
+/**                                                                                   **/
+/**                                                                                   **/
+/***************************************************************************************/
+/***************************************************************************************/
+/*
+ * registers the decoder of the proprietary sentences beginning with id
+ */
+static int plugin_add_decoder(const char *id, afb_gps_decoder_t decoder)
+{
+	if (id == NULL || id[0] != 'P' || decoder == NULL) {
+		AFB_ERROR("invalid decoder for %s", id ? : "(null)");
+		return -1;
+	}
+	if (plugin_decoder_count == PLUGIN_DECODERS_MAX) {
+		AFB_ERROR("too many decoders, can't add %s", id);
+		return -1;
+	}
+	plugin_decoders[plugin_decoder_count].id = id;
+	plugin_decoders[plugin_decoder_count].length = strlen(id);
+	plugin_decoders[plugin_decoder_count].decode = decoder;
+	plugin_decoder_count++;
+	AFB_NOTICE("decoder of %s added", id);
+	return 0;
+}
+
+/*
+ * the interface given to the plugins
+ */
+static const struct afb_gps_plugin_itf plugin_itf = {
+	.add_decoder = plugin_add_decoder,
+	.split = nmea_split,
+	.time = nmea_time,
+	.angle = nmea_angle
+};
+
+/*
+ * loads the plugin of path
+ */
+static int plugin_load(const char *path)
+{
+	void *handle;
+	int (*reg)(unsigned version, const struct afb_gps_plugin_itf *itf);
+
+	handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+	if (handle == NULL) {
+		AFB_ERROR("can't load plugin %s: %s", path, dlerror());
+		return -1;
+	}
+	reg = (int (*)(unsigned, const struct afb_gps_plugin_itf *))dlsym(handle, "afbGpsPluginRegister");
+	if (reg == NULL) {
+		AFB_ERROR("plugin %s has no afbGpsPluginRegister", path);
+		dlclose(handle);
+		return -1;
+	}
+	if (reg(AFB_GPS_PLUGIN_VERSION, &plugin_itf) < 0) {
+		AFB_ERROR("registration of plugin %s failed (interface version %d)", path, AFB_GPS_PLUGIN_VERSION);
+		return -1;
+	}
+	AFB_NOTICE("plugin %s loaded", path);
+	return 0;
+}
+
+/*
+ * loads the plugins listed in AFBGPS_PLUGINS separated by colons
+ */
+static int plugin_load_all()
+{
+	const char *list;
+	char *copy, *path, *next;
+	int rc;
+
+	list = getenv("AFBGPS_PLUGINS");
+	if (list == NULL)
+		return 0;
+	copy = strdup(list);
+	if (copy == NULL)
+		return -1;
+	rc = 0;
+	for (path = copy ; path != NULL ; path = next) {
+		next = strchr(path, ':');
+		if (next != NULL)
+			*next++ = 0;
+		if (*path && plugin_load(path) < 0)
+			rc = -1;
+	}
+	free(copy);
+	return rc;
+}
+
+/***************************************************************************************/
+/***************************************************************************************/
+/**                                                                                   **/
+/**                                                                                   **/
+/**       SECTION: HANDLING OF CONNECTION                                             **/
+/**                                                                                   **/
+/**                                                                                   **/
+/***************************************************************************************/
+/***************************************************************************************/
+/* declare the connection routine */
+static int source_connect(struct source *src);
+
+/*
+ * called on an event on the NMEA stream of the source
+ */
+static int on_event(sd_event_source *s, int fd, uint32_t revents, void *userdata)
+{
+	struct source *src = userdata;
+
+	/* read available data */
+	if ((revents & EPOLLIN) != 0) {
+		nmea_read(src);
+		event_send();
+	}
+
+	/* check if error or hangup */
+	if ((revents & (EPOLLERR|EPOLLRDHUP|EPOLLHUP)) != 0) {
+		sd_event_source_unref(s);
+		close(fd);
+		source_connect(src);
+	}
+
+	return 0;
+}
+
+#if WITH_IO_URING
+/*
+ * input of the sources through io_uring
+ *
+ * each source has a multishot receive pending in the ring that
+ * picks its buffers in a ring of buffers registered to the kernel.
+ * the completions of all the sources are signaled through one
+ * eventfd and processed in one batch, followed by one submission
+ * for the receives to restart.
+ */
+#define URING_ENTRIES        256	/* size of the submission queue */
+#define URING_BUFFER_COUNT   1024	/* count of buffers, must be a power of 2 */
+#define URING_BUFFER_SIZE    2048	/* size of one buffer */
+#define URING_GROUP          0		/* id of the group of buffers */
+
+static struct uring {
+	int active;			/* is the ring used? */
+	int efd;			/* eventfd signaling completions */
+	struct io_uring ring;		/* the ring */
+	struct io_uring_buf_ring *br;	/* the ring of buffers */
+	char *buffers;			/* memory of the buffers */
+} uring;
+
+/*
+ * queues the multishot receive for the source
+ * the caller is responsible of the submission
+ */
+static int uring_arm(struct source *src)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = io_uring_get_sqe(&uring.ring);
+	if (sqe == NULL) {
+		/* the submission queue is full, flush it */
+		io_uring_submit(&uring.ring);
+		sqe = io_uring_get_sqe(&uring.ring);
+		if (sqe == NULL)
+			return -EBUSY;
+	}
+	io_uring_prep_recv_multishot(sqe, src->fd, NULL, 0, 0);
+	sqe->flags |= IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_GROUP;
+	io_uring_sqe_set_data(sqe, src);
+	return 0;
+}
+
+/*
+ * processes the completions of the ring and restarts the receives
+ * returns the count of submitted entries
+ */
+static int uring_complete()
+{
+	struct io_uring_cqe *cqe;
+	struct source *src;
+	unsigned head, count;
+	int recycled;
+	unsigned short bid;
+	char *data;
+
+	count = 0;
+	recycled = 0;
+	io_uring_for_each_cqe(&uring.ring, head, cqe) {
+		count++;
+		src = io_uring_cqe_get_data(cqe);
+		if (cqe->flags & IORING_CQE_F_BUFFER) {
+			bid = (unsigned short)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+			data = &uring.buffers[(size_t)bid * URING_BUFFER_SIZE];
+			TRACE(read, src->fd, cqe->res);
+			if (cqe->res > 0) {
+				METRIC_ADD(bytes, cqe->res);
+				nmea_feed(src, data, (size_t)cqe->res);
+			}
+			io_uring_buf_ring_add(uring.br, data, URING_BUFFER_SIZE, bid,
+					io_uring_buf_ring_mask(URING_BUFFER_COUNT), recycled++);
+		}
+		if (!(cqe->flags & IORING_CQE_F_MORE)) {
+			/* the multishot receive is terminated */
+			if (cqe->res > 0 || cqe->res == -ENOBUFS)
+				uring_arm(src);
+			else {
+				/* end of stream or error */
+				close(src->fd);
+				source_connect(src);
+			}
+		}
+	}
+	io_uring_cq_advance(&uring.ring, count);
+	io_uring_buf_ring_advance(uring.br, recycled);
+	return io_uring_submit(&uring.ring);
+}
+
+/*
+ * processes the signaled completions of the ring
+ */
+static int uring_on_event(sd_event_source *s, int fd, uint32_t revents, void *userdata)
+{
+	uint64_t value;
+
+	/* acknowledge the signal */
+	read(fd, &value, sizeof value);
+	uring_complete();
+
+	/* publish once for the batch */
+	event_send();
+	return 0;
+}
+
+/*
+ * creates the ring and its buffers
+ * returns 0 or a negative error code
+ */
+static int uring_setup()
+{
+	int rc, i;
+
+	rc = io_uring_queue_init(URING_ENTRIES, &uring.ring, 0);
+	if (rc < 0)
+		return rc;
+
+	/* setup the ring of buffers */
+	uring.buffers = malloc(URING_BUFFER_COUNT * URING_BUFFER_SIZE);
+	if (uring.buffers == NULL) {
+		rc = -ENOMEM;
+		goto error;
+	}
+	uring.br = io_uring_setup_buf_ring(&uring.ring, URING_BUFFER_COUNT, URING_GROUP, 0, &rc);
+	if (uring.br == NULL)
+		goto error2;
+	for (i = 0 ; i < URING_BUFFER_COUNT ; i++)
+		io_uring_buf_ring_add(uring.br, &uring.buffers[(size_t)i * URING_BUFFER_SIZE],
+				URING_BUFFER_SIZE, (unsigned short)i,
+				io_uring_buf_ring_mask(URING_BUFFER_COUNT), i);
+	io_uring_buf_ring_advance(uring.br, URING_BUFFER_COUNT);
+	return 0;
+
+error2:
+	free(uring.buffers);
+error:
+	io_uring_queue_exit(&uring.ring);
+	return rc;
+}
+
+/*
+ * releases the ring and its buffers
+ */
+static void uring_release()
+{
+	io_uring_free_buf_ring(&uring.ring, uring.br, URING_BUFFER_COUNT, URING_GROUP);
+	free(uring.buffers);
+	io_uring_queue_exit(&uring.ring);
+}
+
+/*
+ * initialises the ring for the input
+ */
+static int uring_init()
+{
+	int rc;
+
+	rc = uring_setup();
+	if (rc < 0)
+		goto error;
+
+	/* signal the completions to the event loop */
+	uring.efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (uring.efd < 0) {
+		rc = -errno;
+		goto error2;
+	}
+	rc = io_uring_register_eventfd(&uring.ring, uring.efd);
+	if (rc < 0)
+		goto error3;
+	rc = sd_event_add_io(afb_daemon_get_event_loop(), NULL, uring.efd, EPOLLIN, uring_on_event, NULL);
+	if (rc < 0)
+		goto error3;
+
+	uring.active = 1;
+	AFB_NOTICE("reading the sources with io_uring");
+	return 0;
+
+error3:
+	close(uring.efd);
+error2:
+	uring_release();
+error:
+	AFB_ERROR("can't use io_uring: %s", strerror(-rc));
+	return rc;
+}
+#endif
+
+/*
+ * input of the sources in a real-time thread
+ *
+ * the thread polls the sources, decodes the sentences and commits
+ * the fixes without allocating memory. it signals the new fixes and
+ * the lost streams to the event loop through an eventfd, the publishing
+ * and the reconnections being done there, the event loop waking the
+ * thread up through another eventfd when the sources are reconnected.
+ * the pools are filled at init and the memory is locked.
+ */
+static struct {
+	int active;		/* is the real-time thread used? */
+	int priority;		/* SCHED_FIFO priority or 0 for the default policy */
+	int cpu;		/* cpu of the thread or -1 */
+	int efd;		/* eventfd signaling new fixes to the event loop */
+	int wake;		/* eventfd signaling reconnections to the thread */
+	pthread_t thread;	/* the thread */
+	struct pollfd *fds;	/* the polled sources then wake */
+} realtime;
+
+/*
+ * prepares the current thread for reading the sources in real-time:
+ * gets its metrics now and mutes its sampled messages, the binder
+ * allocating for logging them
+ */
+static void realtime_thread_init()
+{
+	metrics_get();
+	log_muted = 1;
+}
+
+/*
+ * the real-time thread
+ */
+static void *realtime_run(void *arg)
+{
+	int i, n, lost;
+	uint32_t generation;
+	uint64_t one = 1, count;
+	struct source *src;
+
+	realtime_thread_init();
+
+	generation = __atomic_load_n(&fix_generation, __ATOMIC_RELAXED);
+	realtime.fds[source_count].fd = realtime.wake;
+	realtime.fds[source_count].events = POLLIN;
+	for (;;) {
+		/* the sources not connected have a fd of -1 ignored by poll */
+		for (i = 0 ; i < source_count ; i++) {
+			realtime.fds[i].fd = __atomic_load_n(&sources[i].fd, __ATOMIC_ACQUIRE);
+			realtime.fds[i].events = POLLIN | POLLRDHUP;
+			realtime.fds[i].revents = 0;
+		}
+		realtime.fds[source_count].revents = 0;
+		n = poll(realtime.fds, (nfds_t)source_count + 1, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			AFB_ERROR("real-time poll failed: %m");
+			return NULL;
+		}
+		if (realtime.fds[source_count].revents != 0)
+			read(realtime.wake, &count, sizeof count);
+
+		lost = 0;
+		for (i = 0 ; i < source_count ; i++) {
+			if (realtime.fds[i].revents == 0)
+				continue;
+			src = &sources[i];
+			if ((realtime.fds[i].revents & POLLIN) != 0)
+				nmea_read(src);
+			if ((realtime.fds[i].revents & (POLLERR|POLLHUP|POLLRDHUP|POLLNVAL)) != 0) {
+				/* the event loop reconnects it */
+				close(src->fd);
+				__atomic_store_n(&src->fd, -1, __ATOMIC_RELAXED);
+				__atomic_store_n(&src->lost, 1, __ATOMIC_RELEASE);
+				lost = 1;
+			}
+		}
+
+		/* signal the new fixes and the lost streams to the event loop */
+		if (lost || generation != __atomic_load_n(&fix_generation, __ATOMIC_RELAXED)) {
+			generation = __atomic_load_n(&fix_generation, __ATOMIC_RELAXED);
+			write(realtime.efd, &one, sizeof one);
+		}
+	}
+}
+
+/*
+ * callback of the event loop publishing the fixes of the real-time thread
+ * and reconnecting the sources that it lost
+ */
+static int realtime_on_event(sd_event_source *s, int fd, uint32_t revents, void *userdata)
+{
+	int i, reconnected;
+	uint64_t count, one = 1;
+
+	read(fd, &count, sizeof count);
+	event_send();
+	reconnected = 0;
+	for (i = 0 ; i < source_count ; i++)
+		if (__atomic_exchange_n(&sources[i].lost, 0, __ATOMIC_ACQUIRE)
+		 && source_connect(&sources[i]) >= 0)
+			reconnected = 1;
+	if (reconnected)
+		write(realtime.wake, &one, sizeof one);
+	return 0;
+}
+
+/*
+ * prepares the real-time input as described by spec: priority[:cpu]
+ */
+static int realtime_init(const char *spec)
+{
+	char *end;
+	pthread_mutexattr_t attr;
+
+	realtime.priority = (int)strtol(spec, &end, 10);
+	realtime.cpu = *end == ':' ? (int)strtol(end + 1, &end, 10) : -1;
+	if (*end || realtime.priority < 0 || realtime.priority > sched_get_priority_max(SCHED_FIFO)) {
+		AFB_ERROR("invalid AFBGPS_REALTIME %s, expected priority[:cpu]", spec);
+		return -1;
+	}
+
+	/* allocates everything now */
+	if (pool_reserve(&pool_of_periods) < 0 || pool_reserve(&pool_of_events) < 0)
+		goto nomem;
+	realtime.fds = calloc((size_t)source_count + 1, sizeof *realtime.fds);
+	if (realtime.fds == NULL)
+		goto nomem;
+
+	/* the fix is shared with lower priority threads */
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_INHERIT);
+	pthread_mutex_init(&fix_lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	/* signal the fixes to the event loop */
+	realtime.efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	realtime.wake = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (realtime.efd < 0 || realtime.wake < 0
+	 || sd_event_add_io(afb_daemon_get_event_loop(), NULL, realtime.efd, EPOLLIN, realtime_on_event, NULL) < 0) {
+		AFB_ERROR("can't signal the real-time fixes: %m");
+		return -1;
+	}
+
+	/* avoid page faults */
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+		AFB_ERROR("can't lock the memory: %m");
+		return -1;
+	}
+
+	realtime.active = 1;
+	return 0;
+
+nomem:
+	AFB_ERROR("out of memory for the real-time input");
+	return -1;
+}
+
+/*
+ * starts the real-time thread
+ */
+static int realtime_start()
+{
+	int rc;
+	pthread_attr_t attr;
+	struct sched_param param;
+	cpu_set_t cpus;
+
+	pthread_attr_init(&attr);
+	if (realtime.priority > 0) {
+		param.sched_priority = realtime.priority;
+		pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+		pthread_attr_setschedparam(&attr, &param);
+	}
+	if (realtime.cpu >= 0) {
+		CPU_ZERO(&cpus);
+		CPU_SET((size_t)realtime.cpu, &cpus);
+		pthread_attr_setaffinity_np(&attr, sizeof cpus, &cpus);
+	}
+	rc = pthread_create(&realtime.thread, &attr, realtime_run, NULL);
+	pthread_attr_destroy(&attr);
+	if (rc != 0) {
+		AFB_ERROR("can't start the real-time thread: %s", strerror(rc));
+		return -1;
+	}
+	AFB_NOTICE("reading the sources in real-time, priority %d, cpu %d", realtime.priority, realtime.cpu);
+	return 0;
+}
+
+/*
+ * starts reading the connected source
+ */
+static int source_arm(struct source *src)
+{
+	if (realtime.active)
+		return 0;
+#if WITH_IO_URING
+	if (uring.active)
+		return uring_arm(src);
+#endif
+	return sd_event_add_io(afb_daemon_get_event_loop(), NULL, src->fd, EPOLLIN, on_event, src);
+}
+
+/*
+ * opens a socket to a host and a service (or port)
+ */
+static int open_socket_to(const char *host, const char *service)
+{
+	int rc, fd;
+	struct addrinfo hint, *rai, *iai;
+
+	/* get addr */
+	memset(&hint, 0, sizeof hint);
+	hint.ai_family = AF_INET;
+	hint.ai_socktype = SOCK_STREAM;
+	rc = getaddrinfo(host, service, &hint, &rai);
+	if (rc != 0)
+		return -1;
+
+	/* get the socket */
+	iai = rai;
+	while (iai != NULL) {
+		fd = socket(iai->ai_family, iai->ai_socktype, iai->ai_protocol);
+		if (fd >= 0) {
+			rc = connect(fd, iai->ai_addr, iai->ai_addrlen);
+			if (rc == 0) {
+				fcntl(fd, F_SETFL, O_NONBLOCK);
+				freeaddrinfo(rai);
+				return fd;
+			}
+			close(fd);
+		}
+		iai = iai->ai_next;
+	}
+	freeaddrinfo(rai);
+	return -1;
+}
+
+/*
+ * connection of the source to its nmea stream
+ */
+static int source_connect(struct source *src)
+{
+	int rc, fd;
+
+	src->fd = -1;
+	src->pos = 0;
+	src->overflow = 0;
+	fd = open_socket_to(src->host, src->service);
+	if (fd < 0) {
+		AFB_ERROR("can't connect to host %s, service %s", src->host, src->service);
+		return fd;
+	}
+	if (isgpsd) {
+		static const char gpsdsetup[] = "?WATCH={\"enable\":true,\"nmea\":true};\r\n";
+		write(fd, gpsdsetup, sizeof gpsdsetup - 1);
+	}
+
+	/* adds to the input, the real-time thread reading it once set */
+	__atomic_store_n(&src->fd, fd, __ATOMIC_RELEASE);
+	rc = source_arm(src);
+	if (rc < 0) {
+		close(fd);
+		src->fd = -1;
+		AFB_ERROR("can't coonect host %s, service %s to the event loop", src->host, src->service);
+	} else {
+		AFB_NOTICE("Connected to host %s, service %s", src->host, src->service);
+	}
+	return rc;
+}
+
+/*
+ * adds the source of spec "host:service"
+ */
+static int source_add(char *spec)
+{
+	struct source *src;
+	char *colon;
+
+	colon = strrchr(spec, ':');
+	if (colon == NULL || colon == spec || colon[1] == 0) {
+		AFB_ERROR("invalid source %s, expected host:service", spec);
+		return -1;
+	}
+	src = realloc(sources, (size_t)(source_count + 1) * sizeof *sources);
+	if (src == NULL)
+		return -1;
+	sources = src;
+	src = &sources[source_count];
+	memset(src, 0, sizeof *src);
+	*colon = 0;
+	src->host = spec;
+	src->service = colon + 1;
+	src->index = source_count++;
+	return 0;
+}
+
+/*
+ * connection to the nmea streams
+ */
+static int connection()
+{
+	char *list, *spec, *next;
+	int i, rc, connected;
+
+	/* get the sources */
+	isgpsd = getenv("AFBGPS_ISNMEA") ? 0 : 1;
+	list = getenv("AFBGPS_SOURCES");
+	if (list == NULL) {
+		/* TODO connect to somewhere else */
+		rc = asprintf(&list, "%s:%s",
+			getenv("AFBGPS_HOST") ? : "sinagot.net",
+			getenv("AFBGPS_SERVICE") ? : "5001");
+	} else {
+		list = strdup(list);
+		rc = list == NULL ? -1 : 0;
+	}
+	if (rc < 0)
+		return -1;
+
+	/* the list is split in place and kept for the sources */
+	for (spec = list ; spec != NULL ; spec = next) {
+		next = strchr(spec, ',');
+		if (next != NULL)
+			*next++ = 0;
+		if (*spec && source_add(spec) < 0)
+			return -1;
+	}
+
+	/* use a real-time thread when requested */
+	if (getenv("AFBGPS_REALTIME")) {
+		if (realtime_init(getenv("AFBGPS_REALTIME")) < 0)
+			return -1;
+	}
+#if WITH_IO_URING
+	/* use io_uring when requested */
+	else if (getenv("AFBGPS_IO_URING") && uring_init() < 0)
+		return -1;
+#endif
+
+	/* connect the sources */
+	connected = 0;
+	rc = -1;
+	for (i = 0 ; i < source_count ; i++) {
+		rc = source_connect(&sources[i]);
+		if (rc >= 0)
+			connected++;
+	}
+#if WITH_IO_URING
+	if (uring.active)
+		io_uring_submit(&uring.ring);
+#endif
+	if (realtime.active && realtime_start() < 0)
+		return -1;
+	return connected ? 0 : rc;
+}
+
+/***************************************************************************************/
+/***************************************************************************************/
+/**                                                                                   **/
+/**                                                                                   **/
+/**       SECTION: DEAD RECKONING                                                     **/
+/**                                                                                   **/
+/**                                                                                   **/
+/***************************************************************************************/
+/***************************************************************************************/
+/*
+ * a signal of the CAN frames
+ *
+ * the value is the big endian integer of size bytes at offset
+ * in the data of the frames of id, multiplied by scale
+ */
+struct signal {
+	uint32_t id;		/* id of the frames */
+	unsigned offset;	/* offset of the value in the data */
+	unsigned size;		/* size of the value in bytes */
+	double scale;		/* scale of the value */
+	int issigned;		/* is the value signed? */
+};
+
+/*
+ * the dead reckoning from the wheel speed and the yaw rate read on CAN
+ *
+ * when no fix comes during outage ms, positions are computed every
+ * period ms from the last fix, the speed and the yaw rate, and
+ * committed as dead-reckoned fixes whose accuracy grows with the
+ * distance travelled. the times are in ms of the monotonic clock.
+ */
+static struct {
+	int fd;			/* the CAN socket */
+	uint32_t period;	/* period of reckoning in ms */
+	uint32_t outage;	/* delay without fix before reckoning in ms */
+	struct signal speed_signal;	/* the wheel speed in m/s */
+	struct signal yaw_signal;	/* the yaw rate in degree/s, positive to the left */
+	double speed_value;	/* last speed read */
+	double yaw_value;	/* last yaw rate read */
+	uint64_t speed_time;	/* time of the last speed read */
+	uint64_t yaw_time;	/* time of the last yaw rate read */
+	uint32_t generation;	/* generation of the last fix seen */
+	uint64_t fix_time;	/* time of the last fix not reckoned */
+	uint64_t time;		/* time of the state below */
+	int valid;		/* is the state valid? */
+	unsigned hasalt;	/* is the altitude known? */
+	double latitude;	/* latitude in degree */
+	double longitude;	/* longitude in degree */
+	double altitude;	/* altitude in m */
+	double speed;		/* speed in m/s */
+	double track;		/* track in degree */
+	double accuracy;	/* accuracy in m */
+} reckon = {
+	.fd = -1,
+	.period = DEFAULT_CAN_PERIOD,
+	.outage = DEFAULT_CAN_OUTAGE,
+	.yaw_signal.id = CAN_EFF_MASK + 1
+};
+
+/*
+ * get the time of the monotonic clock in ms
+ */
+static uint64_t reckon_now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+/*
+ * reads in signal the description spec: id:offset:size:scale
+ * returns 0 or -1 if invalid
+ */
+static int signal_parse(const char *spec, struct signal *signal, int issigned)
+{
+	char end;
+
+	if (sscanf(spec, "%i:%u:%u:%lf%c", (int*)&signal->id, &signal->offset, &signal->size, &signal->scale, &end) != 4
+	 || signal->size < 1 || signal->size > 4 || signal->offset + signal->size > CAN_MAX_DLEN) {
+		AFB_ERROR("invalid CAN signal %s, expected id:offset:size:scale", spec);
+		return -1;
+	}
+	signal->issigned = issigned;
+	return 0;
+}
+
+/*
+ * get in value the signal from the frame
+ * returns 1 if found or 0 otherwise
+ */
+static int signal_get(const struct signal *signal, const struct can_frame *frame, double *value)
+{
+	uint32_t id, raw;
+	unsigned i;
+
+	id = frame->can_id & ((frame->can_id & CAN_EFF_FLAG) ? CAN_EFF_MASK : CAN_SFF_MASK);
+	if (id != signal->id || signal->offset + signal->size > frame->can_dlc)
+		return 0;
+
+	raw = 0;
+	for (i = 0 ; i < signal->size ; i++)
+		raw = (raw << 8) | frame->data[signal->offset + i];
+	if (signal->issigned && signal->size < 4 && (raw & (1u << (8 * signal->size - 1))))
+		raw |= ~0u << (8 * signal->size);
+	*value = (signal->issigned ? (double)(int32_t)raw : (double)raw) * signal->scale;
+	return 1;
+}
+
+/*
+ * records the signals of the frame received at now
+ */
+static void reckon_frame(const struct can_frame *frame, uint64_t now)
+{
+	if (signal_get(&reckon.speed_signal, frame, &reckon.speed_value))
+		reckon.speed_time = now;
+	if (signal_get(&reckon.yaw_signal, frame, &reckon.yaw_value))
+		reckon.yaw_time = now;
+}
+
+/*
+ * callback of the event loop reading the CAN frames
+ */
+static int reckon_on_can(sd_event_source *s, int fd, uint32_t revents, void *userdata)
+{
+	struct can_frame frame;
+	uint64_t now;
+
+	now = reckon_now();
+	while (read(fd, &frame, sizeof frame) == (ssize_t)sizeof frame)
+		reckon_frame(&frame, now);
+	return 0;
+}
+
+/*
+ * restarts the reckoning from the last fix unless it is reckoned
+ */
+static void reckon_restart(uint64_t now)
+{
+	struct fix fix;
+
+	reckon.generation = fix_snapshot(&fix);
+	if (fix.reckoned)
+		return;
+	fix_decode(&fix, FIELDS_ALL);
+	if (!fix.gps.set.latitude || !fix.gps.set.longitude)
+		return;
+
+	reckon.valid = 1;
+	reckon.fix_time = reckon.time = now;
+	reckon.latitude = fix.gps.latitude;
+	reckon.longitude = fix.gps.longitude;
+	reckon.hasalt = fix.gps.set.altitude;
+	reckon.altitude = fix.gps.altitude;
+	if (fix.gps.set.speed)
+		reckon.speed = fix.gps.speed;
+	if (fix.gps.set.track)
+		reckon.track = fix.gps.track;
+	reckon.accuracy = (fix.hdop > 0 ? fix.hdop : DEFAULT_HDOP) * RECKON_UERE;
+}
+
+/*
+ * moves the state to now and commits it as a dead-reckoned fix
+ */
+static void reckon_step(uint64_t now)
+{
+	struct fix fix;
+	struct timeval tv;
+	double dt, distance;
+
+	/* integrates the move */
+	dt = (double)(now - reckon.time) * 0.001;
+	reckon.time = now;
+	if (now - reckon.speed_time <= CAN_FRESHNESS)
+		reckon.speed = reckon.speed_value;
+	if (now - reckon.yaw_time <= CAN_FRESHNESS)
+		reckon.track = angle_normal(reckon.track - reckon.yaw_value * dt);
+	distance = reckon.speed * dt;
+	geo_destination(reckon.latitude, reckon.longitude, reckon.track, distance,
+			&reckon.latitude, &reckon.longitude);
+	reckon.accuracy += distance * RECKON_DRIFT;
+
+	/* commits the fix */
+	memset(&fix, 0, offsetof(struct fix, text));
+	gettimeofday(&tv, NULL);
+	fix.gps.time = (uint32_t)(((uint64_t)tv.tv_sec * 1000 + (uint64_t)tv.tv_usec / 1000) % MILLISECOND_PER_DAY);
+	fix.gps.latitude = reckon.latitude;
+	fix.gps.longitude = reckon.longitude;
+	fix.gps.altitude = reckon.altitude;
+	fix.gps.speed = reckon.speed;
+	fix.gps.track = reckon.track;
+	fix.gps.set.time = fix.gps.set.latitude = fix.gps.set.longitude = 1;
+	fix.gps.set.speed = fix.gps.set.track = 1;
+	fix.gps.set.altitude = reckon.hasalt & 1;
+	fix.reckoned = 1;
+	fix.accuracy = reckon.accuracy;
+	fix_commit(NULL, &fix);
+	event_send();
+}
+
+/*
+ * reckons at now if no fix came during the outage
+ */
+static void reckon_tick(uint64_t now)
+{
+	if (reckon.generation != __atomic_load_n(&fix_generation, __ATOMIC_RELAXED))
+		reckon_restart(now);
+	if (reckon.valid && now - reckon.fix_time >= reckon.outage)
+		reckon_step(now);
+}
+
+/*
+ * callback of the timer of the reckoning
+ */
+static int reckon_on_timer(sd_event_source *s, uint64_t usec, void *userdata)
+{
+	reckon_tick(reckon_now());
+	sd_event_source_set_time(s, usec + (uint64_t)reckon.period * 1000);
+	sd_event_source_set_enabled(s, SD_EVENT_ON);
+	return 0;
+}
+
+/*
+ * starts the dead reckoning if AFBGPS_CAN is set
+ */
+static int reckon_init()
+{
+	const char *itf, *speed, *yaw;
+	struct sockaddr_can addr;
+	struct can_filter filters[2];
+	sd_event_source *timer;
+	uint64_t usec;
+	int rc;
+
+	itf = getenv("AFBGPS_CAN");
+	if (itf == NULL)
+		return 0;
+	speed = getenv("AFBGPS_CAN_SPEED");
+	yaw = getenv("AFBGPS_CAN_YAW");
+	if (speed == NULL) {
+		AFB_ERROR("AFBGPS_CAN_SPEED must be set with AFBGPS_CAN");
+		return -1;
+	}
+	if (signal_parse(speed, &reckon.speed_signal, 0) < 0 || (yaw != NULL && signal_parse(yaw, &reckon.yaw_signal, 1) < 0))
+		return -1;
+	reckon.period = env_unsigned("AFBGPS_CAN_PERIOD", DEFAULT_CAN_PERIOD);
+	reckon.outage = env_unsigned("AFBGPS_CAN_OUTAGE", DEFAULT_CAN_OUTAGE);
+
+	/* opens the CAN socket receiving only the signals */
+	memset(&addr, 0, sizeof addr);
+	addr.can_family = AF_CAN;
+	addr.can_ifindex = (int)if_nametoindex(itf);
+	if (addr.can_ifindex == 0)
+		goto error;
+	reckon.fd = socket(PF_CAN, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, CAN_RAW);
+	if (reckon.fd < 0)
+		goto error;
+	filters[0].can_id = reckon.speed_signal.id;
+	filters[0].can_mask = CAN_EFF_MASK;
+	filters[1].can_id = reckon.yaw_signal.id;
+	filters[1].can_mask = CAN_EFF_MASK;
+	if (setsockopt(reckon.fd, SOL_CAN_RAW, CAN_RAW_FILTER, filters, (socklen_t)((yaw != NULL ? 2 : 1) * sizeof *filters)) < 0
+	 || bind(reckon.fd, (struct sockaddr*)&addr, sizeof addr) < 0)
+		goto error2;
+
+	/* reads the frames and reckons periodically in the event loop */
+	rc = sd_event_add_io(afb_daemon_get_event_loop(), NULL, reckon.fd, EPOLLIN, reckon_on_can, NULL);
+	if (rc >= 0) {
+		sd_event_now(afb_daemon_get_event_loop(), CLOCK_MONOTONIC, &usec);
+		rc = sd_event_add_time(afb_daemon_get_event_loop(), &timer, CLOCK_MONOTONIC,
+				usec + (uint64_t)reckon.period * 1000, 0, reckon_on_timer, NULL);
+	}
+	if (rc < 0) {
+		errno = -rc;
+		goto error2;
+	}
+	sd_event_source_set_enabled(timer, SD_EVENT_ON);
+	AFB_NOTICE("dead reckoning with CAN interface %s", itf);
+	return 0;
+
+error2:
+	close(reckon.fd);
+	reckon.fd = -1;
+error:
+	AFB_ERROR("can't read the CAN interface %s: %m", itf);
+	return -1;
+}
+
+/***************************************************************************************/
+/***************************************************************************************/
+/**                                                                                   **/
+/**                                                                                   **/
+/**       SECTION: PERSISTING TRACKS                                                  **/
+/**                                                                                   **/
+/**                                                                                   **/
+/***************************************************************************************/
+/***************************************************************************************/
+/*
+ * persists the track of the fixes in AFBGPS_TRACK_DIR
+ *
+ * every AFBGPS_TRACK_PERIOD, the new fixes of the history are appended
+ * as a block to the file track.dat and the description of the block,
+ * its time range and its bounding box, is appended to track.idx.
+ * the points of a block are stored by columns: the stamps, then the
+ * latitudes, then the longitudes. the descriptions of the blocks are
+ * kept in memory for the queries to read only the blocks that can match.
+ */
+struct track_block {
+	uint64_t first;		/* stamp of the first point */
+	uint64_t last;		/* stamp of the last point */
+	double south;		/* minimal latitude */
+	double north;		/* maximal latitude */
+	double west;		/* western longitude */
+	double span;		/* eastward span in degree from the western longitude */
+	uint64_t offset;	/* offset of the block in track.dat */
+	uint32_t count;		/* count of points */
+	uint32_t reserved;	/* 0 */
+};
+
+struct track {
+	int data;			/* file of the points */
+	int index;			/* file of the blocks */
+	unsigned period;		/* period of the blocks in ms */
+	uint32_t seq;			/* sequence of the last fix persisted */
+	uint64_t size;			/* size of the file of the points */
+	struct track_block *blocks;	/* the blocks */
+	unsigned count;			/* count of blocks */
+	unsigned capacity;		/* allocated count of blocks */
+	pthread_mutex_t lock;		/* protects the blocks */
+};
+
+/* the track of the fixes */
+static struct track track = { .data = -1, .index = -1, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/*
+ * get the size in the file of the points of the block
+ */
+static inline uint64_t track_block_size(const struct track_block *b)
+{
+	return (uint64_t)b->count * (sizeof(uint64_t) + 2 * sizeof(double));
+}
+
+/*
+ * adds the block to the blocks of t in memory
+ * returns 0 or -1 when out of memory
+ */
+static int track_block_add(struct track *t, const struct track_block *b)
+{
+	struct track_block *blocks;
+	unsigned capacity;
+
+	pthread_mutex_lock(&t->lock);
+	if (t->count == t->capacity) {
+		capacity = t->capacity ? 2 * t->capacity : 1024;
+		blocks = realloc(t->blocks, capacity * sizeof *blocks);
+		if (blocks == NULL) {
+			pthread_mutex_unlock(&t->lock);
+			return -1;
+		}
+		t->blocks = blocks;
+		t->capacity = capacity;
+	}
+	t->blocks[t->count++] = *b;
+	pthread_mutex_unlock(&t->lock);
+	return 0;
+}
+
+/*
+ * appends to t the block of the n points of the columns stamps, lats and lons
+ * the files are written at the end of their valid content, so that a
+ * failure only leaves bytes that the next block overwrites
+ * returns 0 or -1 on error
+ */
+static int track_append(struct track *t, uint64_t *stamps, double *lats, double *lons, unsigned n)
+{
+	struct track_block b;
+	struct iovec iov[3];
+	double d, dmin, dmax;
+	unsigned i;
+
+	/* the bounding box, the longitudes being relative to the first one */
+	memset(&b, 0, sizeof b);
+	b.first = stamps[0];
+	b.last = stamps[n - 1];
+	b.south = b.north = lats[0];
+	dmin = dmax = 0;
+	for (i = 1 ; i < n ; i++) {
+		b.south = fmin(b.south, lats[i]);
+		b.north = fmax(b.north, lats[i]);
+		d = angle_delta(lons[0], lons[i]);
+		dmin = fmin(dmin, d);
+		dmax = fmax(dmax, d);
+	}
+	b.west = angle_normal(lons[0] + dmin);
+	b.span = dmax - dmin;
+	b.offset = t->size;
+	b.count = n;
+
+	/* the points and then the block for never indexing missing points */
+	iov[0].iov_base = stamps;
+	iov[0].iov_len = n * sizeof *stamps;
+	iov[1].iov_base = lats;
+	iov[1].iov_len = n * sizeof *lats;
+	iov[2].iov_base = lons;
+	iov[2].iov_len = n * sizeof *lons;
+	if (pwritev(t->data, iov, 3, (off_t)t->size) != (ssize_t)track_block_size(&b)
+	 || pwrite(t->index, &b, sizeof b, (off_t)(t->count * sizeof b)) != (ssize_t)sizeof b
+	 || track_block_add(t, &b) < 0)
+		return -1;
+	t->size += track_block_size(&b);
+	return 0;
+}
+
+/*
+ * appends the new fixes of the history as a block
+ */
+static void track_flush()
+{
+	struct record *records;
+	uint64_t *stamps, last;
+	double *lats, *lons;
+	unsigned i, n, count;
+	uint32_t seq;
+	int complete;
+
+	records = history_since(track.seq, &count, &complete);
+	if (records == NULL || count == 0) {
+		free(records);
+		return;
+	}
+	if (!complete)
+		AFB_WARNING("fixes lost for the track, out of order or AFBGPS_HISTORY too small for AFBGPS_TRACK_PERIOD");
+	seq = records[count - 1].fix.seq;
+
+	/* the columns of the points in place of the records */
+	stamps = malloc(count * (sizeof *stamps + 2 * sizeof *lats));
+	if (stamps == NULL) {
+		free(records);
+		return;
+	}
+	lats = (double*)&stamps[count];
+	lons = &lats[count];
+	last = track.count ? track.blocks[track.count - 1].last : 0;
+	for (i = n = 0 ; i < count ; i++) {
+		fix_decode(&records[i].fix, FIELD_BIT(field_latitude) | FIELD_BIT(field_longitude));
+		if (records[i].stamp > last && records[i].fix.gps.set.latitude && records[i].fix.gps.set.longitude) {
+			stamps[n] = records[i].stamp;
+			lats[n] = records[i].fix.gps.latitude;
+			lons[n] = records[i].fix.gps.longitude;
+			n++;
+		}
+	}
+	free(records);
+
+	/* on error, the fixes are appended again by the next flush */
+	if (n == 0 || track_append(&track, stamps, lats, lons, n) == 0)
+		track.seq = seq;
+	else
+		AFB_ERROR("can't persist the track: %m");
+	free(stamps);
+}
+
+/*
+ * callback of the timer of the track
+ */
+static int track_on_timer(sd_event_source *s, uint64_t usec, void *userdata)
+{
+	track_flush();
+	sd_event_source_set_time(s, usec + (uint64_t)track.period * 1000);
+	sd_event_source_set_enabled(s, SD_EVENT_ON);
+	return 0;
+}
+
+/*
+ * opens the file of name in dir
+ */
+static int track_open(const char *dir, const char *name)
+{
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof path, "%s/%s", dir, name);
+	return open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+}
+
+/*
+ * loads the blocks of the track t, dropping the blocks
+ * whose points are missing after a crash
+ */
+static int track_load(struct track *t)
+{
+	struct stat st;
+	struct track_block b;
+	off_t offset;
+
+	if (fstat(t->data, &st) < 0)
+		return -1;
+	for (offset = 0 ; pread(t->index, &b, sizeof b, offset) == (ssize_t)sizeof b ; offset += (off_t)sizeof b) {
+		if (b.offset != t->size || b.offset + track_block_size(&b) > (uint64_t)st.st_size)
+			break;
+		if (track_block_add(t, &b) < 0)
+			return -1;
+		t->size += track_block_size(&b);
+	}
+	if (ftruncate(t->index, offset) < 0 || ftruncate(t->data, (off_t)t->size) < 0)
+		return -1;
+	return 0;
+}
+
+/*
+ * starts the persistence of the track if AFBGPS_TRACK_DIR is set
+ */
+static int track_init()
+{
+	const char *dir;
+	sd_event_source *timer;
+	uint64_t usec;
+	int rc;
+
+	dir = getenv("AFBGPS_TRACK_DIR");
+	if (dir == NULL)
+		return 0;
+	track.period = env_unsigned("AFBGPS_TRACK_PERIOD", DEFAULT_TRACK_PERIOD);
+	track.data = track_open(dir, "track.dat");
+	track.index = track_open(dir, "track.idx");
+	if (track.data < 0 || track.index < 0 || track_load(&track) < 0) {
+		AFB_ERROR("can't open the track in %s: %m", dir);
+		return -1;
+	}
+
+	sd_event_now(afb_daemon_get_event_loop(), CLOCK_MONOTONIC, &usec);
+	rc = sd_event_add_time(afb_daemon_get_event_loop(), &timer, CLOCK_MONOTONIC,
+			usec + (uint64_t)track.period * 1000, 0, track_on_timer, NULL);
+	if (rc < 0) {
+		AFB_ERROR("can't add the timer of the track: %s", strerror(-rc));
+		return -1;
+	}
+	sd_event_source_set_enabled(timer, SD_EVENT_ON);
+	AFB_NOTICE("track of %u blocks in %s", track.count, dir);
+	return 0;
+}
+
+/*
+ * can a point of the block be within distance of the point?
+ */
+static int track_block_near(const struct track_block *b, double lat, double lon, double distance)
+{
+	double dlat, dlon, c;
+
+	dlat = distance / METER_PER_DEGREE;
+	if (lat < b->south - dlat || lat > b->north + dlat)
+		return 0;
+	c = cos(fmin(fmax(fabs(b->south), fabs(b->north)) + dlat, 90) * RADIAN_PER_DEGREE);
+	if (c < 1e-6)
+		return 1;
+	dlon = dlat / c;
+	return dlon >= 180 || angle_normal(lon - b->west + dlon) <= b->span + 2 * dlon;
+}
+
+/*
+ * adds to array the points of the track t from 'from' to 'to'
+ * within distance of the point, at most limit points
+ * can be called from any thread
+ * returns the count of points added or -1 on error
+ */
+static int track_near(struct track *t, struct json_object *array, double lat, double lon, double distance,
+			uint64_t from, uint64_t to, unsigned limit)
+{
+	struct track_block *blocks;
+	uint64_t *stamps;
+	double *lats, *lons, *dists;
+	struct json_object *obj;
+	unsigned i, j, n, count;
+
+	/* the blocks that can match */
+	pthread_mutex_lock(&t->lock);
+	blocks = malloc((t->count ? t->count : 1) * sizeof *blocks);
+	for (i = n = 0 ; blocks != NULL && i < t->count ; i++)
+		if (t->blocks[i].last >= from && t->blocks[i].first <= to
+		 && track_block_near(&t->blocks[i], lat, lon, distance))
+			blocks[n++] = t->blocks[i];
+	METRIC_ADD(blocks_skipped, t->count - n);
+	pthread_mutex_unlock(&t->lock);
+	if (blocks == NULL)
+		return -1;
+
+	/* the points of these blocks */
+	count = 0;
+	for (i = 0 ; i < n && count < limit ; i++) {
+		stamps = malloc(track_block_size(&blocks[i]) + blocks[i].count * sizeof *dists);
+		if (stamps == NULL
+		 || pread(t->data, stamps, track_block_size(&blocks[i]), (off_t)blocks[i].offset)
+				!= (ssize_t)track_block_size(&blocks[i])) {
+			free(stamps);
+			free(blocks);
+			return -1;
+		}
+		METRIC_INC(blocks_read);
+		lats = (double*)&stamps[blocks[i].count];
+		lons = &lats[blocks[i].count];
+		dists = &lons[blocks[i].count];
+		geo_haversine_batch(lat, lon, lats, lons, dists, blocks[i].count);
+		for (j = 0 ; j < blocks[i].count && count < limit ; j++)
+			if (dists[j] <= distance && stamps[j] >= from && stamps[j] <= to) {
+				obj = json_object_new_object();
+				json_object_object_add(obj, "time", json_object_new_int64((int64_t)stamps[j]));
+				json_object_object_add(obj, "latitude", json_object_new_double(lats[j]));
+				json_object_object_add(obj, "longitude", json_object_new_double(lons[j]));
+				json_object_object_add(obj, "distance", json_object_new_double(dists[j]));
+				json_object_array_add(array, obj);
+				count++;
+			}
+		free(stamps);
+	}
+	free(blocks);
+	return (int)count;
+}
+
+/*
+ * get the records of the points of the track t stamped from 'from' to 'to'
+ * included, whose fixes only have the latitude and the longitude
+ * the count of records is stored in count
+ * can be called from any thread
+ * returns the array of the records to be freed or NULL on error
+ */
+static struct record *track_between(struct track *t, uint64_t from, uint64_t to, unsigned *count)
+{
+	struct track_block *blocks;
+	struct record *result;
+	uint64_t *stamps;
+	double *lats, *lons;
+	unsigned i, j, n, total;
+
+	/* the blocks of the range */
+	pthread_mutex_lock(&t->lock);
+	blocks = malloc((t->count ? t->count : 1) * sizeof *blocks);
+	for (i = n = total = 0 ; blocks != NULL && i < t->count ; i++)
+		if (t->blocks[i].last >= from && t->blocks[i].first <= to) {
+			blocks[n++] = t->blocks[i];
+			total += t->blocks[i].count;
+		}
+	pthread_mutex_unlock(&t->lock);
+	if (blocks == NULL)
+		return NULL;
+
+	/* the points of these blocks */
+	*count = 0;
+	result = malloc((total ? total : 1) * sizeof *result);
+	for (i = 0 ; result != NULL && i < n ; i++) {
+		stamps = malloc(track_block_size(&blocks[i]));
+		if (stamps == NULL
+		 || pread(t->data, stamps, track_block_size(&blocks[i]), (off_t)blocks[i].offset)
+				!= (ssize_t)track_block_size(&blocks[i])) {
+			free(stamps);
+			free(result);
+			result = NULL;
+			break;
+		}
+		METRIC_INC(blocks_read);
+		lats = (double*)&stamps[blocks[i].count];
+		lons = &lats[blocks[i].count];
+		for (j = 0 ; j < blocks[i].count ; j++)
+			if (stamps[j] >= from && stamps[j] <= to) {
+				memset(&result[*count], 0, offsetof(struct record, fix.text));
+				result[*count].stamp = stamps[j];
+				result[*count].fix.gps.latitude = lats[j];
+				result[*count].fix.gps.longitude = lons[j];
+				result[*count].fix.gps.set.latitude = result[*count].fix.gps.set.longitude = 1;
+				(*count)++;
+			}
+		free(stamps);
+	}
+	free(blocks);
+	return result;
+}
+
+/***************************************************************************************/
+/***************************************************************************************/
+/**                                                                                   **/
+/**                                                                                   **/
+/**       SECTION: EXPORTING HISTORY                                                  **/
+/**                                                                                   **/
+/**                                                                                   **/
+/***************************************************************************************/
+/***************************************************************************************/
+/*
+ * exports the history in Apache Arrow IPC streams
+ *
+ * the columns are filled directly from the records of the history,
+ * preceded by the points of the persisted track older than the history,
+ * by batches of EXPORT_BATCH fixes, the absent fields being nulls.
+ * the records of the history are copied one batch at a time, so that
+ * fix_lock is held for copying one batch only
+ */
+enum column {
+	column_time,
+	column_seq,
+	column_latitude,
+	column_longitude,
+	column_altitude,
+	column_speed,
+	column_track,
+	column_hdop,
+	column_quality,
+	column_reckoned,
+	column_COUNT
+};
+
+/* a batch of columns */
+struct batch {
+	int64_t times[EXPORT_BATCH];
+	uint32_t seqs[EXPORT_BATCH];
+	double values[column_hdop - column_latitude + 1][EXPORT_BATCH];
+	int8_t quality[EXPORT_BATCH];
+	int8_t reckoned[EXPORT_BATCH];
+	uint8_t validity[column_COUNT][EXPORT_BATCH / 8];	/* of the doubles */
+	struct arrow_column columns[column_COUNT];
+};
+
+/*
+ * initialises the columns of the batch
+ */
+static void export_init(struct batch *b)
+{
+	static const char *names[column_COUNT] = {
+		"time", "seq", "latitude", "longitude", "altitude", "speed", "track", "hdop", "quality", "reckoned"
+	};
+	int c;
+
+	memset(b->columns, 0, sizeof b->columns);
+	for (c = 0 ; c < column_COUNT ; c++) {
+		b->columns[c].name = names[c];
+		b->columns[c].type = arrow_double;
+	}
+	b->columns[column_time].type = arrow_timestamp_ms;
+	b->columns[column_time].values = b->times;
+	b->columns[column_seq].type = arrow_uint32;
+	b->columns[column_seq].values = b->seqs;
+	b->columns[column_seq].validity = b->validity[column_seq];
+	b->columns[column_quality].type = arrow_int8;
+	b->columns[column_quality].values = b->quality;
+	b->columns[column_quality].validity = b->validity[column_quality];
+	b->columns[column_reckoned].type = arrow_int8;
+	b->columns[column_reckoned].values = b->reckoned;
+	b->columns[column_reckoned].validity = b->validity[column_reckoned];
+	for (c = column_latitude ; c <= column_hdop ; c++) {
+		b->columns[c].values = b->values[c - column_latitude];
+		b->columns[c].validity = b->validity[c];
+	}
+}
+
+/*
+ * sets the value of the column c at row as valid or not
+ */
+static inline void export_valid(struct batch *b, int c, unsigned row, int valid)
+{
+	if (valid)
+		b->validity[c][row >> 3] |= (uint8_t)(1 << (row & 7));
+	else
+		b->columns[c].null_count++;
+}
+
+/*
+ * sets the double of the column c at row as valid or not
+ */
+static inline void export_value(struct batch *b, int c, unsigned row, double value, int valid)
+{
+	b->values[c - column_latitude][row] = valid ? value : 0;
+	export_valid(b, c, row, valid);
+}
+
+/*
+ * fills the batch with the count records
+ */
+static void export_fill(struct batch *b, struct record *records, unsigned count)
+{
+	unsigned row;
+	int c;
+	struct fix *fix;
+
+	memset(b->validity, 0, sizeof b->validity);
+	for (c = 0 ; c < column_COUNT ; c++)
+		b->columns[c].null_count = 0;
+	for (row = 0 ; row < count ; row++) {
+		fix = &records[row].fix;
+		fix_decode(fix, FIELDS_ALL);
+		b->times[row] = (int64_t)records[row].stamp;
+		b->seqs[row] = fix->seq;
+		b->quality[row] = (int8_t)fix->quality;
+		b->reckoned[row] = (int8_t)fix->reckoned;
+		/* the points of the track have no sequence */
+		export_valid(b, column_seq, row, fix->seq != 0);
+		export_valid(b, column_reckoned, row, fix->seq != 0);
+		export_value(b, column_latitude, row, fix->gps.latitude, fix->gps.set.latitude);
+		export_value(b, column_longitude, row, fix->gps.longitude, fix->gps.set.longitude);
+		export_value(b, column_altitude, row, fix->gps.altitude, fix->gps.set.altitude);
+		export_value(b, column_speed, row, fix->gps.speed, fix->gps.set.speed);
+		export_value(b, column_track, row, fix->gps.track, fix->gps.set.track);
+		export_value(b, column_hdop, row, fix->hdop, fix->hdop > 0);
+		export_valid(b, column_quality, row, fix->quality > 0);
+	}
+}
+
+/*
+ * writes in file the batches of the count records
+ * returns 0 or -1 on error
+ */
+static int export_batches(FILE *file, struct batch *b, struct record *records, unsigned count)
+{
+	unsigned i, n;
+
+	for (i = 0 ; i < count ; i += n) {
+		n = count - i < EXPORT_BATCH ? count - i : EXPORT_BATCH;
+		export_fill(b, &records[i], n);
+		if (arrow_write_batch(file, b->columns, column_COUNT, n) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * writes in file the stream of the history from 'from' to 'to',
+ * completed by the persisted track before the oldest fix of the history
+ * the count of rows is stored in rows and the range of the exported
+ * times in from and to
+ * returns 0 or a negative errno
+ */
+static int export_write(FILE *file, uint64_t *from, uint64_t *to, unsigned *rows)
+{
+	struct batch *b;
+	struct record *records, *points;
+	unsigned n, count;
+	uint64_t first, last;
+	int rc;
+
+	*rows = 0;
+	b = malloc(sizeof *b);
+	records = malloc(EXPORT_BATCH * sizeof *records);
+	if (b == NULL || records == NULL) {
+		free(b);
+		free(records);
+		return -ENOMEM;
+	}
+	export_init(b);
+	rc = arrow_write_schema(file, b->columns, column_COUNT) < 0 ? -EIO : 0;
+	n = history_between(*from, *to, records, EXPORT_BATCH);
+	first = n ? records[0].stamp : 0;
+	last = 0;
+
+	/* the points of the track older than the history */
+	if (rc == 0 && track.data >= 0 && (n == 0 || records[0].stamp > *from)) {
+		points = track_between(&track, *from, n ? records[0].stamp - 1 : *to, &count);
+		if (points == NULL)
+			rc = -EIO;
+		else if (count > 0) {
+			rc = export_batches(file, b, points, count) < 0 ? -EIO : 0;
+			first = points[0].stamp;
+			last = points[count - 1].stamp;
+			*rows = count;
+		}
+		free(points);
+	}
+
+	/* the history, one batch copied at a time */
+	while (rc == 0 && n > 0) {
+		rc = export_batches(file, b, records, n) < 0 ? -EIO : 0;
+		last = records[n - 1].stamp;
+		*rows += n;
+		n = last >= *to ? 0 : history_between(last + 1, *to, records, EXPORT_BATCH);
+	}
+
+	if (rc == 0 && arrow_write_end(file) < 0)
+		rc = -EIO;
+	if (*rows > 0) {
+		*from = first;
+		*to = last;
+	}
+	free(records);
+	free(b);
+	return rc;
+}
+
+/*
+ * exports the history from 'from' to 'to' in a file of AFBGPS_EXPORT_DIR,
+ * completed by the persisted track before the oldest fix of the history
+ * its path is stored in path of size length, the count of rows in rows
+ * and the range of the exported times in from and to
+ * returns 0 or a negative errno
+ */
+static int export_history(uint64_t *from, uint64_t *to, char *path, size_t length, unsigned *rows)
+{
+	const char *dir;
+	char temp[PATH_MAX];
+	FILE *file;
+	int fd, rc;
+
+	dir = getenv("AFBGPS_EXPORT_DIR");
+	if (dir == NULL)
+		return -ENOTDIR;
+
+	/* written under a temporary name for readers never seeing partial files */
+	snprintf(temp, sizeof temp, "%s/.gps-export.XXXXXX", dir);
+	snprintf(path, length, "%s", temp);
+	fd = mkostemp(temp, O_CLOEXEC);
+	file = fd < 0 ? NULL : fdopen(fd, "w");
+	if (file == NULL) {
+		rc = -errno;
+		if (fd >= 0) {
+			close(fd);
+			unlink(temp);
+		}
+		return rc;
+	}
+	rc = export_write(file, from, to, rows);
+	if (fchmod(fd, 0644) < 0 && rc == 0)
+		rc = -errno;
+	if (fclose(file) != 0 && rc == 0)
+		rc = -EIO;
+
+	/* named by the exported times */
+	if (rc == 0) {
+		snprintf(path, length, "%s/gps-%llu-%llu.arrows", dir,
+				(unsigned long long)*from, (unsigned long long)*to);
+		if (rename(temp, path) < 0)
+			rc = -errno;
+	}
+	if (rc < 0)
+		unlink(temp);
+	return rc;
+}
+
+/***************************************************************************************/
+/***************************************************************************************/
+/**                                                                                   **/
+/**                                                                                   **/
+/**       SECTION: EXPORTING METRICS                                                  **/
+/**                                                                                   **/
+/**                                                                                   **/
+/***************************************************************************************/
+/***************************************************************************************/
+/*
+ * get the sum over all threads of the counter at offset in struct metrics
+ */
+static uint64_t metrics_sum(size_t offset)
+{
+	struct metrics *m;
+	uint64_t sum;
+
+	sum = 0;
+	m = __atomic_load_n(&list_of_metrics, __ATOMIC_ACQUIRE);
+	while (m != NULL) {
+		sum += __atomic_load_n((uint64_t*)((char*)m + offset), __ATOMIC_RELAXED);
+		m = m->next;
+	}
+	return sum;
+}
+
+/*
+ * writes the OpenMetrics counter of name
+ */
+static void metrics_counter(FILE *f, const char *name, const char *help, size_t offset)
+{
+	fprintf(f, "# TYPE %s counter\n# HELP %s %s\n%s_total %llu\n",
+		name, name, help, name, (unsigned long long)metrics_sum(offset));
+}
+
+/*
+ * writes the OpenMetrics gauge of name
+ */
+static void metrics_gauge(FILE *f, const char *name, const char *help, unsigned value)
+{
+	fprintf(f, "# TYPE %s gauge\n# HELP %s %s\n%s %u\n", name, name, help, name, value);
+}
+
+/*
+ * writes the series of the histogram of name with the label or NULL,
+ * its latencies are in seconds
+ */
+static void metrics_series(FILE *f, const char *name, const char *label, size_t offset)
+{
+	int i;
+	uint64_t count;
+	const char *sep;
+
+	sep = label ? "," : "";
+	label = label ? label : "";
+	count = 0;
+	for (i = 0 ; i < HISTOGRAM_COUNT ; i++) {
+		count += metrics_sum(offset + offsetof(struct histogram, buckets) + (size_t)i * sizeof(uint64_t));
+		if (i < HISTOGRAM_COUNT - 1)
+			fprintf(f, "%s_bucket{%s%sle=\"%g\"} %llu\n", name, label, sep,
+				(double)histogram_BOUNDS[i] * 1e-9, (unsigned long long)count);
+		else
+			fprintf(f, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, label, sep, (unsigned long long)count);
+	}
+	if (*label)
+		fprintf(f, "%s_sum{%s} %.9f\n%s_count{%s} %llu\n", name, label,
+			(double)metrics_sum(offset + offsetof(struct histogram, sum)) * 1e-9,
+			name, label, (unsigned long long)count);
+	else
+		fprintf(f, "%s_sum %.9f\n%s_count %llu\n", name,
+			(double)metrics_sum(offset + offsetof(struct histogram, sum)) * 1e-9,
+			name, (unsigned long long)count);
+}
+
+/*
+ * writes the OpenMetrics histogram of name, its latencies are in seconds
+ */
+static void metrics_histogram(FILE *f, const char *name, const char *help, size_t offset)
+{
+	fprintf(f, "# TYPE %s histogram\n# HELP %s %s\n", name, name, help);
+	metrics_series(f, name, NULL, offset);
+}
+
+/*
+ * get the text of the metrics in OpenMetrics format
+ * returns a string to be freed or NULL on memory depletion
+ */
+static char *metrics_text()
+{
+	FILE *f;
+	char *text, label[32];
+	size_t size;
+	int i;
+
+	f = open_memstream(&text, &size);
+	if (f == NULL)
+		return NULL;
+
+	metrics_counter(f, "gps_read_bytes", "Bytes read from the NMEA stream.", offsetof(struct metrics, bytes));
+	metrics_counter(f, "gps_reads", "Reads of the NMEA stream.", offsetof(struct metrics, reads));
+	metrics_counter(f, "gps_overflows", "Lines dropped because too long.", offsetof(struct metrics, overflows));
+	metrics_counter(f, "gps_sentences", "Sentences received.", offsetof(struct metrics, sentences));
+	metrics_counter(f, "gps_sentences_rejected", "Sentences unknown or invalid.", offsetof(struct metrics, rejected));
+	metrics_counter(f, "gps_fixes", "Fixes committed.", offsetof(struct metrics, fixes));
+	metrics_counter(f, "gps_position_hits", "Positions found already built.", offsetof(struct metrics, hits));
+	metrics_counter(f, "gps_position_builds", "Positions built.", offsetof(struct metrics, builds));
+	metrics_counter(f, "gps_wakeups", "Scans of the periods for new fixes.", offsetof(struct metrics, wakeups));
+	metrics_counter(f, "gps_pushes", "Events pushed.", offsetof(struct metrics, pushes));
+	metrics_counter(f, "gps_drops", "Events dropped for lack of listener.", offsetof(struct metrics, drops));
+	metrics_counter(f, "gps_deferrals", "Pushes deferred to the next fix by the budget.", offsetof(struct metrics, deferrals));
+	metrics_counter(f, "gps_requests", "Requests to the verbs.", offsetof(struct metrics, requests));
+	metrics_counter(f, "gps_track_blocks_read", "Blocks of the track read by queries.", offsetof(struct metrics, blocks_read));
+	metrics_counter(f, "gps_track_blocks_skipped", "Blocks of the track skipped by queries.", offsetof(struct metrics, blocks_skipped));
+	metrics_gauge(f, "gps_periods", "Periods in use.", pool_of_periods.inuse);
+	metrics_gauge(f, "gps_events", "Events in use.", pool_of_events.inuse);
+	metrics_histogram(f, "gps_parse_seconds", "Latency of parsing a sentence.", offsetof(struct metrics, parse));
+	metrics_histogram(f, "gps_publish_seconds", "Latency of publishing the events of a fix.", offsetof(struct metrics, publish));
+	fputs("# TYPE gps_delivery_seconds histogram\n"
+		"# HELP gps_delivery_seconds Latency from the commit of a fix to its push by priority class.\n", f);
+	for (i = 0 ; i < priority_COUNT ; i++) {
+		snprintf(label, sizeof label, "class=\"%s\"", priority_NAMES[i]);
+		metrics_series(f, "gps_delivery_seconds", label, offsetof(struct metrics, delivery) + (size_t)i * sizeof(struct histogram));
+	}
+	fputs("# EOF\n", f);
+
+	if (fclose(f) != 0) {
+		free(text);
+		return NULL;
+	}
+	return text;
+}
+
+/*
+ * a client of the metrics endpoint
+ *
+ * its socket is not blocking and is served by the event loop: the
+ * request is read, ignored, then the response is written as the
+ * socket accepts it, the client being dropped after METRICS_TIMEOUT
+ */
+struct metrics_client {
+	int fd;				/* socket of the client */
+	sd_event_source *io;		/* source of the socket */
+	sd_event_source *timer;		/* source of the deadline */
+	char *response;			/* the response or NULL while reading the request */
+	size_t length;			/* length of the response */
+	size_t offset;			/* length of the response already written */
+};
+
+/*
+ * closes and frees the client
+ */
+static void metrics_client_close(struct metrics_client *client)
+{
+	sd_event_source_unref(client->io);
+	sd_event_source_unref(client->timer);
+	close(client->fd);
+	free(client->response);
+	free(client);
+}
+
+/*
+ * drops the client that is too slow
+ */
+static int metrics_on_timeout(sd_event_source *s, uint64_t usec, void *userdata)
+{
+	metrics_client_close(userdata);
+	return 0;
+}
+
+/*
+ * serves the client when its socket is ready
+ */
+static int metrics_on_client(sd_event_source *s, int fd, uint32_t revents, void *userdata)
+{
+	static const char header[] =
+		"HTTP/1.0 200 OK\r\n"
+		"Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+		"Connection: close\r\n"
+		"\r\n";
+
+	struct metrics_client *client = userdata;
+	char buffer[1024], *text;
+	ssize_t rc;
+
+	if (client->response == NULL) {
+		/* the request is ignored, whatever it is */
+		rc = read(fd, buffer, sizeof buffer);
+		if (rc < 0 && (errno == EAGAIN || errno == EINTR))
+			return 0;
+		text = metrics_text();
+		if (text == NULL)
+			goto close;
+		client->length = sizeof header - 1 + strlen(text);
+		client->response = malloc(client->length + 1);
+		if (client->response == NULL) {
+			free(text);
+			goto close;
+		}
+		strcpy(stpcpy(client->response, header), text);
+		free(text);
+		sd_event_source_set_io_events(s, EPOLLOUT);
+		return 0;
+	}
+
+	rc = write(fd, &client->response[client->offset], client->length - client->offset);
+	if (rc < 0 && (errno == EAGAIN || errno == EINTR))
+		return 0;
+	if (rc > 0) {
+		client->offset += (size_t)rc;
+		if (client->offset < client->length)
+			return 0;
+	}
+close:
+	metrics_client_close(client);
+	return 0;
+}
+
+/*
+ * accepts a client of the metrics
+ */
+static int metrics_on_connect(sd_event_source *s, int fd, uint32_t revents, void *userdata)
+{
+	struct metrics_client *client;
+	sd_event *loop;
+	uint64_t usec;
+	int cfd, rc;
+
+	cfd = accept4(fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+	if (cfd < 0)
+		return 0;
+	client = calloc(1, sizeof *client);
+	if (client == NULL) {
+		close(cfd);
+		return 0;
+	}
+	client->fd = cfd;
+	loop = afb_daemon_get_event_loop();
+	rc = sd_event_add_io(loop, &client->io, cfd, EPOLLIN, metrics_on_client, client);
+	if (rc >= 0) {
+		sd_event_now(loop, CLOCK_MONOTONIC, &usec);
+		rc = sd_event_add_time(loop, &client->timer, CLOCK_MONOTONIC,
+				usec + METRICS_TIMEOUT * 1000, 0, metrics_on_timeout, client);
+	}
+	if (rc < 0)
+		metrics_client_close(client);
+	return 0;
+}
+
+/*
+ * serves the metrics on the endpoint given by AFBGPS_METRICS
+ *
+ * the endpoint is either a path to a UNIX socket (abstract if it
+ * begins with @) or a TCP port listened on the local host only
+ */
+static int metrics_listen()
+{
+	const char *endpoint;
+	union {
+		struct sockaddr sa;
+		struct sockaddr_un un;
+		struct sockaddr_in in;
+	} addr;
+	socklen_t length;
+	int fd, rc, one;
+
+	endpoint = getenv("AFBGPS_METRICS");
+	if (endpoint == NULL)
+		return 0;
+
+	memset(&addr, 0, sizeof addr);
+	if (endpoint[0] == '/' || endpoint[0] == '@') {
+		if (strlen(endpoint) >= sizeof addr.un.sun_path) {
+			AFB_ERROR("metrics endpoint %s too long", endpoint);
+			return -1;
+		}
+		addr.un.sun_family = AF_UNIX;
+		strcpy(addr.un.sun_path, endpoint);
+		length = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + strlen(endpoint));
+		if (endpoint[0] == '@')
+			addr.un.sun_path[0] = 0;
+		else {
+			unlink(endpoint);
+			length++;
+		}
+	} else {
+		addr.in.sin_family = AF_INET;
+		addr.in.sin_port = htons((uint16_t)atoi(endpoint));
+		addr.in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		length = (socklen_t)sizeof addr.in;
+	}
+
+	fd = socket(addr.sa.sa_family, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if (fd < 0)
+		goto error;
+	one = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+	if (bind(fd, &addr.sa, length) < 0 || listen(fd, 5) < 0)
+		goto error2;
+	rc = sd_event_add_io(afb_daemon_get_event_loop(), NULL, fd, EPOLLIN, metrics_on_connect, NULL);
+	if (rc < 0) {
+		errno = -rc;
+		goto error2;
+	}
+	AFB_NOTICE("serving metrics on %s", endpoint);
+	return 0;
+
+error2:
+	close(fd);
+error:
+	AFB_ERROR("can't serve metrics on %s: %m", endpoint);
+	return -1;
+}
+
+/***************************************************************************************/
+/***************************************************************************************/
+/**                                                                                   **/
+/**                                                                                   **/
+/**       SECTION: BINDING VERBS IMPLEMENTATION                                       **/
+/**                                                                                   **/
+/**                                                                                   **/
+/***************************************************************************************/
+/***************************************************************************************/
+/*
+ * Returns the type corresponding to the given name
+ */
+static enum type type_of_name(const char *name)
+{
+	enum type result;
+	if (name == NULL)
+		return type_DEFAULT;
+	for (result = 0 ; result != type_COUNT ; result++)
+		if (strcmp(type_NAMES[result], name) == 0)
+			return result;
+	return type_INVALID;
+}
+
+/*
+ * extract a valid type from the request
+ */
+static int get_type_for_req(struct afb_req req, enum type *type)
+{
+	if ((*type = type_of_name(afb_req_value(req, "type"))) != type_INVALID)
+		return 1;
+	afb_req_fail(req, "unknown-type", NULL);
+	return 0;
+}
+
+/*
+ * get the priority class of name, the default one if name is NULL
+ */
+static enum priority priority_of_name(const char *name)
+{
+	enum priority result;
+	if (name == NULL)
+		return priority_DEFAULT;
+	for (result = 0 ; result != priority_COUNT ; result++)
+		if (strcmp(priority_NAMES[result], name) == 0)
+			return result;
+	return priority_INVALID;
+}
+
+/*
+ * get in fields the mask of the fields of value, a comma separated
+ * list or an array of names, all the fields if value is NULL
+ * returns 1 if valid, 0 if not or -1 when out of memory
+ */
+static int fields_of_names(const char *value, unsigned *fields)
+{
+	char *copy, *name, *save;
+	enum field field;
+	int ok;
+
+	if (value == NULL) {
+		*fields = FIELDS_ALL;
+		return 1;
+	}
+
+	copy = strdup(value);
+	if (copy == NULL)
+		return -1;
+	*fields = 0;
+	ok = 1;
+	for (name = strtok_r(copy, " ,[]\"", &save) ; ok && name != NULL ; name = strtok_r(NULL, " ,[]\"", &save)) {
+		field = 0;
+		while (field < field_COUNT && strcmp(field_NAMES[field], name) != 0)
+			field++;
+		if (field < field_COUNT)
+			*fields |= FIELD_BIT(field);
+		else
+			ok = 0;
+	}
+	free(copy);
+	return ok && *fields != 0;
+}
+
+/*
+ * extract the mask of the expected fields from the request
+ *
+ * the fields are given as a comma separated list of names
+ * or as an array of names, all the fields if not present
+ */
+static int get_fields_for_req(struct afb_req req, unsigned *fields)
+{
+	switch (fields_of_names(afb_req_value(req, "fields"), fields)) {
+	case 1:
+		return 1;
+	case 0:
+		afb_req_fail(req, "unknown-field", NULL);
+		return 0;
+	default:
+		afb_req_fail(req, "out-of-memory", NULL);
+		return 0;
+	}
+}
+
+/*
+ * extract the mask of the expected types from the request
+ *
+ * the types are given in the list types or else in type
+ */
+static int get_types_for_req(struct afb_req req, unsigned *types)
+{
+	const char *value;
+	char *copy, *name, *save;
+	enum type type;
+
+	value = afb_req_value(req, "types");
+	if (value == NULL) {
+		if (!get_type_for_req(req, &type))
+			return 0;
+		*types = 1u << type;
+		return 1;
+	}
+
+	copy = strdup(value);
+	if (copy == NULL) {
+		afb_req_fail(req, "out-of-memory", NULL);
+		return 0;
+	}
+	*types = 0;
+	type = type_DEFAULT;
+	for (name = strtok_r(copy, " ,[]\"", &save) ; name != NULL && type != type_INVALID ; name = strtok_r(NULL, " ,[]\"", &save))
+		if ((type = type_of_name(name)) != type_INVALID)
+			*types |= 1u << type;
+	free(copy);
+	if (type != type_INVALID && *types != 0)
+		return 1;
+	afb_req_fail(req, "unknown-type", NULL);
+	return 0;
+}
+
+/*
+ * extract the list of the indexes of the expected sources from the request
+ *
+ * the sources are given by their index in AFBGPS_SOURCES, the list is
+ * allocated in indexes and is NULL when sources is not present
+ */
+static int get_sources_for_req(struct afb_req req, int **indexes, int *count)
+{
+	const char *value;
+	char *copy, *name, *save, *end;
+	long index;
+
+	*indexes = NULL;
+	*count = 0;
+	value = afb_req_value(req, "sources");
+	if (value == NULL)
+		return 1;
+
+	copy = strdup(value);
+	*indexes = malloc((strlen(value) / 2 + 1) * sizeof **indexes);
+	if (copy == NULL || *indexes == NULL) {
+		free(copy);
+		free(*indexes);
+		afb_req_fail(req, "out-of-memory", NULL);
+		return 0;
+	}
+	for (name = strtok_r(copy, " ,[]\"", &save) ; name != NULL ; name = strtok_r(NULL, " ,[]\"", &save)) {
+		index = strtol(name, &end, 10);
+		if (*end != 0 || index < 0 || index >= source_count)
+			break;
+		(*indexes)[(*count)++] = (int)index;
+	}
+	free(copy);
+	if (name == NULL && *count != 0)
+		return 1;
+	free(*indexes);
+	afb_req_fail(req, "unknown-source", NULL);
+	return 0;
+}
+
+/*
+ * builds in result the positions of the types of the fix,
+ * tagged with source when not negative
+ */
+static void get_positions(struct json_object *result, struct fix *fix, int source, unsigned types, unsigned fields)
+{
+	enum type type;
+	struct cache cache;
+	struct json_object *pos;
+
+	fix_decode(fix, fields);
+	memset(&cache, 0, sizeof cache);
+	for (type = 0 ; type < type_COUNT ; type++) {
+		if (!(types & (1u << type)))
+			continue;
+		pos = position(&cache, fix, type, fields);
+		if (pos != NULL && source >= 0)
+			json_object_object_add(pos, "source", json_object_new_int(source));
+		json_object_array_add(result, pos);
+	}
+	cache_clear(&cache);
+}
+
+/*
+ * replies to get the positions of the types for the sources of indexes
+ * or for the last fix if indexes is NULL, all from the same generation
+ */
+static void get_batch(struct afb_req req, unsigned types, unsigned fields, const int *indexes, int count)
+{
+	int i;
+	uint32_t generation;
+	struct fix *fixes;
+	struct json_object *result, *positions;
+
+	/* fixes[0] is the last fix, fixes[1] the fused one, then the sources */
+	fixes = malloc((size_t)(2 + count) * sizeof *fixes);
+	if (fixes == NULL) {
+		afb_req_fail(req, "out-of-memory", NULL);
+		return;
+	}
+	generation = fixes_snapshot(indexes == NULL ? &fixes[0] : NULL,
+				(types & (1u << type_fused)) ? &fixes[1] : NULL,
+				indexes, count, &fixes[2]);
+
+	/* the positions, FUSED is only of the fused fix */
+	positions = json_object_new_array();
+	if (types & (1u << type_fused))
+		get_positions(positions, &fixes[1], -1, 1u << type_fused, fields);
+	types &= ~(1u << type_fused);
+	if (types != 0) {
+		if (indexes == NULL)
+			get_positions(positions, &fixes[0], -1, types, fields);
+		for (i = 0 ; i < count ; i++)
+			get_positions(positions, &fixes[2 + i], indexes[i], types, fields);
+	}
+	free(fixes);
+
+	result = json_object_new_object();
+	json_object_object_add(result, "seq", json_object_new_int64(generation));
+	json_object_object_add(result, "positions", positions);
+	afb_req_success(req, result, NULL);
+}
+
+/*
+ * Get the last known position
+ *
+ * parameter of the get are:
+ *
+ *    type:   string: the type of position expected (defaults to "WGS84" if not present)
+ *    fields: string or array: the names of the fields expected among time, latitude,
+ *                    longitude, altitude, speed and track (defaults to all if not present)
+ *    types:  string or array: the types of positions expected, replaces type
+ *    sources: string or array: the indexes in AFBGPS_SOURCES of the sources
+ *                    whose last fixes are expected instead of the last fix
+ *
+ * returns the position or, when types or sources are present, an object
+ * with the seq of the last fix and in positions the array of the position
+ * FUSED if expected then of the positions of the other types for the last
+ * fix or for each of the sources (tagged with source), all taken at once
+ *
+ * The valid types are:
+ *
+ *  +==========+=======================+=======+==========+=======+
+ *  | type     |  longitude & latitude | speed | altitude | track |
+ *  +==========+=======================+=======+==========+=======+
+ *  | WGS84    |      degre            |  m/s  |          |       |
+ *  +----------+-----------------------+-------+          |       |
+ *  | DMS.km/h |                       | km/h  |          |       |
+ *  +----------+                       +-------+   meter  | degre |
+ *  | DMS.mph  |   deg°min'sec"X       |  mph  |          |       |
+ *  +----------+                       +-------+          |       |
+ *  | DMS.kn   |                       |  kn   |          |       |
+ *  +----------+-----------------------+-------+          |       |
+ *  | FUSED    |      degre            |  m/s  |          |       |
+ *  +==========+=======================+=======+==========+=======+
+ *
+ * The type FUSED is the average of the recent fixes of the sources
+ * weighted by their accuracy.
+ */
+static void get(struct afb_req req)
+{
+	enum type type;
+	unsigned fields, types;
+	int *indexes, count;
+	struct fix snapshot;
+	struct cache cache;
+
+	METRIC_INC(requests);
+	if (afb_req_value(req, "types") != NULL || afb_req_value(req, "sources") != NULL) {
+		if (get_types_for_req(req, &types) && get_fields_for_req(req, &fields)
+		 && get_sources_for_req(req, &indexes, &count)) {
+			get_batch(req, types, fields, indexes, count);
+			free(indexes);
+		}
+	} else if (get_type_for_req(req, &type) && get_fields_for_req(req, &fields)) {
+		/* the objects are built for this request only */
+		if (type == type_fused)
+			fused_snapshot(&snapshot);
+		else
+			fix_snapshot(&snapshot);
+		fix_decode(&snapshot, fields);
+		memset(&cache, 0, sizeof cache);
+		afb_req_success(req, position(&cache, &snapshot, type, fields), NULL);
+		cache_clear(&cache);
+	}
+}
+
+/*
+ * get in result the position of type with fields at stamp
+ * returns 1 if found or 0 if stamp is out of the history
+ */
+static int position_at(uint64_t stamp, enum type type, unsigned fields, int hermite, struct json_object **result)
+{
+	struct record before, after;
+	struct fix fix;
+	struct cache cache;
+
+	if (!history_find(stamp, &before, &after))
+		return 0;
+	fix_decode(&before.fix, FIELDS_ALL);
+	fix_decode(&after.fix, FIELDS_ALL);
+	memset(&fix, 0, offsetof(struct fix, text));
+	history_interpolate(&before, &after, stamp, hermite, &fix.gps);
+	fix.reckoned = before.fix.reckoned | after.fix.reckoned;
+	fix.accuracy = fmax(before.fix.accuracy, after.fix.accuracy);
+	memset(&cache, 0, sizeof cache);
+	*result = position(&cache, &fix, type, fields);
+	cache_clear(&cache);
+	return 1;
+}
+
+/*
+ * get in stamp the time in milliseconds since the epoch of text
+ * returns 1 if valid or 0 otherwise
+ */
+static int time_parse(const char *text, uint64_t *stamp)
+{
+	char *end;
+
+	if (*text < '0' || *text > '9')
+		return 0;
+	errno = 0;
+	*stamp = strtoull(text, &end, 10);
+	return *end == 0 && errno == 0;
+}
+
+/*
+ * Get the positions at given times, interpolated from the history
+ *
+ * parameters of the at are:
+ *
+ *    time:   integer: the time in milliseconds since the epoch
+ *    times:  string or array: the times in milliseconds since the epoch,
+ *                    replaces time for getting many positions at once
+ *    method: string: "linear" (default) or "hermite" for interpolating
+ *                    along the speeds and the tracks
+ *    type:   string: the type of position expected, see get
+ *    fields: string or array: the names of the fields expected, see get
+ *
+ * returns the position at time or an array of the positions at times,
+ * the times out of the history having null positions
+ */
+static void at(struct afb_req req)
+{
+	enum type type;
+	unsigned fields;
+	int hermite;
+	uint64_t time;
+	const char *stamp, *times, *method;
+	char *copy, *item, *save;
+	struct json_object *result, *pos;
+
+	METRIC_INC(requests);
+	if (!get_type_for_req(req, &type) || !get_fields_for_req(req, &fields))
+		return;
+
+	method = afb_req_value(req, "method");
+	if (method == NULL || strcmp(method, "linear") == 0)
+		hermite = 0;
+	else if (strcmp(method, "hermite") == 0)
+		hermite = 1;
+	else {
+		afb_req_fail(req, "unknown-method", NULL);
+		return;
+	}
+
+	times = afb_req_value(req, "times");
+	if (times == NULL) {
+		stamp = afb_req_value(req, "time");
+		if (stamp == NULL)
+			afb_req_fail(req, "missing-time", NULL);
+		else if (!time_parse(stamp, &time))
+			afb_req_fail(req, "bad-time", NULL);
+		else if (!position_at(time, type, fields, hermite, &result))
+			afb_req_fail(req, "out-of-range", NULL);
+		else
+			afb_req_success(req, result, NULL);
+		return;
+	}
+
+	copy = strdup(times);
+	result = json_object_new_array();
+	if (copy == NULL || result == NULL) {
+		free(copy);
+		json_object_put(result);
+		afb_req_fail(req, "out-of-memory", NULL);
+		return;
+	}
+	for (item = strtok_r(copy, " ,[]", &save) ; item != NULL ; item = strtok_r(NULL, " ,[]", &save)) {
+		if (!time_parse(item, &time)) {
+			free(copy);
+			json_object_put(result);
+			afb_req_fail(req, "bad-time", NULL);
+			return;
+		}
+		json_object_array_add(result,
+			position_at(time, type, fields, hermite, &pos) ? pos : NULL);
+	}
+	free(copy);
+	afb_req_success(req, result, NULL);
+}
+
+/*
+ * Export the history, and the persisted track before it, in an Apache Arrow
+ * IPC stream file of AFBGPS_EXPORT_DIR
+ *
+ * parameters of the export are:
+ *
+ *    from:   integer: the first time in milliseconds since the epoch (defaults to the oldest)
+ *    to:     integer: the last time in milliseconds since the epoch (defaults to the newest)
+ *
+ * returns an object with:
+ *    file:   string: the path of the file written
+ *    rows:   integer: the count of fixes exported
+ *    from:   integer: the time of the first fix exported, if any
+ *    to:     integer: the time of the last fix exported, if any
+ */
+static void export(struct afb_req req)
+{
+	const char *value;
+	char path[PATH_MAX];
+	uint64_t from, to;
+	unsigned rows;
+	int rc;
+	struct json_object *result;
+
+	METRIC_INC(requests);
+	value = afb_req_value(req, "from");
+	from = value ? strtoull(value, NULL, 10) : 0;
+	value = afb_req_value(req, "to");
+	to = value ? strtoull(value, NULL, 10) : UINT64_MAX;
+	rc = export_history(&from, &to, path, sizeof path, &rows);
+	if (rc == -ENOTDIR)
+		afb_req_fail(req, "no-export-dir", NULL);
+	else if (rc == -ENOMEM)
+		afb_req_fail(req, "out-of-memory", NULL);
+	else if (rc < 0) {
+		AFB_ERROR("can't export to %s: %s", path, strerror(-rc));
+		afb_req_fail(req, "export-failed", NULL);
+	} else {
+		result = json_object_new_object();
+		json_object_object_add(result, "file", json_object_new_string(path));
+		json_object_object_add(result, "rows", json_object_new_int64(rows));
+		if (rows > 0) {
+			json_object_object_add(result, "from", json_object_new_int64((int64_t)from));
+			json_object_object_add(result, "to", json_object_new_int64((int64_t)to));
+		}
+		afb_req_success(req, result, NULL);
+	}
+}
+
+/*
+ * Get the points of the persisted track near a position
+ *
+ * parameters of the near are:
+ *
+ *    latitude:  number: the latitude of the position in degree
+ *    longitude: number: the longitude of the position in degree
+ *    distance:  number: the maximum distance in meter (defaults to 100)
+ *    from:      integer: the first time in milliseconds since the epoch (defaults to the oldest)
+ *    to:        integer: the last time in milliseconds since the epoch (defaults to the newest)
+ *    limit:     integer: the maximum count of points (defaults to 1000)
+ *
+ * returns the array of the points, in chronological order, with their
+ * time, latitude, longitude and distance to the position
+ */
+static void near(struct afb_req req)
+{
+	const char *lat, *lon, *distance, *from, *to, *limit;
+	struct json_object *result;
+
+	METRIC_INC(requests);
+	if (track.data < 0) {
+		afb_req_fail(req, "no-track", NULL);
+		return;
+	}
+	lat = afb_req_value(req, "latitude");
+	lon = afb_req_value(req, "longitude");
+	if (lat == NULL || lon == NULL) {
+		afb_req_fail(req, "missing-position", NULL);
+		return;
 	}
+	distance = afb_req_value(req, "distance");
+	from = afb_req_value(req, "from");
+	to = afb_req_value(req, "to");
+	limit = afb_req_value(req, "limit");
 
-	return 0;
+	result = json_object_new_array();
+	if (track_near(&track, result, atof(lat), angle_normal(atof(lon)), distance ? atof(distance) : 100,
+			from ? strtoull(from, NULL, 10) : 0, to ? strtoull(to, NULL, 10) : UINT64_MAX,
+			limit ? (unsigned)atoi(limit) : DEFAULT_NEAR_LIMIT) < 0) {
+		json_object_put(result);
+		afb_req_fail(req, "read-failed", NULL);
+	} else
+		afb_req_success(req, result, NULL);
 }
 
 /*
- * opens a socket to a host and a service (or port)
+ * adds to json the replay of the fixes after since
  */
-static int open_socket_to(const char *host, const char *service)
+static void replay(struct json_object *json, uint32_t since, enum type type, unsigned fields)
 {
-	int rc, fd;
-	struct addrinfo hint, *rai, *iai;
-
-	/* get addr */
-	memset(&hint, 0, sizeof hint);
-	hint.ai_family = AF_INET;
-	hint.ai_socktype = SOCK_STREAM;
-	rc = getaddrinfo(host, service, &hint, &rai);
-	if (rc != 0)
-		return -1;
+	struct record *records;
+	struct json_object *array;
+	struct cache cache;
+	unsigned i, count;
+	int complete;
 
-	/* get the socket */
-	iai = rai;
-	while (iai != NULL) {
-		fd = socket(iai->ai_family, iai->ai_socktype, iai->ai_protocol);
-		if (fd >= 0) {
-			rc = connect(fd, iai->ai_addr, iai->ai_addrlen);
-			if (rc == 0) {
-				fcntl(fd, F_SETFL, O_NONBLOCK);
-				freeaddrinfo(rai);
-				return fd;
-			}
-			close(fd);
+	records = history_since(since, &count, &complete);
+	array = json_object_new_array();
+	if (records != NULL) {
+		for (i = 0 ; i < count ; i++) {
+			fix_decode(&records[i].fix, fields);
+			memset(&cache, 0, sizeof cache);
+			json_object_array_add(array, position(&cache, &records[i].fix, type, fields));
+			cache_clear(&cache);
 		}
-		iai = iai->ai_next;
+		free(records);
 	}
-	freeaddrinfo(rai);
-	return -1;
+	json_object_object_add(json, "replay", array);
+	json_object_object_add(json, "complete", json_object_new_boolean(records != NULL && complete));
 }
 
 /*
- * connection to nmea stream for the host and the port
+ * a stream expected by a subscription
  */
-static int connect_to(const char *host, const char *service, int isgpsd)
-{
-	sd_event_source *source;
-	int rc, fd;
-
-	/* TODO connect to somewhere else */
-	fd = open_socket_to(host, service);
-	if (fd < 0) {
-		ERROR(afbitf, "can't connect to host %s, service %s", host, service);
-		return fd;
-	}
-	if (isgpsd) {
-		static const char gpsdsetup[] = "?WATCH={\"enable\":true,\"nmea\":true};\r\n";
-		write(fd, gpsdsetup, sizeof gpsdsetup - 1);
-	}
+struct stream {
+	enum type type;			/* type of the positions */
+	unsigned fields;		/* mask of the fields */
+	unsigned keyframe;		/* count of pushes between keyframes or 0 */
+	enum priority priority;		/* priority class of the pushes */
+	uint32_t period;		/* normalized period in ms */
+	int index;			/* index of the stream in the request */
+	struct event *event;		/* the event of the stream */
+};
 
-	/* adds to the event loop */
-	rc = sd_event_add_io(afb_daemon_get_event_loop(afbitf->daemon), &source, fd, EPOLLIN, on_event, NULL);
-	if (rc < 0) {
-		close(fd);
-		ERROR(afbitf, "can't coonect host %s, service %s to the event loop", host, service);
-	} else {
-		NOTICE(afbitf, "Connected to host %s, service %s", host, service);
+/*
+ * sets the stream for the values of its parameters, see subscribe
+ * returns NULL or the status of the error
+ */
+static const char *stream_set(struct stream *stream, const char *type, const char *fields, const char *period,
+				const char *delta, const char *keyframe, const char *priority)
+{
+	if ((stream->type = type_of_name(type)) == type_INVALID)
+		return "unknown-type";
+	switch (fields_of_names(fields, &stream->fields)) {
+	case 1:
+		break;
+	case 0:
+		return "unknown-field";
+	default:
+		return "out-of-memory";
 	}
-	return rc;
+	if ((stream->priority = priority_of_name(priority)) == priority_INVALID)
+		return "unknown-priority";
+	stream->keyframe = 0;
+	if (delta != NULL && strcmp(delta, "false") != 0 && strcmp(delta, "0") != 0)
+		stream->keyframe = keyframe == NULL || atoi(keyframe) <= 0 ? DEFAULT_KEYFRAME : (unsigned)atoi(keyframe);
+	stream->period = period_normal(period == NULL ? DEFAULT_PERIOD : atoi(period));
+	stream->event = NULL;
+	return NULL;
 }
 
 /*
- * connection to nmea stream
+ * get the value of the member name of the object or NULL
  */
-static int connection()
+static const char *stream_value(struct json_object *object, const char *name)
 {
-	const char *host;
-	const char *service;
-	int isgpsd;
+	struct json_object *value;
 
-	/* TODO connect to somewhere else */
-	host = getenv("AFBGPS_HOST") ? : "sinagot.net";
-	service = getenv("AFBGPS_SERVICE") ? : "5001";
-	isgpsd = getenv("AFBGPS_ISNMEA") ? 0 : 1;
-	return connect_to(host, service, isgpsd);
+	return json_object_object_get_ex(object, name, &value) ? json_object_get_string(value) : NULL;
 }
 
-/***************************************************************************************/
-/***************************************************************************************/
-/**                                                                                   **/
-/**                                                                                   **/
-/**       SECTION: BINDING VERBS IMPLEMENTATION                                       **/
-/**                                                                                   **/
-/**                                                                                   **/
-/***************************************************************************************/
-/***************************************************************************************/
 /*
- * Returns the type corresponding to the given name
+ * compares the streams by period for qsort
  */
-static enum type type_of_name(const char *name)
+static int stream_compare(const void *a, const void *b)
 {
-	enum type result;
-	if (name == NULL)
-		return type_DEFAULT;
-	for (result = 0 ; result != type_COUNT ; result++)
-		if (strcmp(type_NAMES[result], name) == 0)
-			return result;
-	return type_INVALID;
+	const struct stream *s0 = a, *s1 = b;
+
+	return s0->period != s1->period ? s0->period < s1->period ? -1 : 1 : s0->index - s1->index;
 }
 
 /*
- * extract a valid type from the request
+ * get the object of the reply for the subscription to the stream
+ * must be called with events_lock held
  */
-static int get_type_for_req(struct afb_req req, enum type *type)
+static struct json_object *stream_reply(struct stream *stream)
 {
-	if ((*type = type_of_name(afb_req_value(req, "type"))) != type_INVALID)
-		return 1;
-	afb_req_fail(req, "unknown-type", NULL);
-	return 0;
+	struct json_object *json;
+
+	/* the new subscriber needs a keyframe */
+	stream->event->countdown = 0;
+	json = json_object_new_object();
+	json_object_object_add(json, "name", json_object_new_string(stream->event->name));
+	json_object_object_add(json, "id", json_object_new_int(stream->event->id));
+	return json;
 }
-	
+
 /*
- * Get the last known position
- *
- * parameter of the get are:
- *
- *    type:   string: the type of position expected (defaults to "WGS84" if not present)
- *
- * returns the position
- *
- * The valid types are:
- *
- *  +==========+=======================+=======+==========+=======+
- *  | type     |  longitude & latitude | speed | altitude | track |
- *  +==========+=======================+=======+==========+=======+
- *  | WGS84    |      degre            |  m/s  |          |       |
- *  +----------+-----------------------+-------+          |       |
- *  | DMS.km/h |                       | km/h  |          |       |
- *  +----------+                       +-------+   meter  | degre |
- *  | DMS.mph  |   deg°min'sec"X       |  mph  |          |       |
- *  +----------+                       +-------+          |       |
- *  | DMS.kn   |                       |  kn   |          |       |
- *  +==========+=======================+=======+==========+=======+
+ * subscribes to the streams of value, an array of objects having the
+ * parameters of subscribe, in one pass over the periods
  */
-static void get(struct afb_req req)
+static void subscribe_streams(struct afb_req req, const char *value)
 {
-	enum type type;
-	if (get_type_for_req(req, &type))
-		afb_req_success(req, position(type), NULL);
+	int i, count, dropped;
+	const char *status, *since;
+	struct stream *streams;
+	struct period **pp;
+	struct json_object *array, *item, *json, *replies;
+
+	/* get the streams */
+	array = json_tokener_parse(value);
+	count = array != NULL && json_object_is_type(array, json_type_array) ? (int)json_object_array_length(array) : 0;
+	if (count == 0) {
+		json_object_put(array);
+		afb_req_fail(req, "invalid-streams", NULL);
+		return;
+	}
+	streams = malloc((size_t)count * sizeof *streams);
+	status = streams == NULL ? "out-of-memory" : NULL;
+	for (i = 0 ; i < count && status == NULL ; i++) {
+		item = json_object_array_get_idx(array, (size_t)i);
+		if (!json_object_is_type(item, json_type_object))
+			status = "invalid-streams";
+		else
+			status = stream_set(&streams[i], stream_value(item, "type"), stream_value(item, "fields"),
+					stream_value(item, "period"), stream_value(item, "delta"),
+					stream_value(item, "keyframe"), stream_value(item, "priority"));
+		streams[i].index = i;
+	}
+	json_object_put(array);
+	if (status != NULL) {
+		free(streams);
+		afb_req_fail(req, status, NULL);
+		return;
+	}
+
+	/* get the events by increasing period, all or none being subscribed */
+	qsort(streams, (size_t)count, sizeof *streams, stream_compare);
+	replies = json_object_new_array();
+	pthread_mutex_lock(&events_lock);
+	pp = &list_of_periods;
+	for (i = 0 ; i < count && status == NULL ; i++) {
+		streams[i].event = event_get_from(&pp, streams[i].type, streams[i].fields,
+					streams[i].keyframe, streams[i].priority, streams[i].period);
+		if (streams[i].event == NULL)
+			status = "out-of-memory";
+		else if (afb_req_subscribe(req, streams[i].event->event) != 0)
+			status = "failed";
+		else {
+			streams[i].event->listeners++;
+			json_object_array_put_idx(replies, (size_t)streams[i].index, stream_reply(&streams[i]));
+		}
+	}
+	if (status != NULL) {
+		dropped = 0;
+		for (i -= 2 ; i >= 0 ; i--)
+			if (afb_req_unsubscribe(req, streams[i].event->event) == 0)
+				dropped |= event_unlisten(streams[i].event);
+		if (dropped)
+			fields_demand_update();
+	}
+	pthread_mutex_unlock(&events_lock);
+
+	/* the replays are built out of the lock */
+	if (status != NULL) {
+		json_object_put(replies);
+		afb_req_fail(req, status, NULL);
+	} else {
+		since = afb_req_value(req, "since");
+		if (since != NULL)
+			for (i = 0 ; i < count ; i++)
+				replay(json_object_array_get_idx(replies, (size_t)streams[i].index),
+					(uint32_t)strtoul(since, NULL, 10), streams[i].type, streams[i].fields);
+		json = json_object_new_object();
+		json_object_object_add(json, "streams", replies);
+		afb_req_success(req, json, NULL);
+	}
+	free(streams);
 }
 
 /*
@@ -955,34 +5590,162 @@ static void get(struct afb_req req)
  *
  *    type:   string:  the type of position expected (defaults to WCS84 if not present)
  *                     see the list above (get)
+ *    fields: string or array: the names of the fields expected (defaults to all if not present)
+ *                     see the list above (get)
  *    period: integer: the expected period in milliseconds (defaults to 2000 if not present)
+ *    delta:  boolean: if true, the pushes only have the fields changed since the
+ *                     previous one, except keyframes (defaults to false if not present)
+ *    keyframe: integer: count of pushes between keyframes of delta (defaults to 10)
+ *    since:  integer: the sequence number of the last fix received for
+ *                     replaying the fixes missed since it
+ *    priority: string: the priority class of the pushes: "high", "normal"
+ *                     (default) or "low", see AFBGPS_PUSH_BUDGET_US
+ *    streams: array:  objects having the parameters type, fields, period, delta,
+ *                     keyframe and priority above for subscribing to all of them
+ *                     at once, replacing these parameters
  *
  * returns an object with 2 fields:
  *
  *    name:   string:  the name of the event without its prefix
  *    id:     integer: a numeric identifier of the event to be used for unsubscribing
+ *
+ * and when since is given, 2 more fields:
+ *
+ *    replay: array:   the positions of the fixes of sequence greater than since
+ *                     found in the history, the events following may repeat some
+ *    complete: boolean: false if fixes after since are missing from the history
+ *
+ * or when streams is given, an object whose field streams is the array of
+ * these objects for each of the streams, none being subscribed on error
  */
 static void subscribe(struct afb_req req)
 {
-	enum type type;
-	const char *period;
-	struct event *event;
+	const char *status, *streams, *since;
+	struct stream stream;
+	struct period **pp;
 	struct json_object *json;
 
-	if (get_type_for_req(req, &type)) {
-		period = afb_req_value(req, "period");
-		event = event_get(type, period == NULL ? DEFAULT_PERIOD : atoi(period));
-		if (event == NULL)
-			afb_req_fail(req, "out-of-memory", NULL);
-		else if (afb_req_subscribe(req, event->event) != 0)
-			afb_req_fail_f(req, "failed", "afb_req_subscribe returned an error: %m");
-		else {
-			json = json_object_new_object();
-			json_object_object_add(json, "name", json_object_new_string(event->name));
-			json_object_object_add(json, "id", json_object_new_int(event->id));
-			afb_req_success(req, json, NULL);
+	METRIC_INC(requests);
+	streams = afb_req_value(req, "streams");
+	if (streams != NULL) {
+		subscribe_streams(req, streams);
+		return;
+	}
+
+	status = stream_set(&stream, afb_req_value(req, "type"), afb_req_value(req, "fields"),
+			afb_req_value(req, "period"), afb_req_value(req, "delta"),
+			afb_req_value(req, "keyframe"), afb_req_value(req, "priority"));
+	if (status != NULL) {
+		afb_req_fail(req, status, NULL);
+		return;
+	}
+
+	json = NULL;
+	pthread_mutex_lock(&events_lock);
+	pp = &list_of_periods;
+	stream.event = event_get_from(&pp, stream.type, stream.fields, stream.keyframe, stream.priority, stream.period);
+	if (stream.event == NULL)
+		afb_req_fail(req, "out-of-memory", NULL);
+	else if (afb_req_subscribe(req, stream.event->event) != 0)
+		afb_req_fail_f(req, "failed", "afb_req_subscribe returned an error: %m");
+	else {
+		stream.event->listeners++;
+		json = stream_reply(&stream);
+	}
+	pthread_mutex_unlock(&events_lock);
+
+	/* the replay is built out of the lock */
+	if (json != NULL) {
+		since = afb_req_value(req, "since");
+		if (since != NULL)
+			replay(json, (uint32_t)strtoul(since, NULL, 10), stream.type, stream.fields);
+		afb_req_success(req, json, NULL);
+	}
+}
+
+/*
+ * an identifier to unsubscribe and its event
+ */
+struct unsubscription {
+	int id;				/* the identifier */
+	struct event *event;		/* its event or NULL */
+};
+
+/*
+ * compares the unsubscriptions by identifier for qsort and bsearch
+ */
+static int unsubscription_compare(const void *a, const void *b)
+{
+	const struct unsubscription *u0 = a, *u1 = b;
+
+	return u0->id != u1->id ? u0->id < u1->id ? -1 : 1 : 0;
+}
+
+/*
+ * unsubscribes the identifiers of value, a comma separated list or an
+ * array, in one pass over the events
+ */
+static void unsubscribe_ids(struct afb_req req, const char *value)
+{
+	int i, j, count, dropped;
+	char *copy, *name, *save, *end;
+	struct unsubscription *unsubs, *u, key;
+	struct period *p;
+	struct event *e;
+
+	/* get the sorted identifiers without duplicates */
+	copy = strdup(value);
+	unsubs = malloc((strlen(value) / 2 + 1) * sizeof *unsubs);
+	if (copy == NULL || unsubs == NULL) {
+		free(copy);
+		free(unsubs);
+		afb_req_fail(req, "out-of-memory", NULL);
+		return;
+	}
+	count = 0;
+	for (name = strtok_r(copy, " ,[]\"", &save) ; name != NULL ; name = strtok_r(NULL, " ,[]\"", &save)) {
+		unsubs[count].id = (int)strtol(name, &end, 10);
+		unsubs[count++].event = NULL;
+		if (*end != 0)
+			break;
+	}
+	free(copy);
+	if (name != NULL || count == 0) {
+		free(unsubs);
+		afb_req_fail(req, "bad-id", NULL);
+		return;
+	}
+	qsort(unsubs, (size_t)count, sizeof *unsubs, unsubscription_compare);
+	for (i = j = 1 ; i < count ; i++)
+		if (unsubs[i].id != unsubs[j - 1].id)
+			unsubs[j++] = unsubs[i];
+	count = j;
+
+	/* get the events, all or none being unsubscribed */
+	pthread_mutex_lock(&events_lock);
+	j = 0;
+	for (p = list_of_periods ; p != NULL ; p = p->next)
+		for (e = p->events ; e != NULL ; e = e->next) {
+			key.id = e->id;
+			u = bsearch(&key, unsubs, (size_t)count, sizeof *unsubs, unsubscription_compare);
+			if (u != NULL) {
+				u->event = e;
+				j++;
+			}
 		}
+	if (j != count)
+		afb_req_fail(req, "bad-id", NULL);
+	else {
+		dropped = 0;
+		for (i = 0 ; i < count ; i++)
+			if (afb_req_unsubscribe(req, unsubs[i].event->event) == 0)
+				dropped |= event_unlisten(unsubs[i].event);
+		if (dropped)
+			fields_demand_update();
+		afb_req_success(req, NULL, NULL);
 	}
+	pthread_mutex_unlock(&events_lock);
+	free(unsubs);
 }
 
 /*
@@ -991,61 +5754,297 @@ static void subscribe(struct afb_req req)
  * parameters of the unsubscription are:
  *
  *    id:   integer: the numeric identifier of the event as returned when subscribing
+ *    ids:  string or array: identifiers for unsubscribing all of them at once,
+ *                   replacing id, none being unsubscribed if one is bad
  */
 static void unsubscribe(struct afb_req req)
 {
 	const char *id;
 	struct event *event;
 
+	METRIC_INC(requests);
+	id = afb_req_value(req, "ids");
+	if (id != NULL) {
+		unsubscribe_ids(req, id);
+		return;
+	}
 	id = afb_req_value(req, "id");
 	if (id == NULL)
 		afb_req_fail(req, "missing-id", NULL);
 	else {
+		pthread_mutex_lock(&events_lock);
 		event = event_of_id(atoi(id));
 		if (event == NULL)
 			afb_req_fail(req, "bad-id", NULL);
 		else {
-			afb_req_unsubscribe(req, event->event);
+			if (afb_req_unsubscribe(req, event->event) == 0 && event_unlisten(event))
+				fields_demand_update();
 			afb_req_success(req, NULL, NULL);
 		}
+		pthread_mutex_unlock(&events_lock);
 	}
 }
 
 /*
- * array of the verbs exported to afb-daemon
+ * watch a derived event
+ *
+ * parameters of the watch are:
+ *
+ *    event:  string: the name of the derived event: stop or route
+ *
+ * The event stop has the fields type (stop-start or stop-end),
+ * latitude and longitude of the stop, start in ms since the
+ * epoch and duration in ms.
+ *
+ * The event route, for the route set by the verb route, has the fields
+ * type (progress, off-route, on-route or arrival), progress from 0 to 1,
+ * travelled and remaining distances in m, deviation in m from the route,
+ * segment matched, off-route and eta in ms since the epoch if moving.
  */
-static const struct afb_verb_desc_v1 binding_verbs[] = {
-  /* VERB'S NAME            SESSION MANAGEMENT          FUNCTION TO CALL         SHORT DESCRIPTION */
-  { .name= "get",          .session= AFB_SESSION_NONE, .callback= get,          .info= "get the last known data" },
-  { .name= "subscribe",    .session= AFB_SESSION_NONE, .callback= subscribe,    .info= "subscribe to notification of position" },
-  { .name= "unsubscribe",  .session= AFB_SESSION_NONE, .callback= unsubscribe,  .info= "unsubscribe a previous subscription" },
-  { .name= NULL } /* marker for end of the array */
-};
+static void watch(struct afb_req req)
+{
+	const char *name;
+	enum derived d;
+
+	METRIC_INC(requests);
+	name = afb_req_value(req, "event");
+	d = 0;
+	while (d < derived_COUNT && (name == NULL || strcmp(name, derived_NAMES[d]) != 0))
+		d++;
+	if (d == derived_COUNT) {
+		afb_req_fail(req, "unknown-event", NULL);
+		return;
+	}
+
+	pthread_mutex_lock(&events_lock);
+	if (!afb_event_is_valid(derived_events[d].event))
+		derived_events[d].event = afb_daemon_make_event(derived_NAMES[d]);
+	if (!afb_event_is_valid(derived_events[d].event))
+		afb_req_fail(req, "out-of-memory", NULL);
+	else if (afb_req_subscribe(req, derived_events[d].event) != 0)
+		afb_req_fail_f(req, "failed", "afb_req_subscribe returned an error: %m");
+	else {
+		__atomic_store_n(&derived_events[d].watched, 1, __ATOMIC_RELAXED);
+		afb_req_success(req, NULL, NULL);
+	}
+	pthread_mutex_unlock(&events_lock);
+}
 
 /*
- * description of the binding for afb-daemon
+ * stop watching a derived event
+ *
+ * parameters of the unwatch are:
+ *
+ *    event:  string: the name of the derived event
  */
-static const struct afb_binding binding_description =
+static void unwatch(struct afb_req req)
 {
-  /* description conforms to VERSION 1 */
-  .type= AFB_BINDING_VERSION_1,
-  .v1= {			/* fills the v1 field of the union when AFB_BINDING_VERSION_1 */
-    .prefix= "gps",		/* the API name (or binding name or prefix) */
-    .info= "Access to the GPS data",	/* short description of of the binding */
-    .verbs = binding_verbs	/* the array describing the verbs of the API */
-  }
-};
+	const char *name;
+	enum derived d;
+
+	METRIC_INC(requests);
+	name = afb_req_value(req, "event");
+	d = 0;
+	while (d < derived_COUNT && (name == NULL || strcmp(name, derived_NAMES[d]) != 0))
+		d++;
+	if (d == derived_COUNT || !afb_event_is_valid(derived_events[d].event))
+		afb_req_fail(req, "unknown-event", NULL);
+	else {
+		afb_req_unsubscribe(req, derived_events[d].event);
+		afb_req_success(req, NULL, NULL);
+	}
+}
+
+/*
+ * set the route followed by the derived event route
+ *
+ * parameters of the route are:
+ *
+ *    points:   array or string: the latitudes and longitudes in degree of the
+ *                      points of the polyline, as [[lat,lon],...] or
+ *                      [lat,lon,...], removes the route if absent or empty
+ *    corridor: number: the half width in m of the corridor (defaults to 50)
+ *
+ * returns an object with:
+ *    length:   number: the length of the route in m
+ *    segments: integer: the count of segments
+ */
+static void set_route(struct afb_req req)
+{
+	const char *points, *corridor;
+	char *copy, *item, *save;
+	double *values, *more, length;
+	unsigned count, size;
+	struct json_object *result;
+
+	METRIC_INC(requests);
+	points = afb_req_value(req, "points");
+	corridor = afb_req_value(req, "corridor");
+	copy = strdup(points ? points : "");
+	values = NULL;
+	count = size = 0;
+	for (item = copy ? strtok_r(copy, " ,[]", &save) : NULL ; item != NULL ; item = strtok_r(NULL, " ,[]", &save)) {
+		if (count == size) {
+			size = size ? 2 * size : 64;
+			more = realloc(values, size * sizeof *values);
+			if (more == NULL)
+				break;
+			values = more;
+		}
+		values[count++] = atof(item);
+	}
+	if (copy == NULL || item != NULL)
+		afb_req_fail(req, "out-of-memory", NULL);
+	else if (count % 2 != 0 || count == 2)
+		afb_req_fail(req, "invalid-points", NULL);
+	else {
+		length = route_set(values, count / 2,
+			corridor != NULL && atof(corridor) > 0 ? atof(corridor) : DEFAULT_CORRIDOR);
+		if (length < 0)
+			afb_req_fail(req, "out-of-memory", NULL);
+		else {
+			result = json_object_new_object();
+			json_object_object_add(result, "length", json_object_new_double(length));
+			json_object_object_add(result, "segments", json_object_new_int(count ? (int)count / 2 - 1 : 0));
+			afb_req_success(req, result, NULL);
+		}
+	}
+	free(values);
+	free(copy);
+}
+
+/*
+ * get the tiles of the coverage, see AFBGPS_TILE_ZOOM
+ *
+ * parameters of the tiles are:
+ *
+ *    min:    integer: the minimal count of fixes of the tiles returned (defaults to 1)
+ *    reset:  boolean: if true, the tiles are reset after being read
+ *
+ * returns an object with:
+ *    zoom:    integer: the zoom of the tiles
+ *    x, y:    arrays of integers: the coordinates of the tiles
+ *    count:   array of integers: the count of fixes of the tiles
+ *    dwell:   array of integers: the dwell time in ms in the tiles
+ *    dropped: integer: count of fixes not counted because the table is full
+ */
+static void get_tiles(struct afb_req req)
+{
+	const char *min, *reset;
+	struct json_object *result;
+
+	METRIC_INC(requests);
+	if (tiles.entries == NULL) {
+		afb_req_fail(req, "no-tiles", NULL);
+		return;
+	}
+	min = afb_req_value(req, "min");
+	reset = afb_req_value(req, "reset");
+	result = json_object_new_object();
+	if (tiles_get(result, min != NULL && atoi(min) > 0 ? (uint32_t)atoi(min) : 1,
+			reset != NULL && strcmp(reset, "false") != 0 && strcmp(reset, "0") != 0) < 0) {
+		json_object_put(result);
+		afb_req_fail(req, "out-of-memory", NULL);
+	} else
+		afb_req_success(req, result, NULL);
+}
+
+/*
+ * report the memory used for the subscriptions
+ *
+ * returns an object with 2 fields, periods and events, each
+ * being an object with the fields:
+ *
+ *    inuse:  integer: count of items in use
+ *    free:   integer: count of allocated items ready for recycling
+ *    max:    integer: maximum count of items
+ *    slabs:  integer: count of allocated slabs
+ *    bytes:  integer: memory allocated for the items in bytes
+ */
+static void memory(struct afb_req req)
+{
+	struct json_object *json;
+
+	METRIC_INC(requests);
+	json = json_object_new_object();
+	pthread_mutex_lock(&events_lock);
+	json_object_object_add(json, "periods", pool_report(&pool_of_periods));
+	json_object_object_add(json, "events", pool_report(&pool_of_events));
+	pthread_mutex_unlock(&events_lock);
+	afb_req_success(req, json, NULL);
+}
 
 /*
- * activation function for registering the binding called by afb-daemon
+ * get the metrics of the binding
+ *
+ * returns a string: the metrics in OpenMetrics text format
  */
-const struct afb_binding *afbBindingV1Register(const struct afb_binding_interface *itf)
+static void metrics(struct afb_req req)
 {
-	afbitf = itf;			/* records the interface for accessing afb-daemon */
-	return &binding_description;	/* returns the description of the binding */
+	char *text;
+
+	METRIC_INC(requests);
+	text = metrics_text();
+	if (text == NULL)
+		afb_req_fail(req, "out-of-memory", NULL);
+	else {
+		afb_req_success(req, json_object_new_string(text), NULL);
+		free(text);
+	}
 }
 
-int afbBindingV1ServiceInit(struct afb_service service)
+/*
+ * array of the verbs exported to afb-daemon
+ */
+static const struct afb_verb_v2 binding_verbs[] = {
+  /* VERB'S NAME            FUNCTION TO CALL         SESSION MANAGEMENT             SHORT DESCRIPTION */
+  { .verb= "get",          .callback= get,          .session= AFB_SESSION_NONE_V2, .info= "get the last known data" },
+  { .verb= "at",           .callback= at,           .session= AFB_SESSION_NONE_V2, .info= "get the positions interpolated at given times" },
+  { .verb= "export",       .callback= export,       .session= AFB_SESSION_NONE_V2, .info= "export the history in an Arrow IPC stream file" },
+  { .verb= "near",         .callback= near,         .session= AFB_SESSION_NONE_V2, .info= "get the points of the persisted track near a position" },
+  { .verb= "subscribe",    .callback= subscribe,    .session= AFB_SESSION_NONE_V2, .info= "subscribe to notification of position" },
+  { .verb= "unsubscribe",  .callback= unsubscribe,  .session= AFB_SESSION_NONE_V2, .info= "unsubscribe a previous subscription" },
+  { .verb= "watch",        .callback= watch,        .session= AFB_SESSION_NONE_V2, .info= "watch a derived event" },
+  { .verb= "unwatch",      .callback= unwatch,      .session= AFB_SESSION_NONE_V2, .info= "stop watching a derived event" },
+  { .verb= "route",        .callback= set_route,    .session= AFB_SESSION_NONE_V2, .info= "set the route followed by the derived event route" },
+  { .verb= "tiles",        .callback= get_tiles,    .session= AFB_SESSION_NONE_V2, .info= "get the counts and dwell times of the tiles" },
+  { .verb= "memory",       .callback= memory,       .session= AFB_SESSION_NONE_V2, .info= "report memory used for subscriptions" },
+  { .verb= "metrics",      .callback= metrics,      .session= AFB_SESSION_NONE_V2, .info= "get the metrics in OpenMetrics format" },
+  { .verb= NULL } /* marker for end of the array */
+};
+
+/*
+ * initialisation of the binding, called by afb-daemon
+ */
+static int init()
 {
+	pool_of_periods.max = env_unsigned("AFBGPS_MAX_PERIODS", DEFAULT_MAX_PERIODS);
+	pool_of_events.max = env_unsigned("AFBGPS_MAX_EVENTS", DEFAULT_MAX_EVENTS);
+	log_sampling = env_unsigned("AFBGPS_LOG_SAMPLING", DEFAULT_LOG_SAMPLING);
+	push_budget = (uint64_t)env_unsigned("AFBGPS_PUSH_BUDGET_US", 0) * 1000;
+	if (history_init(env_count("AFBGPS_HISTORY", DEFAULT_HISTORY)) < 0 || tiles_init() < 0)
+		return -1;
+	stop.speed = env_double("AFBGPS_STOP_SPEED", DEFAULT_STOP_SPEED);
+	stop.radius = env_double("AFBGPS_STOP_RADIUS", DEFAULT_STOP_RADIUS);
+	stop.duration = env_unsigned("AFBGPS_STOP_DURATION", DEFAULT_STOP_DURATION);
+	metrics_listen();
+	if (plugin_load_all() < 0 || reckon_init() < 0 || track_init() < 0)
+		return -1;
 	return connection();
 }
+
+/*
+ * description of the binding for afb-daemon
+ *
+ * the verbs can be called concurrently from several threads:
+ * the fix is read through snapshots and the events are
+ * protected by events_lock
+ */
+const struct afb_binding_v2 afbBindingV2 =
+{
+  .api= "gps",				/* the API name */
+  .info= "Access to the GPS data",	/* short description of of the binding */
+  .verbs= binding_verbs,		/* the array describing the verbs of the API */
+  .init= init,				/* the initialisation */
+  .noconcurrency= 0			/* the verbs are thread safe */
+};
@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2016 "IoT.bzh"
+ * Author José Bollo <jose.bollo@iot.bzh>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Interface of the plugins of af-gps-binding
+ *
+ * A plugin is a shared object that decodes proprietary sentences,
+ * the ones beginning with $P like $PUBX or $PMTK. It exports the
+ * function afbGpsPluginRegister that receives the version of the
+ * interface of the binding and the interface below. It fails if the
+ * version is not the AFB_GPS_PLUGIN_VERSION it was built with or
+ * else registers the decoders of the sentences it handles.
+ *
+ * The decoder receives the text of the sentence following its
+ * registered id (and the comma that follows it if any), without
+ * checksum, and a zeroed fix. It returns 1 if it filled the fix that
+ * must be committed or 0 otherwise.
+ *
+ * Example:
+ *
+ *     static const struct afb_gps_plugin_itf *gps;
+ *
+ *     static int pubx(char *s, struct afb_gps_data *fix)
+ *     {
+ *         char *f[2];
+ *         if (!gps->split(s, f, 2) || strcmp(f[0], "00") || !gps->time(f[1], &fix->time))
+ *             return 0;
+ *         fix->set.time = 1;
+ *         return 1;
+ *     }
+ *
+ *     int afbGpsPluginRegister(unsigned version, const struct afb_gps_plugin_itf *itf)
+ *     {
+ *         if (version != AFB_GPS_PLUGIN_VERSION)
+ *             return -1;
+ *         gps = itf;
+ *         return itf->add_decoder("PUBX", pubx);
+ *     }
+ */
+
+#define AFB_GPS_PLUGIN_VERSION 2
+
+/* flags for recording what field is set */
+struct afb_gps_flags {
+	unsigned time: 1;
+	unsigned latitude: 1;
+	unsigned longitude: 1;
+	unsigned altitude: 1;
+	unsigned speed: 1;
+	unsigned track: 1;
+};
+
+/* the gps data converted */
+struct afb_gps_data {
+	struct afb_gps_flags set;
+
+	uint32_t time;		/* time of the day in ms UTC */
+	double latitude;	/* latitude in degree, negative for south */
+	double longitude;	/* longitude in degree from 0 to 360 eastward */
+	double altitude;	/* altitude in meter */
+	double speed;		/* speed in m/s */
+	double track;		/* track in degree */
+};
+
+/* decoder of a proprietary sentence */
+typedef int (*afb_gps_decoder_t)(char *s, struct afb_gps_data *fix);
+
+/* interface given to the plugins */
+struct afb_gps_plugin_itf {
+	/* registers the decoder for sentences starting with id, returns 0 or -1 on error */
+	int (*add_decoder)(const char *id, afb_gps_decoder_t decoder);
+
+	/* splits the count first fields of s, returns 1 if found or 0 otherwise */
+	int (*split)(char *s, char *fields[], int count);
+
+	/* converts a hhmmss.sss time to milliseconds, returns 1 if valid or 0 otherwise */
+	int (*time)(const char *text, uint32_t *result);
+
+	/* converts a dddmm.mmm angle to degrees, returns 1 if valid or 0 otherwise */
+	int (*angle)(const char *text, double *result);
+};
+
+/* the function exported by the plugins, returns 0 or -1 on error */
+extern int afbGpsPluginRegister(unsigned version, const struct afb_gps_plugin_itf *itf);
@@ -0,0 +1,389 @@
+/*
+ * Copyright (C) 2016 "IoT.bzh"
+ * Author José Bollo <jose.bollo@iot.bzh>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "arrow-ipc.h"
+
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+# error "the flatbuffers are written in the byte order of the host that must be little endian"
+#endif
+
+/*
+ * references:
+ *
+ *       https://arrow.apache.org/docs/format/Columnar.html#serialization-and-interprocess-communication-ipc
+ *       https://github.com/apache/arrow/blob/main/format/Message.fbs
+ *       https://github.com/apache/arrow/blob/main/format/Schema.fbs
+ *       https://flatbuffers.dev/internals/
+ */
+
+#define CONTINUATION     0xFFFFFFFFu
+
+#define VERSION_V5       4	/* MetadataVersion.V5 */
+
+#define HEADER_SCHEMA    1	/* MessageHeader.Schema */
+#define HEADER_BATCH     3	/* MessageHeader.RecordBatch */
+
+#define TYPE_INT         2	/* Type.Int */
+#define TYPE_FLOAT       3	/* Type.FloatingPoint */
+#define TYPE_TIMESTAMP   10	/* Type.Timestamp */
+
+#define PRECISION_DOUBLE 2	/* Precision.DOUBLE */
+#define UNIT_MILLISECOND 1	/* TimeUnit.MILLISECOND */
+
+#define MAX_FIELDS       8	/* maximum count of fields of the tables */
+
+/***************************************************************************************/
+/*
+ * building flatbuffers
+ *
+ * the buffer is built forward: the root offset first, then each table
+ * preceded by its vtable and followed by its children. the offsets to
+ * the children are written as 0 and patched when the children are
+ * written, the children being after their parent as flatbuffers want.
+ */
+struct fb {
+	uint8_t *data;		/* the buffer */
+	size_t size;		/* size used */
+	size_t capacity;	/* size allocated */
+	int error;		/* out of memory? */
+};
+
+/* a field of a table */
+struct fbfield {
+	unsigned size;		/* size of the field: 1, 2, 4 or 8, 0 if absent */
+	uint64_t value;		/* value of scalars, 0 for offsets to patch */
+	size_t pos;		/* position of the field once written */
+};
+
+/*
+ * reserves length zeroed bytes at the end of the buffer
+ * returns their position
+ */
+static size_t fb_reserve(struct fb *fb, size_t length)
+{
+	size_t pos, capacity;
+	uint8_t *data;
+
+	pos = fb->size;
+	if (pos + length > fb->capacity) {
+		capacity = fb->capacity ? fb->capacity : 1024;
+		while (pos + length > capacity)
+			capacity *= 2;
+		data = realloc(fb->data, capacity);
+		if (data == NULL) {
+			fb->error = 1;
+			return pos;
+		}
+		fb->data = data;
+		fb->capacity = capacity;
+	}
+	memset(&fb->data[pos], 0, length);
+	fb->size = pos + length;
+	return pos;
+}
+
+/*
+ * pads the buffer for having (size + extra) multiple of align
+ */
+static void fb_align(struct fb *fb, size_t align, size_t extra)
+{
+	fb_reserve(fb, (align - (fb->size + extra) % align) % align);
+}
+
+/*
+ * writes the value of length bytes at pos
+ */
+static void fb_set(struct fb *fb, size_t pos, uint64_t value, unsigned length)
+{
+	if (!fb->error)
+		memcpy(&fb->data[pos], &value, length);
+}
+
+/*
+ * patches the offset at pos for pointing target
+ */
+static void fb_patch(struct fb *fb, size_t pos, size_t target)
+{
+	fb_set(fb, pos, (uint32_t)(target - pos), 4);
+}
+
+/*
+ * writes the table of count fields, preceded by its vtable
+ * returns the position of the table
+ */
+static size_t fb_table(struct fb *fb, struct fbfield *fields, unsigned count)
+{
+	unsigned i, size, offsets[MAX_FIELDS], inline_size;
+	size_t vtable, table;
+
+	/* layout of the fields by decreasing size for their alignment */
+	inline_size = 4;
+	for (size = 8 ; size ; size >>= 1)
+		for (i = 0 ; i < count ; i++)
+			if (fields[i].size == size) {
+				inline_size = (inline_size + size - 1) & ~(size - 1);
+				offsets[i] = inline_size;
+				inline_size += size;
+			}
+
+	/* the vtable, placed for the table to be aligned on 8 */
+	fb_align(fb, 8, 4 + 2 * count);
+	vtable = fb_reserve(fb, 4 + 2 * count);
+	fb_set(fb, vtable, 4 + 2 * count, 2);
+	fb_set(fb, vtable + 2, inline_size, 2);
+	for (i = 0 ; i < count ; i++)
+		fb_set(fb, vtable + 4 + 2 * i, fields[i].size ? offsets[i] : 0, 2);
+
+	/* the table */
+	table = fb_reserve(fb, (inline_size + 7) & ~7u);
+	fb_set(fb, table, (uint32_t)(table - vtable), 4);
+	for (i = 0 ; i < count ; i++)
+		if (fields[i].size) {
+			fields[i].pos = table + offsets[i];
+			fb_set(fb, fields[i].pos, fields[i].value, fields[i].size);
+		}
+	return table;
+}
+
+/*
+ * writes the string
+ * returns its position
+ */
+static size_t fb_string(struct fb *fb, const char *string)
+{
+	size_t pos, length;
+
+	length = strlen(string);
+	fb_align(fb, 4, 0);
+	pos = fb_reserve(fb, 4 + length + 1);
+	fb_set(fb, pos, (uint32_t)length, 4);
+	if (!fb->error)
+		memcpy(&fb->data[pos + 4], string, length);
+	return pos;
+}
+
+/*
+ * writes the vector of count items of size
+ * returns its position, the items being at position + 4
+ */
+static size_t fb_vector(struct fb *fb, const void *items, size_t count, size_t size)
+{
+	size_t pos;
+
+	fb_align(fb, size > 4 ? 8 : 4, 4);
+	pos = fb_reserve(fb, 4 + count * size);
+	fb_set(fb, pos, (uint32_t)count, 4);
+	if (!fb->error && items != NULL)
+		memcpy(&fb->data[pos + 4], items, count * size);
+	return pos;
+}
+
+/***************************************************************************************/
+/*
+ * writing the messages
+ */
+
+/*
+ * writes the message of the flatbuffer and its body
+ * the body is made of the count buffers, each padded to 8
+ */
+static int message_write(FILE *file, struct fb *fb, const void **buffers, const uint64_t *lengths, unsigned count)
+{
+	static const uint8_t zeros[8];
+	uint32_t prefix[2];
+	unsigned i;
+
+	fb_align(fb, 8, 0);
+	if (fb->error)
+		return -1;
+	prefix[0] = CONTINUATION;
+	prefix[1] = (uint32_t)fb->size;
+	if (fwrite(prefix, sizeof prefix, 1, file) != 1
+	 || fwrite(fb->data, fb->size, 1, file) != 1)
+		return -1;
+	for (i = 0 ; i < count ; i++)
+		if ((lengths[i] && fwrite(buffers[i], lengths[i], 1, file) != 1)
+		 || (lengths[i] & 7 && fwrite(zeros, 8 - (lengths[i] & 7), 1, file) != 1))
+			return -1;
+	return 0;
+}
+
+/*
+ * starts the message of header type, returns the position of its header offset
+ */
+static size_t message_start(struct fb *fb, unsigned type, uint64_t body_length)
+{
+	struct fbfield message[] = {
+		{ 2, VERSION_V5, 0 },	/* version */
+		{ 1, type, 0 },		/* header_type */
+		{ 4, 0, 0 },		/* header */
+		{ 8, body_length, 0 }	/* bodyLength */
+	};
+	size_t root;
+
+	root = fb_reserve(fb, 4);
+	fb_patch(fb, root, fb_table(fb, message, 4));
+	return message[2].pos;
+}
+
+/*
+ * get the size in bytes of the values of type
+ */
+static size_t type_size(enum arrow_type type)
+{
+	switch (type) {
+	case arrow_int8: return 1;
+	case arrow_uint32: return 4;
+	default: return 8;
+	}
+}
+
+/*
+ * writes the field of the column, returns its position
+ */
+static size_t field_write(struct fb *fb, const struct arrow_column *column)
+{
+	struct fbfield field[] = {
+		{ 4, 0, 0 },		/* name */
+		{ 1, 1, 0 },		/* nullable */
+		{ 1, 0, 0 },		/* type_type */
+		{ 4, 0, 0 },		/* type */
+		{ 0, 0, 0 },		/* dictionary */
+		{ 4, 0, 0 }		/* children */
+	};
+	struct fbfield type[2];
+	size_t pos, typepos;
+
+	/* the type */
+	memset(type, 0, sizeof type);
+	switch (column->type) {
+	case arrow_double:
+		field[2].value = TYPE_FLOAT;
+		type[0].size = 2;		/* precision */
+		type[0].value = PRECISION_DOUBLE;
+		break;
+	case arrow_timestamp_ms:
+		field[2].value = TYPE_TIMESTAMP;
+		type[0].size = 2;		/* unit */
+		type[0].value = UNIT_MILLISECOND;
+		type[1].size = 4;		/* timezone */
+		break;
+	default:
+		field[2].value = TYPE_INT;
+		type[0].size = 4;		/* bitWidth */
+		type[0].value = 8 * type_size(column->type);
+		type[1].size = 1;		/* is_signed */
+		type[1].value = column->type != arrow_uint32;
+		break;
+	}
+
+	pos = fb_table(fb, field, 6);
+	fb_patch(fb, field[0].pos, fb_string(fb, column->name));
+	typepos = fb_table(fb, type, 2);
+	fb_patch(fb, field[3].pos, typepos);
+	if (column->type == arrow_timestamp_ms)
+		fb_patch(fb, type[1].pos, fb_string(fb, "UTC"));
+	fb_patch(fb, field[5].pos, fb_vector(fb, NULL, 0, 4));
+	return pos;
+}
+
+int arrow_write_schema(FILE *file, const struct arrow_column *columns, unsigned count)
+{
+	struct fb fb = { NULL, 0, 0, 0 };
+	struct fbfield schema[] = {
+		{ 2, 0, 0 },		/* endianness: Little */
+		{ 4, 0, 0 }		/* fields */
+	};
+	size_t header, fields;
+	unsigned i;
+	int rc;
+
+	header = message_start(&fb, HEADER_SCHEMA, 0);
+	fb_patch(&fb, header, fb_table(&fb, schema, 2));
+	fields = fb_vector(&fb, NULL, count, 4);
+	fb_patch(&fb, schema[1].pos, fields);
+	for (i = 0 ; i < count ; i++)
+		fb_patch(&fb, fields + 4 + 4 * i, field_write(&fb, &columns[i]));
+
+	rc = message_write(file, &fb, NULL, NULL, 0);
+	free(fb.data);
+	return rc;
+}
+
+int arrow_write_batch(FILE *file, const struct arrow_column *columns, unsigned count, size_t length)
+{
+	struct fb fb = { NULL, 0, 0, 0 };
+	struct fbfield batch[] = {
+		{ 8, length, 0 },	/* length */
+		{ 4, 0, 0 },		/* nodes */
+		{ 4, 0, 0 }		/* buffers */
+	};
+	uint64_t *nodes, *descs, *lengths, offset;
+	const void **buffers;
+	size_t header;
+	unsigned i;
+	int rc;
+
+	/* the nodes, the descriptions of the buffers and the buffers */
+	nodes = calloc(2 * count, sizeof *nodes);
+	descs = calloc(4 * count, sizeof *descs);
+	lengths = calloc(2 * count, sizeof *lengths);
+	buffers = calloc(2 * count, sizeof *buffers);
+	rc = -1;
+	if (nodes == NULL || descs == NULL || lengths == NULL || buffers == NULL)
+		goto end;
+	offset = 0;
+	for (i = 0 ; i < count ; i++) {
+		nodes[2 * i] = length;
+		nodes[2 * i + 1] = columns[i].validity ? columns[i].null_count : 0;
+		buffers[2 * i] = columns[i].validity;
+		lengths[2 * i] = nodes[2 * i + 1] ? (length + 7) / 8 : 0;
+		buffers[2 * i + 1] = columns[i].values;
+		lengths[2 * i + 1] = length * type_size(columns[i].type);
+		descs[4 * i] = offset;
+		descs[4 * i + 1] = lengths[2 * i];
+		offset += (lengths[2 * i] + 7) & ~(uint64_t)7;
+		descs[4 * i + 2] = offset;
+		descs[4 * i + 3] = lengths[2 * i + 1];
+		offset += (lengths[2 * i + 1] + 7) & ~(uint64_t)7;
+	}
+
+	/* the message */
+	header = message_start(&fb, HEADER_BATCH, offset);
+	fb_patch(&fb, header, fb_table(&fb, batch, 3));
+	fb_patch(&fb, batch[1].pos, fb_vector(&fb, nodes, count, 16));
+	fb_patch(&fb, batch[2].pos, fb_vector(&fb, descs, 2 * count, 16));
+	rc = message_write(file, &fb, buffers, lengths, 2 * count);
+
+end:
+	free(nodes);
+	free(descs);
+	free(lengths);
+	free(buffers);
+	free(fb.data);
+	return rc;
+}
+
+int arrow_write_end(FILE *file)
+{
+	uint32_t end[2] = { CONTINUATION, 0 };
+
+	return fwrite(end, sizeof end, 1, file) == 1 ? 0 : -1;
+}
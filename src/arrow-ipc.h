@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2016 "IoT.bzh"
+ * Author José Bollo <jose.bollo@iot.bzh>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Writing of Apache Arrow IPC streams
+ *
+ * A stream is a schema, followed by record batches of the columns
+ * of the schema, followed by the end marker. The columns are
+ * primitive arrays with an optional bitmap of validity.
+ *
+ * Example:
+ *
+ *     struct arrow_column cols[] = {
+ *         { "time", arrow_timestamp_ms, times, NULL, 0 },
+ *         { "speed", arrow_double, speeds, valids, nulls }
+ *     };
+ *     arrow_write_schema(f, cols, 2);
+ *     arrow_write_batch(f, cols, 2, count);
+ *     arrow_write_end(f);
+ */
+
+/* the types of the columns */
+enum arrow_type {
+	arrow_int8,		/* int8_t */
+	arrow_uint32,		/* uint32_t */
+	arrow_int64,		/* int64_t */
+	arrow_timestamp_ms,	/* int64_t milliseconds since the epoch, UTC */
+	arrow_double		/* double */
+};
+
+/* a column */
+struct arrow_column {
+	const char *name;		/* name of the column */
+	enum arrow_type type;		/* type of its values */
+	const void *values;		/* the values of the batch */
+	const uint8_t *validity;	/* bitmap of the valid values of the batch or NULL */
+	size_t null_count;		/* count of invalid values of the batch */
+};
+
+/* writes the schema of the count columns, returns 0 or -1 on error */
+extern int arrow_write_schema(FILE *file, const struct arrow_column *columns, unsigned count);
+
+/* writes the batch of length values of the count columns, returns 0 or -1 on error */
+extern int arrow_write_batch(FILE *file, const struct arrow_column *columns, unsigned count, size_t length);
+
+/* writes the end of the stream, returns 0 or -1 on error */
+extern int arrow_write_end(FILE *file);
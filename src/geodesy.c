@@ -0,0 +1,329 @@
+/*
+ * Copyright (C) 2016 "IoT.bzh"
+ * Author José Bollo <jose.bollo@iot.bzh>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <math.h>
+
+#include "geodesy.h"
+
+/*
+ * this file is compiled with -fno-math-errno and -fopenmp-simd
+ * for the loops marked with "omp simd" to be vectorized
+ */
+
+#define EARTH_RADIUS        6371008.8           /* mean radius in m */
+#define WGS84_A             6378137.0           /* semi-major axis in m */
+#define WGS84_F             (1 / 298.257223563) /* flattening */
+#define WGS84_B             (WGS84_A * (1 - WGS84_F))
+#define WGS84_E2            (WGS84_F * (2 - WGS84_F))  /* square of the eccentricity */
+
+#define RADIAN              0.017453292519943295       /* pi / 180 */
+#define DEGREE              57.29577951308232          /* 180 / pi */
+
+#define VINCENTY_EPSILON    1e-12
+#define VINCENTY_ITERATIONS 200
+
+/*
+ * get the angle in degree normalized in [0, 360[
+ */
+static inline double normal(double a)
+{
+	a = fmod(a, 360.0);
+	return a < 0 ? a + 360.0 : a;
+}
+
+/*
+ * get the longitude in degree normalized in [-180, 180[
+ */
+static inline double longitude(double a)
+{
+	a = fmod(a + 180.0, 360.0);
+	return a < 0 ? a + 180.0 : a - 180.0;
+}
+
+/*
+ * get the difference of the angles in degree from a0 to a1 in [-180, 180]
+ */
+static inline double delta(double a0, double a1)
+{
+	double d = a1 - a0;
+	return d > 180.0 ? d - 360.0 : d < -180.0 ? d + 360.0 : d;
+}
+
+static inline double haversine(double lat0, double lon0, double coslat0, double lat1, double lon1)
+{
+	double a, slat, slon;
+
+	slat = sin((lat1 - lat0) * (RADIAN / 2));
+	slon = sin((lon1 - lon0) * (RADIAN / 2));
+	a = slat * slat + coslat0 * cos(lat1 * RADIAN) * slon * slon;
+	return 2 * EARTH_RADIUS * asin(sqrt(fmin(a, 1.0)));
+}
+
+double geo_haversine(double lat0, double lon0, double lat1, double lon1)
+{
+	return haversine(lat0, lon0, cos(lat0 * RADIAN), lat1, lon1);
+}
+
+void geo_haversine_batch(double lat0, double lon0, const double *lats, const double *lons,
+			double *distances, size_t n)
+{
+	size_t i;
+	double coslat0 = cos(lat0 * RADIAN);
+
+#pragma omp simd
+	for (i = 0 ; i < n ; i++)
+		distances[i] = haversine(lat0, lon0, coslat0, lats[i], lons[i]);
+}
+
+static inline double bearing(double lon0, double sinlat0, double coslat0, double lat1, double lon1)
+{
+	double dlon, y, x;
+
+	dlon = (lon1 - lon0) * RADIAN;
+	lat1 *= RADIAN;
+	y = sin(dlon) * cos(lat1);
+	x = coslat0 * sin(lat1) - sinlat0 * cos(lat1) * cos(dlon);
+	return atan2(y, x) * DEGREE;
+}
+
+double geo_bearing(double lat0, double lon0, double lat1, double lon1)
+{
+	return normal(bearing(lon0, sin(lat0 * RADIAN), cos(lat0 * RADIAN), lat1, lon1));
+}
+
+void geo_bearing_batch(double lat0, double lon0, const double *lats, const double *lons,
+			double *bearings, size_t n)
+{
+	size_t i;
+	double sinlat0 = sin(lat0 * RADIAN), coslat0 = cos(lat0 * RADIAN), b;
+
+#pragma omp simd private(b)
+	for (i = 0 ; i < n ; i++) {
+		b = bearing(lon0, sinlat0, coslat0, lats[i], lons[i]);
+		bearings[i] = b < 0 ? b + 360.0 : b;
+	}
+}
+
+static inline int vincenty(double lon0, double sinU1, double cosU1, double lat1, double lon1,
+			double *distance, double *azimuth0, double *azimuth1)
+{
+	double L, U2, sinU2, cosU2, lambda, lambdap;
+	double sinlambda, coslambda, sinsigma, cossigma, sigma, sinalpha, cos2alpha;
+	double cos2sigmam, C, u2, A, B, dsigma;
+	int iter;
+
+	L = delta(lon0, lon1) * RADIAN;
+	U2 = atan((1 - WGS84_F) * tan(lat1 * RADIAN));
+	sinU2 = sin(U2);
+	cosU2 = cos(U2);
+
+	lambda = L;
+	iter = VINCENTY_ITERATIONS;
+	do {
+		sinlambda = sin(lambda);
+		coslambda = cos(lambda);
+		sinsigma = sqrt((cosU2 * sinlambda) * (cosU2 * sinlambda)
+			+ (cosU1 * sinU2 - sinU1 * cosU2 * coslambda) * (cosU1 * sinU2 - sinU1 * cosU2 * coslambda));
+		if (sinsigma == 0) {
+			/* coincident points */
+			if (distance)
+				*distance = 0;
+			if (azimuth0)
+				*azimuth0 = 0;
+			if (azimuth1)
+				*azimuth1 = 0;
+			return 0;
+		}
+		cossigma = sinU1 * sinU2 + cosU1 * cosU2 * coslambda;
+		sigma = atan2(sinsigma, cossigma);
+		sinalpha = cosU1 * cosU2 * sinlambda / sinsigma;
+		cos2alpha = 1 - sinalpha * sinalpha;
+		cos2sigmam = cos2alpha != 0 ? cossigma - 2 * sinU1 * sinU2 / cos2alpha : 0; /* equatorial line */
+		C = WGS84_F / 16 * cos2alpha * (4 + WGS84_F * (4 - 3 * cos2alpha));
+		lambdap = lambda;
+		lambda = L + (1 - C) * WGS84_F * sinalpha
+			* (sigma + C * sinsigma * (cos2sigmam + C * cossigma * (-1 + 2 * cos2sigmam * cos2sigmam)));
+	} while (fabs(lambda - lambdap) > VINCENTY_EPSILON && --iter > 0);
+	if (iter == 0)
+		return -1;
+
+	u2 = cos2alpha * (WGS84_A * WGS84_A - WGS84_B * WGS84_B) / (WGS84_B * WGS84_B);
+	A = 1 + u2 / 16384 * (4096 + u2 * (-768 + u2 * (320 - 175 * u2)));
+	B = u2 / 1024 * (256 + u2 * (-128 + u2 * (74 - 47 * u2)));
+	dsigma = B * sinsigma * (cos2sigmam + B / 4 * (cossigma * (-1 + 2 * cos2sigmam * cos2sigmam)
+		- B / 6 * cos2sigmam * (-3 + 4 * sinsigma * sinsigma) * (-3 + 4 * cos2sigmam * cos2sigmam)));
+
+	if (distance)
+		*distance = WGS84_B * A * (sigma - dsigma);
+	if (azimuth0)
+		*azimuth0 = normal(atan2(cosU2 * sinlambda, cosU1 * sinU2 - sinU1 * cosU2 * coslambda) * DEGREE);
+	if (azimuth1)
+		*azimuth1 = normal(atan2(cosU1 * sinlambda, -sinU1 * cosU2 + cosU1 * sinU2 * coslambda) * DEGREE);
+	return 0;
+}
+
+int geo_vincenty(double lat0, double lon0, double lat1, double lon1,
+			double *distance, double *azimuth0, double *azimuth1)
+{
+	double U1 = atan((1 - WGS84_F) * tan(lat0 * RADIAN));
+
+	return vincenty(lon0, sin(U1), cos(U1), lat1, lon1, distance, azimuth0, azimuth1);
+}
+
+size_t geo_vincenty_batch(double lat0, double lon0, const double *lats, const double *lons,
+			double *distances, double *azimuths, size_t n)
+{
+	size_t i, failed;
+	double U1, sinU1, cosU1;
+
+	/* the iterations differ by point, only the origin is shared */
+	U1 = atan((1 - WGS84_F) * tan(lat0 * RADIAN));
+	sinU1 = sin(U1);
+	cosU1 = cos(U1);
+	failed = 0;
+	for (i = 0 ; i < n ; i++)
+		if (vincenty(lon0, sinU1, cosU1, lats[i], lons[i], &distances[i],
+				azimuths ? &azimuths[i] : NULL, NULL) < 0) {
+			distances[i] = NAN;
+			if (azimuths)
+				azimuths[i] = NAN;
+			failed++;
+		}
+	return failed;
+}
+
+static inline void destination(double lon0, double sinlat0, double coslat0, double bearing, double distance,
+			double *lat1, double *lon1)
+{
+	double d, b, sinlat1;
+
+	d = distance / EARTH_RADIUS;
+	b = bearing * RADIAN;
+	sinlat1 = sinlat0 * cos(d) + coslat0 * sin(d) * cos(b);
+	*lat1 = asin(sinlat1) * DEGREE;
+	*lon1 = longitude(lon0 + atan2(sin(b) * sin(d) * coslat0, cos(d) - sinlat0 * sinlat1) * DEGREE);
+}
+
+void geo_destination(double lat0, double lon0, double bearing, double distance,
+			double *lat1, double *lon1)
+{
+	destination(lon0, sin(lat0 * RADIAN), cos(lat0 * RADIAN), bearing, distance, lat1, lon1);
+}
+
+void geo_destination_batch(double lat0, double lon0, const double *bearings, const double *distances,
+			double *lats, double *lons, size_t n)
+{
+	size_t i;
+	double sinlat0 = sin(lat0 * RADIAN), coslat0 = cos(lat0 * RADIAN);
+
+#pragma omp simd
+	for (i = 0 ; i < n ; i++)
+		destination(lon0, sinlat0, coslat0, bearings[i], distances[i], &lats[i], &lons[i]);
+}
+
+/*
+ * computes the earth centered, earth fixed coordinates of the point
+ */
+static inline void ecef(double lat, double lon, double alt, double *x, double *y, double *z)
+{
+	double sinlat, coslat, n;
+
+	sinlat = sin(lat * RADIAN);
+	coslat = cos(lat * RADIAN);
+	n = WGS84_A / sqrt(1 - WGS84_E2 * sinlat * sinlat);
+	*x = (n + alt) * coslat * cos(lon * RADIAN);
+	*y = (n + alt) * coslat * sin(lon * RADIAN);
+	*z = (n * (1 - WGS84_E2) + alt) * sinlat;
+}
+
+void geo_enu(double lat0, double lon0, double alt0, double lat1, double lon1, double alt1,
+			double *east, double *north, double *up)
+{
+	double x0, y0, z0, x1, y1, z1, dx, dy, dz;
+	double sinlat, coslat, sinlon, coslon;
+
+	ecef(lat0, lon0, alt0, &x0, &y0, &z0);
+	ecef(lat1, lon1, alt1, &x1, &y1, &z1);
+	dx = x1 - x0;
+	dy = y1 - y0;
+	dz = z1 - z0;
+	sinlat = sin(lat0 * RADIAN);
+	coslat = cos(lat0 * RADIAN);
+	sinlon = sin(lon0 * RADIAN);
+	coslon = cos(lon0 * RADIAN);
+	*east = -sinlon * dx + coslon * dy;
+	*north = -sinlat * coslon * dx - sinlat * sinlon * dy + coslat * dz;
+	*up = coslat * coslon * dx + coslat * sinlon * dy + sinlat * dz;
+}
+
+void geo_enu_batch(double lat0, double lon0, const double *lats, const double *lons,
+			double *easts, double *norths, size_t n)
+{
+	size_t i;
+	double x0, y0, z0, x, y, z, sinlat0, coslat0, sinlon0, coslon0;
+
+	/* the same projection as geo_enu, the origin being computed once */
+	ecef(lat0, lon0, 0, &x0, &y0, &z0);
+	sinlat0 = sin(lat0 * RADIAN);
+	coslat0 = cos(lat0 * RADIAN);
+	sinlon0 = sin(lon0 * RADIAN);
+	coslon0 = cos(lon0 * RADIAN);
+
+#pragma omp simd private(x, y, z)
+	for (i = 0 ; i < n ; i++) {
+		ecef(lats[i], lons[i], 0, &x, &y, &z);
+		x -= x0;
+		y -= y0;
+		z -= z0;
+		easts[i] = -sinlon0 * x + coslon0 * y;
+		norths[i] = -sinlat0 * coslon0 * x - sinlat0 * sinlon0 * y + coslat0 * z;
+	}
+}
+
+int geo_inside(double lat, double lon, const double *lats, const double *lons, size_t count)
+{
+	size_t i;
+	double x, xi, xj, yi, yj, west;
+	int inside;
+
+	if (count == 0)
+		return 0;
+
+	/*
+	 * the longitudes of the vertices are unwrapped from the first one
+	 * over the antimeridian and the one of the point is taken in their
+	 * frame, east of their westernmost
+	 */
+	west = xj = lons[0];
+	for (i = 1 ; i < count ; i++) {
+		xj += delta(lons[i - 1], lons[i]);
+		west = fmin(west, xj);
+	}
+	x = west + normal(lon - west);
+
+	inside = 0;
+	yj = lats[count - 1];
+	for (i = 0 ; i < count ; i++) {
+		xi = i == 0 ? lons[0] : xj + delta(lons[i - 1], lons[i]);
+		yi = lats[i];
+		if ((yi > lat) != (yj > lat) && x < xj + (lat - yj) * (xi - xj) / (yi - yj))
+			inside = !inside;
+		xj = xi;
+		yj = yi;
+	}
+	return inside;
+}
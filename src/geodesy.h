@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2016 "IoT.bzh"
+ * Author José Bollo <jose.bollo@iot.bzh>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+/*
+ * Geodesy on the WGS84 coordinates
+ *
+ * The latitudes, longitudes, bearings and azimuths are in degree,
+ * the bearings and azimuths being clockwise from the north in [0, 360[.
+ * The distances and altitudes are in meter.
+ *
+ * The functions suffixed by _batch compute for n points at once from
+ * one origin the same values as their scalar function, with loops
+ * vectorized by the compiler except the iterations of Vincenty.
+ */
+
+/* distance on the sphere of mean radius using the haversine formula */
+extern double geo_haversine(double lat0, double lon0, double lat1, double lon1);
+
+/* initial bearing on the sphere from the point 0 to the point 1 */
+extern double geo_bearing(double lat0, double lon0, double lat1, double lon1);
+
+/*
+ * distance and azimuths on the WGS84 ellipsoid using the inverse
+ * formula of Vincenty, any of the results can be NULL
+ * returns 0 or -1 if it doesn't converge (nearly antipodal points)
+ */
+extern int geo_vincenty(double lat0, double lon0, double lat1, double lon1,
+			double *distance, double *azimuth0, double *azimuth1);
+
+/*
+ * point at distance from the point 0 in the direction bearing on the sphere,
+ * its longitude in [-180, 180[
+ */
+extern void geo_destination(double lat0, double lon0, double bearing, double distance,
+			double *lat1, double *lon1);
+
+/* east, north and up coordinates of the point 1 in the tangent plane of the point 0 */
+extern void geo_enu(double lat0, double lon0, double alt0, double lat1, double lon1, double alt1,
+			double *east, double *north, double *up);
+
+/*
+ * is the point inside the polygon of count vertices? (even-odd rule)
+ * its edges are the shortest over the longitudes, so it can cross the
+ * antimeridian but not enclose a pole
+ */
+extern int geo_inside(double lat, double lon, const double *lats, const double *lons, size_t count);
+
+/* distances from the point 0 to the n points */
+extern void geo_haversine_batch(double lat0, double lon0, const double *lats, const double *lons,
+			double *distances, size_t n);
+
+/* bearings from the point 0 to the n points */
+extern void geo_bearing_batch(double lat0, double lon0, const double *lats, const double *lons,
+			double *bearings, size_t n);
+
+/*
+ * distances and initial azimuths (if azimuths isn't NULL) from the point 0
+ * to the n points on the WGS84 ellipsoid, NAN where it doesn't converge
+ * returns the count of points not converging
+ */
+extern size_t geo_vincenty_batch(double lat0, double lon0, const double *lats, const double *lons,
+			double *distances, double *azimuths, size_t n);
+
+/* points at the distances from the point 0 in the directions bearings on the sphere */
+extern void geo_destination_batch(double lat0, double lon0, const double *bearings, const double *distances,
+			double *lats, double *lons, size_t n);
+
+/*
+ * east and north coordinates of the n points in the tangent plane of the
+ * point 0 as geo_enu gives them, all the points being at the altitude 0
+ */
+extern void geo_enu_batch(double lat0, double lon0, const double *lats, const double *lons,
+			double *easts, double *norths, size_t n);
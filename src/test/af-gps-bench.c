@@ -0,0 +1,1273 @@
+/*
+ * Copyright (C) 2016 "IoT.bzh"
+ * Author José Bollo <jose.bollo@iot.bzh>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * the micro-benchmarks of the binding
+ *
+ * the binding is compiled in this program against the stub of afb, so
+ * the cases reach its static functions and call its verbs directly
+ */
+#define _GNU_SOURCE
+#include <getopt.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#include "../af-gps-binding.c"
+
+#include "afb-stub.h"
+
+/*
+ * each case processes points, sentences or positions, by chunks until
+ * bench_time is elapsed, and this BENCH_RUNS times. its rate is the
+ * median of the runs and its noise the median of the deviations to
+ * the rate, relatively to the rate. a case regresses from a baseline
+ * when its rate is lower by more than the threshold, that is the
+ * largest of BENCH_THRESHOLD and BENCH_NOISES times the noises.
+ */
+#define BENCH_RUNS       5		/* count of runs of a case */
+#define BENCH_THRESHOLD  0.05		/* minimal relative change reported */
+#define BENCH_NOISES     3		/* count of noises of the threshold */
+#define BENCH_POINTS     1024		/* count of points of the geodesy cases */
+#define BENCH_PERIODS    31		/* count of periods of the scheduling case */
+#define BENCH_MONTH      2592000	/* count of points of the month of the track cases */
+#define BENCH_BLOCK      60		/* count of points of the blocks of the track cases */
+#define BENCH_CLIENTS    16		/* count of concurrent clients of the clients case */
+#define BENCH_SAMPLES    (1 << 20)	/* maximum count of latencies of a verb */
+#define BENCH_GETS       16		/* count of gets of a client between two subscriptions */
+#define BENCH_SOURCES    1000		/* count of sources of the input cases */
+
+/* duration of one run in ns, set by --time */
+static uint64_t bench_time = 200000000;
+
+static const char bench_GGA[] = "GPGGA,123519.00,4807.038,N,01131.000,E,1,08,0.9,545.4,M,46.9,M,,";
+
+/* the values computed, for the compiler not dropping their computation */
+static volatile double bench_sink;
+
+/* the points of the geodesy cases */
+static double bench_lats[BENCH_POINTS], bench_lons[BENCH_POINTS], bench_out[2][BENCH_POINTS];
+static double bench_bearings[BENCH_POINTS], bench_distances[BENCH_POINTS];
+
+/* the fix of the position cases */
+static struct fix bench_fix;
+
+/* the source replaying the log */
+static struct source bench_source = { .fd = -1 };
+static uint64_t bench_lines;
+
+/* the verbs called by the clients */
+enum bench_verb {
+	bench_verb_get,
+	bench_verb_subscribe,
+	bench_verb_unsubscribe,
+	bench_verb_COUNT
+};
+
+static const char * const bench_VERBS[bench_verb_COUNT] = { "get", "subscribe", "unsubscribe" };
+
+/* the latencies in ns of the requests of each verb, counted atomically */
+static struct {
+	uint64_t *samples;
+	unsigned count;
+} bench_latencies[bench_verb_COUNT];
+
+/* the concurrent clients */
+static pthread_t bench_threads[BENCH_CLIENTS];
+static int bench_stopping;
+static unsigned bench_requests;
+
+/* the sources of the input cases, fed by a thread */
+static struct {
+	struct source *sources;		/* the sources reading the sockets */
+	int (*sockets)[2];		/* the read and write sockets of the sources */
+	int epoll;			/* the epoll of the epoll case or -1 */
+	pthread_t writer;		/* the thread writing the sockets */
+	int stopping;			/* is the writer stopping? */
+	uint64_t syscalls;		/* system calls of the reading thread */
+	uint64_t sentences;		/* sentences read before the case */
+	uint64_t reads;			/* reads before the case */
+	uint64_t start;			/* nanonow at the start of the case */
+	uint64_t cpu;			/* cpu time of the reading thread at the start */
+} bench_input = { .epoll = -1 };
+
+/* the thread replaying the log as the real-time thread reads the sources */
+static struct {
+	pthread_t thread;		/* the thread or 0 */
+	pthread_mutex_t lock;		/* protects count and stopping */
+	pthread_cond_t cond;		/* signals the changes of count and stopping */
+	unsigned count;			/* replays requested or 0 once done */
+	int stopping;			/* is the thread stopping? */
+	uint64_t allocations;		/* calls to the allocator by the thread after its init */
+} bench_ingest = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+/* the track of the track cases, in a temporary directory */
+static struct track bench_track = { .data = -1, .index = -1, .lock = PTHREAD_MUTEX_INITIALIZER };
+static char bench_dir[PATH_MAX];
+static uint64_t bench_second;
+
+/* the cases: process count times, return the count of items processed */
+static uint64_t bench_nmea_time(unsigned count)
+{
+	unsigned i;
+	uint32_t t = 0;
+
+	for (i = 0 ; i < count ; i++)
+		nmea_time("123519.00", &t);
+	bench_sink = t;
+	return count;
+}
+
+static uint64_t bench_nmea_angle(unsigned count)
+{
+	unsigned i;
+	double a = 0;
+
+	for (i = 0 ; i < count ; i++)
+		nmea_angle("4807.038", &a);
+	bench_sink = a;
+	return count;
+}
+
+static uint64_t bench_nmea_split(unsigned count)
+{
+	unsigned i;
+	char line[sizeof bench_GGA], *fields[16];
+
+	for (i = 0 ; i < count ; i++) {
+		memcpy(line, bench_GGA, sizeof line);
+		bench_sink = nmea_split(&line[6], fields, 14);
+	}
+	return count;
+}
+
+static uint64_t bench_position(unsigned count, enum type type)
+{
+	unsigned i;
+	struct cache cache;
+
+	memset(&cache, 0, sizeof cache);
+	for (i = 0 ; i < count ; i++) {
+		json_object_put(position(&cache, &bench_fix, type, FIELDS_ALL));
+		cache_clear(&cache);
+	}
+	return count;
+}
+
+static uint64_t bench_position_wgs84(unsigned count) { return bench_position(count, type_wgs84); }
+static uint64_t bench_position_dms_kmh(unsigned count) { return bench_position(count, type_dms_kmh); }
+static uint64_t bench_position_dms_mph(unsigned count) { return bench_position(count, type_dms_mph); }
+static uint64_t bench_position_dms_kn(unsigned count) { return bench_position(count, type_dms_kn); }
+
+static uint64_t bench_new_dms(unsigned count)
+{
+	unsigned i;
+
+	for (i = 0 ; i < count ; i++)
+		json_object_put(new_dms(48.1173 + i * 1e-6, 1));
+	return count;
+}
+
+static uint64_t bench_event_get(unsigned count)
+{
+	struct period **pp;
+	unsigned i;
+
+	pthread_mutex_lock(&events_lock);
+	for (i = 0 ; i < count ; i++) {
+		pp = &list_of_periods;
+		event_get_from(&pp, type_wgs84, FIELDS_ALL, 0, priority_DEFAULT, period_normal((int)(100 * (1 + i % BENCH_PERIODS))));
+	}
+	pthread_mutex_unlock(&events_lock);
+	return count;
+}
+
+/*
+ * removes the periods and the events of the cases
+ */
+static void bench_events_clear()
+{
+	struct period *p;
+	struct event *e;
+
+	pthread_mutex_lock(&events_lock);
+	while ((p = list_of_periods) != NULL) {
+		while ((e = p->events) != NULL) {
+			p->events = e->next;
+			afb_event_drop(e->event);
+			pool_put(&pool_of_events, e);
+		}
+		list_of_periods = p->next;
+		pool_put(&pool_of_periods, p);
+	}
+	fields_demand_update();
+	pthread_mutex_unlock(&events_lock);
+}
+
+/*
+ * subscribes to an event of each type for count periods through the
+ * verb subscribe, so that the events have a listener
+ * returns 0 or -1 on error
+ */
+static int bench_events_make(unsigned count)
+{
+	struct json_object *args;
+	unsigned i;
+	enum type type;
+	int rc;
+
+	rc = 0;
+	args = json_object_new_object();
+	for (i = 0 ; rc == 0 && i < count ; i++)
+		for (type = 0 ; rc == 0 && type < type_COUNT ; type++) {
+			json_object_object_add(args, "type", json_object_new_string(type_NAMES[type]));
+			json_object_object_add(args, "period", json_object_new_int((int)(100 * (1 + i))));
+			if (strcmp(stub_call(subscribe, args, NULL), "success") != 0)
+				rc = -1;
+		}
+	json_object_put(args);
+	if (rc < 0)
+		bench_events_clear();
+	return rc;
+}
+
+static int bench_events_many() { return bench_events_make(BENCH_PERIODS); }
+static int bench_events_one() { return bench_events_make(1); }
+
+static uint64_t bench_event_send(unsigned count)
+{
+	unsigned i;
+	struct period *p;
+
+	for (i = 0 ; i < count ; i++) {
+		bench_fix.gps.time += 100;
+		fix_commit(NULL, &bench_fix);
+		/* all the periods are due */
+		for (p = list_of_periods ; p != NULL ; p = p->next)
+			p->last -= p->period;
+		event_send();
+	}
+	return (uint64_t)count * BENCH_PERIODS * type_COUNT;
+}
+
+static uint64_t bench_haversine(unsigned count)
+{
+	unsigned i;
+
+	for (i = 0 ; i < count ; i++)
+		geo_haversine_batch(48.1, 11.5, bench_lats, bench_lons, bench_out[0], BENCH_POINTS);
+	bench_sink = bench_out[0][0];
+	return (uint64_t)count * BENCH_POINTS;
+}
+
+static uint64_t bench_enu(unsigned count)
+{
+	unsigned i;
+
+	for (i = 0 ; i < count ; i++)
+		geo_enu_batch(48.1, 11.5, bench_lats, bench_lons, bench_out[0], bench_out[1], BENCH_POINTS);
+	bench_sink = bench_out[0][0];
+	return (uint64_t)count * BENCH_POINTS;
+}
+
+static uint64_t bench_vincenty(unsigned count)
+{
+	unsigned i;
+	double d = 0;
+
+	for (i = 0 ; i < count ; i++)
+		geo_vincenty(48.1, 11.5, bench_lats[i % BENCH_POINTS], bench_lons[i % BENCH_POINTS], &d, NULL, NULL);
+	bench_sink = d;
+	return count;
+}
+
+static uint64_t bench_vincenty_batch(unsigned count)
+{
+	unsigned i;
+
+	for (i = 0 ; i < count ; i++)
+		geo_vincenty_batch(48.1, 11.5, bench_lats, bench_lons, bench_out[0], bench_out[1], BENCH_POINTS);
+	bench_sink = bench_out[0][0];
+	return (uint64_t)count * BENCH_POINTS;
+}
+
+static uint64_t bench_destination(unsigned count)
+{
+	unsigned i;
+
+	for (i = 0 ; i < count ; i++)
+		geo_destination_batch(48.1, 11.5, bench_bearings, bench_distances, bench_out[0], bench_out[1], BENCH_POINTS);
+	bench_sink = bench_out[0][0];
+	return (uint64_t)count * BENCH_POINTS;
+}
+
+/*
+ * get the position of the track at second, a daily loop of 40 km
+ */
+static void bench_track_point(uint64_t second, double *lat, double *lon)
+{
+	double a;
+
+	a = 2 * M_PI * (double)(second % 86400) / 86400;
+	*lat = 48.1 + 0.05 * sin(a);
+	*lon = 11.5 + 0.08 * cos(a);
+}
+
+/*
+ * appends count blocks of BENCH_BLOCK points, one per second, to the track
+ * returns 0 or -1 on error
+ */
+static int bench_track_fill(unsigned count)
+{
+	uint64_t stamps[BENCH_BLOCK];
+	double lats[BENCH_BLOCK], lons[BENCH_BLOCK];
+	unsigned i, j;
+
+	for (i = 0 ; i < count ; i++) {
+		for (j = 0 ; j < BENCH_BLOCK ; j++, bench_second++) {
+			stamps[j] = 1700000000000 + 1000 * bench_second;
+			bench_track_point(bench_second, &lats[j], &lons[j]);
+		}
+		if (track_append(&bench_track, stamps, lats, lons, BENCH_BLOCK) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * removes the track and its temporary directory
+ */
+static void bench_track_close()
+{
+	char path[PATH_MAX];
+
+	if (bench_track.data >= 0)
+		close(bench_track.data);
+	if (bench_track.index >= 0)
+		close(bench_track.index);
+	if (bench_dir[0]) {
+		snprintf(path, sizeof path, "%s/track.dat", bench_dir);
+		unlink(path);
+		snprintf(path, sizeof path, "%s/track.idx", bench_dir);
+		unlink(path);
+		rmdir(bench_dir);
+	}
+	free(bench_track.blocks);
+	bench_track.data = bench_track.index = -1;
+	bench_track.blocks = NULL;
+	bench_track.count = bench_track.capacity = 0;
+	bench_track.size = 0;
+	bench_dir[0] = 0;
+	bench_second = 0;
+}
+
+/*
+ * creates an empty track in a temporary directory
+ * returns 0 or -1 on error
+ */
+static int bench_track_open()
+{
+	const char *tmp;
+
+	tmp = getenv("TMPDIR");
+	snprintf(bench_dir, sizeof bench_dir, "%s/afb-gps-bench-XXXXXX", tmp ? tmp : "/tmp");
+	if (mkdtemp(bench_dir) == NULL) {
+		bench_dir[0] = 0;
+		return -1;
+	}
+	bench_track.data = track_open(bench_dir, "track.dat");
+	bench_track.index = track_open(bench_dir, "track.idx");
+	if (bench_track.data < 0 || bench_track.index < 0) {
+		bench_track_close();
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * creates the track of a month of fixes at 1 Hz
+ * returns 0 or -1 on error
+ */
+static int bench_track_month()
+{
+	if (bench_track_open() < 0 || bench_track_fill(BENCH_MONTH / BENCH_BLOCK) < 0) {
+		bench_track_close();
+		return -1;
+	}
+	return 0;
+}
+
+static uint64_t bench_track_append(unsigned count)
+{
+	return bench_track_fill(count) < 0 ? 0 : (uint64_t)count * BENCH_BLOCK;
+}
+
+static uint64_t bench_track_near(unsigned count)
+{
+	unsigned i;
+	double lat, lon;
+	struct json_object *array;
+
+	for (i = 0 ; i < count ; i++) {
+		bench_track_point((uint64_t)i * 7919, &lat, &lon);
+		array = json_object_new_array();
+		track_near(&bench_track, array, lat, lon, 100, 0, UINT64_MAX, DEFAULT_NEAR_LIMIT);
+		json_object_put(array);
+	}
+	return count;
+}
+
+/*
+ * calls the verb for a client and records its latency
+ * stores its reply in reply if not NULL
+ * returns 0 on success or -1 on failure
+ */
+static int bench_call(enum bench_verb v, void (*verb)(struct afb_req req), struct json_object *args, struct json_object **reply)
+{
+	uint64_t start;
+	unsigned i;
+	int rc;
+
+	start = nanonow();
+	rc = strcmp(stub_call(verb, args, reply), "success") == 0 ? 0 : -1;
+	i = __atomic_fetch_add(&bench_latencies[v].count, 1, __ATOMIC_RELAXED);
+	if (i < BENCH_SAMPLES)
+		bench_latencies[v].samples[i] = nanonow() - start;
+	__atomic_fetch_add(&bench_requests, 1, __ATOMIC_RELAXED);
+	return rc;
+}
+
+/*
+ * a client getting the positions of each type through the verb get
+ * and, every BENCH_GETS gets, subscribing to an event of the periods of
+ * the case and unsubscribing from it, until bench_stopping is set
+ */
+static void *bench_client(void *arg)
+{
+	struct json_object *gets[type_COUNT], *subscription, *unsubscription, *reply, *id;
+	enum type type;
+	unsigned n;
+
+	for (type = 0 ; type < type_COUNT ; type++) {
+		gets[type] = json_object_new_object();
+		json_object_object_add(gets[type], "type", json_object_new_string(type_NAMES[type]));
+	}
+	subscription = json_object_new_object();
+	unsubscription = json_object_new_object();
+	type = (enum type)((intptr_t)arg % type_COUNT);
+	for (n = 1 ; !__atomic_load_n(&bench_stopping, __ATOMIC_RELAXED) ; n++) {
+		bench_call(bench_verb_get, get, gets[type], NULL);
+		if (n % BENCH_GETS == 0) {
+			json_object_object_add(subscription, "type", json_object_new_string(type_NAMES[type]));
+			json_object_object_add(subscription, "period", json_object_new_int((int)(100 * (1 + n / BENCH_GETS % BENCH_PERIODS))));
+			if (bench_call(bench_verb_subscribe, subscribe, subscription, &reply) == 0
+			 && json_object_object_get_ex(reply, "id", &id)) {
+				json_object_object_add(unsubscription, "id", json_object_get(id));
+				bench_call(bench_verb_unsubscribe, unsubscribe, unsubscription, NULL);
+			}
+			json_object_put(reply);
+		}
+		type = (type + 1) % type_COUNT;
+	}
+	for (type = 0 ; type < type_COUNT ; type++)
+		json_object_put(gets[type]);
+	json_object_put(subscription);
+	json_object_put(unsubscription);
+	return NULL;
+}
+
+/*
+ * releases the latencies of the verbs
+ */
+static void bench_latencies_free()
+{
+	int v;
+
+	for (v = 0 ; v < bench_verb_COUNT ; v++) {
+		free(bench_latencies[v].samples);
+		bench_latencies[v].samples = NULL;
+	}
+}
+
+/*
+ * stops the clients and removes the events
+ */
+static void bench_clients_stop()
+{
+	int i;
+
+	__atomic_store_n(&bench_stopping, 1, __ATOMIC_RELAXED);
+	for (i = 0 ; i < BENCH_CLIENTS ; i++)
+		if (bench_threads[i])
+			pthread_join(bench_threads[i], NULL);
+	memset(bench_threads, 0, sizeof bench_threads);
+	bench_latencies_free();
+	bench_events_clear();
+}
+
+/*
+ * starts the clients, with the events of each type of 31 periods
+ * subscribed, so that the subscriptions of the clients don't drop them
+ * returns 0 or -1 on error
+ */
+static int bench_clients_start()
+{
+	int i, v;
+
+	for (v = 0 ; v < bench_verb_COUNT ; v++) {
+		bench_latencies[v].samples = malloc(BENCH_SAMPLES * sizeof *bench_latencies[v].samples);
+		bench_latencies[v].count = 0;
+		if (bench_latencies[v].samples == NULL) {
+			bench_latencies_free();
+			return -1;
+		}
+	}
+	if (bench_events_make(BENCH_PERIODS) < 0) {
+		bench_latencies_free();
+		return -1;
+	}
+	bench_requests = 0;
+	bench_stopping = 0;
+	for (i = 0 ; i < BENCH_CLIENTS ; i++)
+		if (pthread_create(&bench_threads[i], NULL, bench_client, (void*)(intptr_t)i) != 0) {
+			bench_threads[i] = 0;
+			bench_clients_stop();
+			return -1;
+		}
+	return 0;
+}
+
+/*
+ * commits and publishes count fixes while the clients get them
+ * returns the count of the requests of the clients meanwhile
+ */
+static uint64_t bench_clients(unsigned count)
+{
+	unsigned i, before;
+	struct period *p;
+
+	before = __atomic_load_n(&bench_requests, __ATOMIC_RELAXED);
+	for (i = 0 ; i < count ; i++) {
+		bench_fix.gps.time += 100;
+		fix_commit(NULL, &bench_fix);
+		pthread_mutex_lock(&events_lock);
+		for (p = list_of_periods ; p != NULL ; p = p->next)
+			p->last -= p->period;
+		pthread_mutex_unlock(&events_lock);
+		event_send();
+	}
+	return __atomic_load_n(&bench_requests, __ATOMIC_RELAXED) - before;
+}
+
+/*
+ * compares the integers for qsort
+ */
+static int bench_compare_samples(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * adds to item the percentiles of the latencies of the requests of
+ * each verb in µs
+ */
+static void bench_percentiles(struct json_object *item)
+{
+	static const double percentiles[] = { 50, 90, 99, 99.9 };
+	static const char *names[] = { "p50", "p90", "p99", "p999" };
+	struct json_object *latencies, *latency;
+	uint64_t *samples;
+	unsigned i, n;
+	int v;
+
+	latencies = json_object_new_object();
+	for (v = 0 ; v < bench_verb_COUNT ; v++) {
+		n = bench_latencies[v].count < BENCH_SAMPLES ? bench_latencies[v].count : BENCH_SAMPLES;
+		if (n == 0)
+			continue;
+		samples = bench_latencies[v].samples;
+		qsort(samples, n, sizeof *samples, bench_compare_samples);
+		latency = json_object_new_object();
+		for (i = 0 ; i < sizeof percentiles / sizeof *percentiles ; i++)
+			json_object_object_add(latency, names[i],
+				json_object_new_double((double)samples[(unsigned)(percentiles[i] / 100 * (n - 1))] / 1000));
+		json_object_object_add(latencies, bench_VERBS[v], latency);
+	}
+	json_object_object_add(item, "latency_us", latencies);
+}
+
+/*
+ * the cpu time in ns of the current thread
+ */
+static uint64_t bench_cpu()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * writes a sentence to each source in turn until stopping
+ */
+static void *bench_writer(void *arg)
+{
+	static const char line[] = "$GPGGA,123519.00,4807.038,N,01131.000,E,1,08,0.9,545.4,M,46.9,M,,\r\n";
+	int i;
+
+	while (!__atomic_load_n(&bench_input.stopping, __ATOMIC_RELAXED))
+		for (i = 0 ; i < BENCH_SOURCES ; i++)
+			if (send(bench_input.sockets[i][1], line, sizeof line - 1, MSG_NOSIGNAL) < 0)
+				return NULL;
+	return NULL;
+}
+
+/*
+ * stops the writer and closes the sources
+ */
+static void bench_input_close()
+{
+	int i;
+
+	if (bench_input.sockets == NULL)
+		return;
+	__atomic_store_n(&bench_input.stopping, 1, __ATOMIC_RELAXED);
+	for (i = 0 ; i < BENCH_SOURCES ; i++)
+		shutdown(bench_input.sockets[i][0], SHUT_RD);
+	if (bench_input.writer) {
+		pthread_join(bench_input.writer, NULL);
+		bench_input.writer = 0;
+	}
+	for (i = 0 ; i < BENCH_SOURCES ; i++) {
+		if (bench_input.sockets[i][0] >= 0)
+			close(bench_input.sockets[i][0]);
+		if (bench_input.sockets[i][1] >= 0)
+			close(bench_input.sockets[i][1]);
+	}
+	free(bench_input.sockets);
+	free(bench_input.sources);
+	bench_input.sockets = NULL;
+	bench_input.sources = NULL;
+	if (bench_input.epoll >= 0) {
+		close(bench_input.epoll);
+		bench_input.epoll = -1;
+	}
+}
+
+/*
+ * opens the sockets of the sources, raising the limit of files
+ * returns 0 or -1 on error
+ */
+static int bench_input_open()
+{
+	struct rlimit limit;
+	int i;
+
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < 2 * BENCH_SOURCES + 64) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+	bench_input.sockets = malloc(BENCH_SOURCES * sizeof *bench_input.sockets);
+	bench_input.sources = calloc(BENCH_SOURCES, sizeof *bench_input.sources);
+	if (bench_input.sockets == NULL || bench_input.sources == NULL) {
+		free(bench_input.sockets);
+		free(bench_input.sources);
+		bench_input.sockets = NULL;
+		bench_input.sources = NULL;
+		return -1;
+	}
+	for (i = 0 ; i < BENCH_SOURCES ; i++)
+		bench_input.sockets[i][0] = bench_input.sockets[i][1] = -1;
+	for (i = 0 ; i < BENCH_SOURCES ; i++) {
+		if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, bench_input.sockets[i]) < 0
+		 || fcntl(bench_input.sockets[i][0], F_SETFL, O_NONBLOCK) < 0) {
+			bench_input_close();
+			return -1;
+		}
+		bench_input.sources[i].index = i;
+		bench_input.sources[i].fd = bench_input.sockets[i][0];
+	}
+	return 0;
+}
+
+/*
+ * starts the writer and the measures of the case
+ * returns 0 or -1 on error
+ */
+static int bench_input_start()
+{
+	bench_input.stopping = 0;
+	if (pthread_create(&bench_input.writer, NULL, bench_writer, NULL) != 0) {
+		bench_input.writer = 0;
+		bench_input_close();
+		return -1;
+	}
+	bench_input.syscalls = 0;
+	bench_input.sentences = metrics_get()->sentences;
+	bench_input.reads = metrics_get()->reads;
+	bench_input.cpu = bench_cpu();
+	bench_input.start = nanonow();
+	return 0;
+}
+
+/*
+ * adds to item the system calls and the cpu of the reading thread
+ * per second and per sentence
+ */
+static void bench_input_report(struct json_object *item)
+{
+	double elapsed, syscalls, sentences;
+
+	elapsed = (double)(nanonow() - bench_input.start) / 1e9;
+	syscalls = (double)(bench_input.syscalls + metrics_get()->reads - bench_input.reads);
+	sentences = (double)(metrics_get()->sentences - bench_input.sentences);
+	json_object_object_add(item, "syscalls_per_s", json_object_new_double(syscalls / elapsed));
+	json_object_object_add(item, "syscalls_per_sentence", json_object_new_double(sentences > 0 ? syscalls / sentences : 0));
+	json_object_object_add(item, "cpu", json_object_new_double((double)(bench_cpu() - bench_input.cpu) / 1e9 / elapsed));
+}
+
+/*
+ * the epoll case reads the ready sources as on_event does
+ */
+static int bench_epoll_start()
+{
+	struct epoll_event ev;
+	int i;
+
+	if (bench_input_open() < 0)
+		return -1;
+	bench_input.epoll = epoll_create1(EPOLL_CLOEXEC);
+	if (bench_input.epoll < 0)
+		goto error;
+	for (i = 0 ; i < BENCH_SOURCES ; i++) {
+		ev.events = EPOLLIN;
+		ev.data.ptr = &bench_input.sources[i];
+		if (epoll_ctl(bench_input.epoll, EPOLL_CTL_ADD, bench_input.sources[i].fd, &ev) < 0)
+			goto error;
+	}
+	return bench_input_start();
+
+error:
+	bench_input_close();
+	return -1;
+}
+
+static uint64_t bench_epoll(unsigned count)
+{
+	struct epoll_event evs[64];
+	uint64_t before;
+	unsigned i;
+	int n, j;
+
+	before = metrics_get()->sentences;
+	for (i = 0 ; i < count ; i++) {
+		n = epoll_wait(bench_input.epoll, evs, sizeof evs / sizeof *evs, -1);
+		bench_input.syscalls++;
+		for (j = 0 ; j < n ; j++) {
+			nmea_read(evs[j].data.ptr);
+			event_send();
+		}
+	}
+	return metrics_get()->sentences - before;
+}
+
+#if WITH_IO_URING
+/*
+ * the io_uring case processes the completions in batches as
+ * uring_on_event does
+ */
+static void bench_uring_stop()
+{
+	bench_input_close();
+	uring_release();
+}
+
+static int bench_uring_start()
+{
+	int i;
+
+	if (bench_input_open() < 0)
+		return -1;
+	if (uring_setup() < 0) {
+		bench_input_close();
+		return -1;
+	}
+	for (i = 0 ; i < BENCH_SOURCES ; i++)
+		if (uring_arm(&bench_input.sources[i]) < 0) {
+			bench_uring_stop();
+			return -1;
+		}
+	io_uring_submit(&uring.ring);
+	if (bench_input_start() < 0) {
+		uring_release();
+		return -1;
+	}
+	return 0;
+}
+static uint64_t bench_uring(unsigned count)
+{
+	uint64_t before;
+	unsigned i;
+
+	before = metrics_get()->sentences;
+	for (i = 0 ; i < count ; i++) {
+		io_uring_submit_and_wait(&uring.ring, 1);
+		bench_input.syscalls++;
+		if (uring_complete() > 0)
+			bench_input.syscalls++;
+		event_send();
+	}
+	return metrics_get()->sentences - before;
+}
+#endif
+
+/*
+ * the allocator counting the calls of the current thread once armed
+ *
+ * it replaces the one of the C library for the program and the libraries
+ * it uses, json-c included, and forwards the calls to it
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static __thread int bench_armed;		/* are the calls counted? */
+static __thread uint64_t bench_allocations;	/* the calls counted */
+
+void *malloc(size_t size)
+{
+	bench_allocations += (uint64_t)bench_armed;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size)
+{
+	bench_allocations += (uint64_t)bench_armed;
+	return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	bench_allocations += (uint64_t)bench_armed;
+	return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+	bench_allocations += (uint64_t)(bench_armed && ptr != NULL);
+	__libc_free(ptr);
+}
+
+/*
+ * replays the log on demand after the init of the thread as the
+ * real-time thread, counting the calls to the allocator
+ */
+static void *bench_ingester(void *arg)
+{
+	unsigned i, count;
+
+	realtime_thread_init();
+	pthread_mutex_lock(&bench_ingest.lock);
+	bench_ingest.count = 0;
+	pthread_cond_broadcast(&bench_ingest.cond);
+	for (;;) {
+		while (bench_ingest.count == 0 && !bench_ingest.stopping)
+			pthread_cond_wait(&bench_ingest.cond, &bench_ingest.lock);
+		if (bench_ingest.stopping)
+			break;
+		count = bench_ingest.count;
+		pthread_mutex_unlock(&bench_ingest.lock);
+		bench_armed = 1;
+		for (i = 0 ; i < count ; i++) {
+			lseek(bench_source.fd, 0, SEEK_SET);
+			nmea_read(&bench_source);
+		}
+		bench_armed = 0;
+		pthread_mutex_lock(&bench_ingest.lock);
+		bench_ingest.allocations += bench_allocations;
+		bench_allocations = 0;
+		bench_ingest.count = 0;
+		pthread_cond_broadcast(&bench_ingest.cond);
+	}
+	pthread_mutex_unlock(&bench_ingest.lock);
+	return NULL;
+}
+
+static void bench_ingest_stop()
+{
+	pthread_mutex_lock(&bench_ingest.lock);
+	bench_ingest.stopping = 1;
+	pthread_cond_broadcast(&bench_ingest.cond);
+	pthread_mutex_unlock(&bench_ingest.lock);
+	pthread_join(bench_ingest.thread, NULL);
+	bench_ingest.thread = 0;
+	afbBindingV2verbosity = -1;
+}
+
+/*
+ * starts the thread replaying the log, in debug verbosity for checking
+ * that it doesn't log the sampled messages
+ */
+static int bench_ingest_start()
+{
+	if (bench_source.fd < 0)
+		return -1;
+	afbBindingV2verbosity = LOG_LEVEL_DEBUG;
+	bench_ingest.stopping = 0;
+	bench_ingest.allocations = 0;
+	bench_ingest.count = UINT_MAX;
+	if (pthread_create(&bench_ingest.thread, NULL, bench_ingester, NULL) != 0) {
+		bench_ingest.thread = 0;
+		afbBindingV2verbosity = -1;
+		return -1;
+	}
+
+	/* wait the end of its init */
+	pthread_mutex_lock(&bench_ingest.lock);
+	while (bench_ingest.count != 0)
+		pthread_cond_wait(&bench_ingest.cond, &bench_ingest.lock);
+	pthread_mutex_unlock(&bench_ingest.lock);
+	return 0;
+}
+
+static uint64_t bench_ingest_replay(unsigned count)
+{
+	pthread_mutex_lock(&bench_ingest.lock);
+	bench_ingest.count = count;
+	pthread_cond_broadcast(&bench_ingest.cond);
+	while (bench_ingest.count != 0)
+		pthread_cond_wait(&bench_ingest.cond, &bench_ingest.lock);
+	pthread_mutex_unlock(&bench_ingest.lock);
+	return (uint64_t)count * bench_lines;
+}
+
+static uint64_t bench_nmea_read(unsigned count)
+{
+	unsigned i;
+
+	for (i = 0 ; i < count ; i++) {
+		lseek(bench_source.fd, 0, SEEK_SET);
+		nmea_read(&bench_source);
+	}
+	return (uint64_t)count * bench_lines;
+}
+
+static uint64_t bench_replay(unsigned count)
+{
+	unsigned i;
+
+	for (i = 0 ; i < count ; i++) {
+		lseek(bench_source.fd, 0, SEEK_SET);
+		nmea_read(&bench_source);
+		event_send();
+	}
+	return (uint64_t)count * bench_lines;
+}
+
+static int bench_log() { return bench_source.fd < 0 ? -1 : 0; }
+
+static int bench_log_events()
+{
+	return bench_source.fd < 0 ? -1 : bench_events_one();
+}
+
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+/*
+ * sets the debug verbosity for the replay, without emitting the
+ * messages because the sampling never elapses
+ */
+static int bench_log_debug()
+{
+	int site;
+
+	if (bench_log_events() < 0)
+		return -1;
+	afbBindingV2verbosity = LOG_LEVEL_DEBUG;
+	for (site = 0 ; site < log_site_COUNT ; site++)
+		log_countdowns[site] = UINT_MAX;
+	return 0;
+}
+
+static void bench_log_quiet()
+{
+	afbBindingV2verbosity = -1;
+	bench_events_clear();
+}
+#endif
+
+static const struct {
+	const char *name;			/* name of the case */
+	uint64_t (*run)(unsigned count);	/* the case */
+	unsigned chunk;				/* count processed between two readings of the clock */
+	int (*setup)();				/* prepares the case if not NULL, returns 0 or -1 */
+	void (*cleanup)();			/* releases the setup if not NULL */
+} bench_CASES[] = {
+	{ "nmea_time", bench_nmea_time, 1000, NULL, NULL },
+	{ "nmea_angle", bench_nmea_angle, 1000, NULL, NULL },
+	{ "nmea_split", bench_nmea_split, 1000, NULL, NULL },
+	{ "position_wgs84", bench_position_wgs84, 100, NULL, NULL },
+	{ "position_dms_kmh", bench_position_dms_kmh, 100, NULL, NULL },
+	{ "position_dms_mph", bench_position_dms_mph, 100, NULL, NULL },
+	{ "position_dms_kn", bench_position_dms_kn, 100, NULL, NULL },
+	{ "new_dms", bench_new_dms, 100, NULL, NULL },
+	{ "event_get", bench_event_get, 1000, NULL, bench_events_clear },
+	{ "event_send", bench_event_send, 10, bench_events_many, bench_events_clear },
+	{ "clients", bench_clients, 10, bench_clients_start, bench_clients_stop },
+	{ "input_epoll", bench_epoll, 10, bench_epoll_start, bench_input_close },
+#if WITH_IO_URING
+	{ "input_io_uring", bench_uring, 10, bench_uring_start, bench_uring_stop },
+#endif
+	{ "geo_haversine_batch", bench_haversine, 10, NULL, NULL },
+	{ "geo_enu_batch", bench_enu, 10, NULL, NULL },
+	{ "geo_vincenty", bench_vincenty, 100, NULL, NULL },
+	{ "geo_vincenty_batch", bench_vincenty_batch, 1, NULL, NULL },
+	{ "geo_destination_batch", bench_destination, 10, NULL, NULL },
+	{ "track_append", bench_track_append, 10, bench_track_open, bench_track_close },
+	{ "track_near", bench_track_near, 1, bench_track_month, bench_track_close },
+	{ "nmea_read", bench_nmea_read, 1, bench_log, NULL },
+	{ "replay", bench_replay, 1, bench_log_events, bench_events_clear },
+	{ "replay_realtime", bench_ingest_replay, 1, bench_ingest_start, bench_ingest_stop },
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+	{ "replay_debug", bench_replay, 1, bench_log_debug, bench_log_quiet },
+#endif
+};
+
+/*
+ * compares the doubles for qsort
+ */
+static int bench_compare(const void *a, const void *b)
+{
+	double x = *(const double*)a, y = *(const double*)b;
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * measures the case c, stores its rate in items per second and its noise
+ */
+static void bench_case(int c, double *rate, double *noise)
+{
+	double rates[BENCH_RUNS], deviations[BENCH_RUNS];
+	uint64_t start, elapsed, items;
+	int r;
+
+	for (r = 0 ; r < BENCH_RUNS ; r++) {
+		items = 0;
+		start = nanonow();
+		do {
+			items += bench_CASES[c].run(bench_CASES[c].chunk);
+			elapsed = nanonow() - start;
+		} while (elapsed < bench_time);
+		rates[r] = (double)items * 1e9 / (double)elapsed;
+	}
+	qsort(rates, BENCH_RUNS, sizeof *rates, bench_compare);
+	*rate = rates[BENCH_RUNS / 2];
+	for (r = 0 ; r < BENCH_RUNS ; r++)
+		deviations[r] = fabs(rates[r] - *rate);
+	qsort(deviations, BENCH_RUNS, sizeof *deviations, bench_compare);
+	*noise = *rate > 0 ? deviations[BENCH_RUNS / 2] / *rate : 0;
+}
+
+/*
+ * prepares the data of the cases, the replay of log if not NULL
+ * returns 0 or -1 if the log can't be read
+ */
+static int bench_prepare(const char *log)
+{
+	char buffer[4096];
+	ssize_t i, n;
+
+	for (i = 0 ; i < BENCH_POINTS ; i++) {
+		bench_lats[i] = 48.1 + 0.5 * sin((double)i);
+		bench_lons[i] = 11.5 + 0.5 * cos((double)i);
+		bench_bearings[i] = fmod(37.0 * (double)i, 360.0);
+		bench_distances[i] = 50.0 * (double)(i + 1);
+	}
+	memset(&bench_fix, 0, offsetof(struct fix, text));
+	bench_fix.gps.set.time = bench_fix.gps.set.latitude = bench_fix.gps.set.longitude = 1;
+	bench_fix.gps.set.altitude = bench_fix.gps.set.speed = bench_fix.gps.set.track = 1;
+	bench_fix.gps.time = 45319000;
+	bench_fix.gps.latitude = 48.1173;
+	bench_fix.gps.longitude = 11.5166667;
+	bench_fix.gps.altitude = 545.4;
+	bench_fix.gps.speed = 11.52;
+	bench_fix.gps.track = 84.4;
+
+	if (bench_source.fd >= 0)
+		close(bench_source.fd);
+	bench_source.fd = -1;
+	bench_lines = 0;
+	if (log == NULL)
+		return 0;
+	bench_source.fd = open(log, O_RDONLY | O_CLOEXEC);
+	if (bench_source.fd < 0)
+		return -1;
+	while ((n = read(bench_source.fd, buffer, sizeof buffer)) > 0)
+		for (i = 0 ; i < n ; i++)
+			bench_lines += buffer[i] == '\n';
+	return 0;
+}
+
+/*
+ * runs the cases whose name contains filter, or all if NULL, compares
+ * them to baseline if not NULL and adds the results to result
+ */
+static void bench_run(struct json_object *result, const char *filter, struct json_object *baseline)
+{
+	struct json_object *cases, *item, *base, *value, *regressions, *improvements, *allocating;
+	double rate, noise, brate, bnoise, threshold, change;
+	int c;
+
+	cases = json_object_new_object();
+	regressions = json_object_new_array();
+	improvements = json_object_new_array();
+	allocating = json_object_new_array();
+	for (c = 0 ; c < (int)(sizeof bench_CASES / sizeof *bench_CASES) ; c++) {
+		if ((filter != NULL && strstr(bench_CASES[c].name, filter) == NULL)
+		 || (bench_CASES[c].setup != NULL && bench_CASES[c].setup() < 0))
+			continue;
+		bench_case(c, &rate, &noise);
+		item = json_object_new_object();
+		json_object_object_add(item, "rate", json_object_new_double(rate));
+		json_object_object_add(item, "noise", json_object_new_double(noise));
+		if (bench_latencies[bench_verb_get].samples != NULL)
+			bench_percentiles(item);
+		if (bench_input.sockets != NULL)
+			bench_input_report(item);
+		if (bench_ingest.thread) {
+			json_object_object_add(item, "allocations", json_object_new_int64((int64_t)bench_ingest.allocations));
+			if (bench_ingest.allocations > 0)
+				json_object_array_add(allocating, json_object_new_string(bench_CASES[c].name));
+		}
+		if (bench_CASES[c].cleanup != NULL)
+			bench_CASES[c].cleanup();
+
+		/* compares to the baseline */
+		if (baseline != NULL && json_object_object_get_ex(baseline, bench_CASES[c].name, &base)
+		 && json_object_object_get_ex(base, "rate", &value) && (brate = json_object_get_double(value)) > 0) {
+			bnoise = json_object_object_get_ex(base, "noise", &value) ? json_object_get_double(value) : 0;
+			threshold = fmax(BENCH_THRESHOLD, BENCH_NOISES * (noise + bnoise));
+			change = rate / brate - 1;
+			json_object_object_add(item, "change", json_object_new_double(change));
+			json_object_object_add(item, "threshold", json_object_new_double(threshold));
+			if (change < -threshold)
+				json_object_array_add(regressions, json_object_new_string(bench_CASES[c].name));
+			else if (change > threshold)
+				json_object_array_add(improvements, json_object_new_string(bench_CASES[c].name));
+		}
+		json_object_object_add(cases, bench_CASES[c].name, item);
+	}
+	json_object_object_add(result, "cases", cases);
+	json_object_object_add(result, "allocating", allocating);
+	if (baseline != NULL) {
+		json_object_object_add(result, "regressions", regressions);
+		json_object_object_add(result, "improvements", improvements);
+	} else {
+		json_object_put(regressions);
+		json_object_put(improvements);
+	}
+}
+
+
+static const char bench_USAGE[] =
+	"usage: af-gps-bench [options]\n"
+	"\n"
+	"  -c, --cases FILTER     runs only the cases whose name contains FILTER\n"
+	"  -l, --log FILE         replays the NMEA log FILE in the cases nmea_read and replay\n"
+	"  -b, --baseline FILE    compares to the results of a previous bench\n"
+	"  -s, --save FILE        saves the results to FILE as the next baseline\n"
+	"  -t, --time MS          duration of each run in ms (default 200)\n"
+	"  -h, --help             prints this help\n";
+
+static const struct option bench_OPTIONS[] = {
+	{ "cases", required_argument, NULL, 'c' },
+	{ "log", required_argument, NULL, 'l' },
+	{ "baseline", required_argument, NULL, 'b' },
+	{ "save", required_argument, NULL, 's' },
+	{ "time", required_argument, NULL, 't' },
+	{ "help", no_argument, NULL, 'h' },
+	{ NULL, 0, NULL, 0 }
+};
+
+/*
+ * prints the names of the array item of result with a message
+ * returns 1 if the array isn't empty or else 0
+ */
+static int bench_failed(struct json_object *result, const char *item, const char *message)
+{
+	struct json_object *array;
+
+	if (!json_object_object_get_ex(result, item, &array) || json_object_array_length(array) == 0)
+		return 0;
+	fprintf(stderr, "%s: %s\n", message, json_object_to_json_string(array));
+	return 1;
+}
+
+/*
+ * runs the bench and prints its result on the standard output
+ * exits with 1 when a case allocates, 2 on error
+ */
+int main(int ac, char **av)
+{
+	const char *log, *filter, *path, *save;
+	struct json_object *result, *baseline, *cases;
+	int opt, rc;
+
+	log = filter = path = save = NULL;
+	while ((opt = getopt_long(ac, av, "c:l:b:s:t:h", bench_OPTIONS, NULL)) != -1) {
+		switch (opt) {
+		case 'c': filter = optarg; break;
+		case 'l': log = optarg; break;
+		case 'b': path = optarg; break;
+		case 's': save = optarg; break;
+		case 't': bench_time = strtoull(optarg, NULL, 10) * 1000000; break;
+		case 'h': fputs(bench_USAGE, stdout); return 0;
+		default: fputs(bench_USAGE, stderr); return 2;
+		}
+	}
+
+	baseline = cases = NULL;
+	if (path != NULL) {
+		baseline = json_object_from_file(path);
+		if (baseline == NULL || !json_object_object_get_ex(baseline, "cases", &cases)) {
+			fprintf(stderr, "invalid baseline %s\n", path);
+			return 2;
+		}
+	}
+	if (bench_prepare(log) < 0) {
+		fprintf(stderr, "can't read the log %s: %m\n", log);
+		return 2;
+	}
+	afbBindingV2verbosity = -1;
+	if (history_init(DEFAULT_HISTORY) < 0 || tiles_init() < 0) {
+		fprintf(stderr, "out of memory\n");
+		return 2;
+	}
+
+	result = json_object_new_object();
+	bench_run(result, filter, cases);
+	json_object_put(baseline);
+	puts(json_object_to_json_string_ext(result, JSON_C_TO_STRING_PRETTY));
+	if (save != NULL && json_object_to_file(save, result) < 0) {
+		fprintf(stderr, "can't save to %s\n", save);
+		json_object_put(result);
+		return 2;
+	}
+	rc = bench_failed(result, "allocating", "cases allocating");
+	json_object_put(result);
+	return rc;
+}
@@ -0,0 +1,177 @@
+/*
+ * Copyright (C) 2016 "IoT.bzh"
+ * Author José Bollo <jose.bollo@iot.bzh>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <json-c/json.h>
+
+#include <systemd/sd-event.h>
+
+#include "afb-stub.h"
+
+/* the events, their name follows them */
+struct afb_event_itf {
+	int unused;
+};
+
+struct stub_event {
+	int listeners;		/* count of the subscriptions, atomic */
+	char name[];		/* name of the event */
+};
+
+static const struct afb_event_itf event_itf;
+
+/* the requests */
+struct stub_req {
+	struct json_object *args;	/* the arguments or NULL */
+	struct json_object *reply;	/* the object replied on success */
+	const char *status;		/* the status of the reply or NULL */
+};
+
+/* the verbosity of the binding */
+int afbBindingV2verbosity = 0;
+
+/* the event loop of the binding, created on first use */
+static struct sd_event *event_loop;
+static pthread_once_t event_loop_once = PTHREAD_ONCE_INIT;
+
+static void event_loop_create()
+{
+	if (sd_event_new(&event_loop) < 0)
+		event_loop = NULL;
+}
+
+struct sd_event *afb_daemon_get_event_loop()
+{
+	pthread_once(&event_loop_once, event_loop_create);
+	return event_loop;
+}
+
+/*
+ * logs the message on the standard error, formatted in an allocated
+ * buffer as the binder does
+ */
+void afb_daemon_verbose(int level, const char *file, int line, const char *func, const char *fmt, ...)
+{
+	static const char *prefixes[] = { "EMERGENCY", "ALERT", "CRITICAL", "ERROR", "WARNING", "NOTICE", "INFO", "DEBUG" };
+	va_list ap;
+	char *message;
+
+	va_start(ap, fmt);
+	if (vasprintf(&message, fmt, ap) < 0)
+		message = NULL;
+	va_end(ap);
+	fprintf(stderr, "%s: %s [%s:%d, %s]\n", prefixes[level & 7], message ? message : fmt, file, line, func);
+	free(message);
+}
+
+struct afb_event afb_daemon_make_event(const char *name)
+{
+	struct stub_event *event;
+	size_t length;
+
+	length = strlen(name);
+	event = malloc(sizeof *event + length + 1);
+	if (event == NULL)
+		return (struct afb_event){ .itf = NULL, .closure = NULL };
+	event->listeners = 0;
+	memcpy(event->name, name, length + 1);
+	return (struct afb_event){ .itf = &event_itf, .closure = event };
+}
+
+int afb_event_push(struct afb_event event, struct json_object *object)
+{
+	struct stub_event *e = event.closure;
+
+	json_object_put(object);
+	return __atomic_load_n(&e->listeners, __ATOMIC_RELAXED);
+}
+
+void afb_event_drop(struct afb_event event)
+{
+	free(event.closure);
+}
+
+int stub_event_listeners(struct afb_event event)
+{
+	struct stub_event *e = event.closure;
+
+	return __atomic_load_n(&e->listeners, __ATOMIC_RELAXED);
+}
+
+const char *afb_req_value(struct afb_req req, const char *name)
+{
+	struct stub_req *r = req.closure;
+	struct json_object *value;
+
+	if (r->args == NULL || !json_object_object_get_ex(r->args, name, &value))
+		return NULL;
+	return json_object_get_string(value);
+}
+
+void afb_req_success(struct afb_req req, struct json_object *obj, const char *info)
+{
+	struct stub_req *r = req.closure;
+
+	r->reply = obj;
+	r->status = "success";
+}
+
+void afb_req_fail(struct afb_req req, const char *status, const char *info)
+{
+	struct stub_req *r = req.closure;
+
+	r->status = status;
+}
+
+void afb_req_fail_f(struct afb_req req, const char *status, const char *info, ...)
+{
+	afb_req_fail(req, status, NULL);
+}
+
+int afb_req_subscribe(struct afb_req req, struct afb_event event)
+{
+	struct stub_event *e = event.closure;
+
+	__atomic_fetch_add(&e->listeners, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+int afb_req_unsubscribe(struct afb_req req, struct afb_event event)
+{
+	struct stub_event *e = event.closure;
+
+	__atomic_fetch_sub(&e->listeners, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+const char *stub_call(void (*verb)(struct afb_req req), struct json_object *args, struct json_object **reply)
+{
+	struct stub_req r = { .args = args, .reply = NULL, .status = NULL };
+
+	verb((struct afb_req){ .itf = NULL, .closure = &r });
+	if (reply != NULL)
+		*reply = r.reply;
+	else
+		json_object_put(r.reply);
+	return r.status != NULL ? r.status : "no-reply";
+}
@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2016 "IoT.bzh"
+ * Author José Bollo <jose.bollo@iot.bzh>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <afb/afb-binding.h>
+
+/*
+ * Calling the verbs of the binding without the binder
+ *
+ * The requests carry their arguments and record their reply. The events
+ * count their listeners, the requests that subscribed them and didn't
+ * unsubscribe them: a push releases its object and returns the count of
+ * the listeners as the binder does, so the events without listener are
+ * dropped by the binding.
+ */
+
+/*
+ * calls verb with the arguments args, an object or NULL, that is kept
+ * by the caller
+ * stores the object replied on success in reply if not NULL, to be
+ * released with json_object_put, or NULL on failure
+ * returns "success" or the status of the failure given by the verb
+ */
+extern const char *stub_call(void (*verb)(struct afb_req req), struct json_object *args, struct json_object **reply);
+
+/*
+ * returns the count of the listeners of event
+ */
+extern int stub_event_listeners(struct afb_event event);
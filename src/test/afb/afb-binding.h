@@ -0,0 +1,100 @@
+/*
+ * Copyright (C) 2016 "IoT.bzh"
+ * Author José Bollo <jose.bollo@iot.bzh>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Stub of the version 2 of the binding API of afb-daemon
+ *
+ * Only the subset used by the binding is declared, for compiling it
+ * in the tests without the binder: the functions are implemented by
+ * afb-stub.c that calls the verbs directly.
+ */
+
+struct json_object;
+struct sd_event;
+struct afb_auth;
+struct afb_event_itf;
+struct afb_req_itf;
+
+struct afb_event {
+	const struct afb_event_itf *itf;	/* NULL for an invalid event */
+	void *closure;
+};
+
+struct afb_req {
+	const struct afb_req_itf *itf;
+	void *closure;
+};
+
+#define AFB_SESSION_NONE_V2 0
+
+struct afb_verb_v2 {
+	const char *verb;
+	void (*callback)(struct afb_req req);
+	const struct afb_auth *auth;
+	const char *info;
+	uint32_t session;
+};
+
+struct afb_binding_v2 {
+	const char *api;
+	const char *specification;
+	const char *info;
+	const struct afb_verb_v2 *verbs;
+	int (*preinit)();
+	int (*init)();
+	void (*onevent)(const char *event, struct json_object *object);
+	unsigned noconcurrency: 1;
+};
+
+extern int afbBindingV2verbosity;
+
+extern struct afb_event afb_daemon_make_event(const char *name);
+extern struct sd_event *afb_daemon_get_event_loop();
+extern void afb_daemon_verbose(int level, const char *file, int line, const char *func, const char *fmt, ...)
+	__attribute__((format(printf, 5, 6)));
+
+extern int afb_event_push(struct afb_event event, struct json_object *object);
+extern void afb_event_drop(struct afb_event event);
+
+static inline int afb_event_is_valid(struct afb_event event)
+{
+	return event.itf != NULL;
+}
+
+extern const char *afb_req_value(struct afb_req req, const char *name);
+extern void afb_req_success(struct afb_req req, struct json_object *obj, const char *info);
+extern void afb_req_fail(struct afb_req req, const char *status, const char *info);
+extern void afb_req_fail_f(struct afb_req req, const char *status, const char *info, ...)
+	__attribute__((format(printf, 3, 4)));
+extern int afb_req_subscribe(struct afb_req req, struct afb_event event);
+extern int afb_req_unsubscribe(struct afb_req req, struct afb_event event);
+
+#define _AFB_LOGGING_V2_(vlevel, llevel, ...) \
+	do { \
+		if (afbBindingV2verbosity >= vlevel) \
+			afb_daemon_verbose(llevel, __FILE__, __LINE__, __func__, __VA_ARGS__); \
+	} while(0)
+
+#define AFB_ERROR(...)   _AFB_LOGGING_V2_(0, 3, __VA_ARGS__)
+#define AFB_WARNING(...) _AFB_LOGGING_V2_(1, 4, __VA_ARGS__)
+#define AFB_NOTICE(...)  _AFB_LOGGING_V2_(1, 5, __VA_ARGS__)
+#define AFB_INFO(...)    _AFB_LOGGING_V2_(2, 6, __VA_ARGS__)
+#define AFB_DEBUG(...)   _AFB_LOGGING_V2_(3, 7, __VA_ARGS__)
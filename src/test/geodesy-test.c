@@ -0,0 +1,174 @@
+/*
+ * Copyright (C) 2016 "IoT.bzh"
+ * Author José Bollo <jose.bollo@iot.bzh>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <math.h>
+
+#include "../geodesy.h"
+
+/*
+ * the accuracy checks of the geodesy against reference values, the
+ * scalar and batch functions giving the largest absolute error
+ * the references are analytic or, for Vincenty, the Flinders Peak to
+ * Buninyong example of its paper
+ */
+#define QUARTER     10007557.221018	/* pi / 2 times the mean radius in m */
+#define ARC         111195.080234	/* 1 degree times the mean radius in m */
+#define EQUATOR     111319.490793	/* 1 degree of the equator in m */
+#define EAST        111313.839237	/* a sin(1 degree), east of (0, 1) from (0, 0) */
+#define FLINDERS    -37.951033417, 144.424867889
+#define BUNINYONG   -37.652821139, 143.926495528
+
+static double check_haversine()
+{
+	double lats[] = { 0, 90 }, lons[] = { 90, 0 }, d[2];
+
+	geo_haversine_batch(0, 0, lats, lons, d, 2);
+	return fmax(fabs(geo_haversine(0, 0, 0, 90) - QUARTER),
+		fmax(fabs(d[0] - QUARTER), fabs(d[1] - QUARTER)));
+}
+
+static double check_vincenty()
+{
+	double buninyong[] = { BUNINYONG }, equator[] = { 0, 1 }, d[2] = { NAN, NAN }, e[2] = { NAN, NAN };
+
+	geo_vincenty(FLINDERS, BUNINYONG, &d[0], NULL, NULL);
+	geo_vincenty(0, 0, 0, 1, &d[1], NULL, NULL);
+	geo_vincenty_batch(FLINDERS, &buninyong[0], &buninyong[1], &e[0], NULL, 1);
+	geo_vincenty_batch(0, 0, &equator[0], &equator[1], &e[1], NULL, 1);
+	return fmax(fmax(fabs(d[0] - 54972.271), fabs(d[1] - EQUATOR)),
+		fmax(fabs(e[0] - 54972.271), fabs(e[1] - EQUATOR)));
+}
+
+static double check_vincenty_azimuth()
+{
+	double buninyong[] = { BUNINYONG }, a0 = NAN, a1 = NAN, b0 = NAN, d;
+
+	geo_vincenty(FLINDERS, BUNINYONG, NULL, &a0, &a1);
+	geo_vincenty_batch(FLINDERS, &buninyong[0], &buninyong[1], &d, &b0, 1);
+	return fmax(fmax(fabs(a0 - 306.868158333), fabs(a1 - 307.173630556)), fabs(b0 - 306.868158333));
+}
+
+static double check_destination()
+{
+	double bearings[] = { 90, 0, 270, 90 }, distances[] = { QUARTER, ARC, ARC / 4, ARC };
+	double lats[4], lons[4], lat, lon;
+
+	/* the longitudes west and over the antimeridian are negative */
+	geo_destination(0, 0, 90, QUARTER, &lat, &lon);
+	geo_destination_batch(0, 0, bearings, distances, lats, lons, 3);
+	geo_destination_batch(0, 179.5, &bearings[3], &distances[3], &lats[3], &lons[3], 1);
+	return fmax(fmax(fmax(fabs(lat), fabs(lon - 90)), fmax(fabs(lats[0]), fabs(lons[0] - 90))),
+		fmax(fmax(fabs(lats[1] - 1), fabs(lons[1])),
+		fmax(fmax(fabs(lats[2]), fabs(lons[2] + 0.25)), fmax(fabs(lats[3]), fabs(lons[3] + 179.5)))));
+}
+
+static double check_enu()
+{
+	double lats[] = { 0, 49.45, 46.8 }, lons[] = { 1, 11.5, 13.3 }, easts[3], norths[3], e, n, u, error;
+	int i;
+
+	/* analytic on the equator then as geo_enu up to 150 km */
+	geo_enu(0, 0, 0, 0, 1, 0, &e, &n, &u);
+	geo_enu_batch(0, 0, lats, lons, easts, norths, 1);
+	error = fmax(fmax(fabs(e - EAST), fabs(n)), fmax(fabs(easts[0] - EAST), fabs(norths[0])));
+	geo_enu_batch(48.1, 11.5, &lats[1], &lons[1], &easts[1], &norths[1], 2);
+	for (i = 1 ; i < 3 ; i++) {
+		geo_enu(48.1, 11.5, 0, lats[i], lons[i], 0, &e, &n, &u);
+		error = fmax(error, fmax(fabs(easts[i] - e), fabs(norths[i] - n)));
+	}
+	return error;
+}
+
+/*
+ * the points inside and outside a concave polygon around Munich and a
+ * box over the antimeridian, the error being the count of wrong answers
+ */
+static double check_inside()
+{
+	static const double munich_lats[] = { 48.0, 48.0, 48.3, 48.3, 48.1, 48.1 };
+	static const double munich_lons[] = { 11.3, 11.8, 11.8, 11.6, 11.6, 11.3 };
+	static const double pacific_lats[] = { 0, 0, 1, 1 };
+	static const double pacific_lons[] = { 179.5, -179.5, -179.5, 179.5 };
+	static const struct {
+		int pacific;		/* is the point for the box over the antimeridian? */
+		double lat, lon;	/* the point */
+		int inside;		/* is it inside? */
+	} points[] = {
+		{ 0, 48.05, 11.4, 1 },
+		{ 0, 48.2, 11.7, 1 },
+		{ 0, 48.2, 11.4, 0 },	/* in the notch */
+		{ 0, 48.05, 11.9, 0 },
+		{ 0, 47.9, 11.5, 0 },
+		{ 0, 48.05, -168.6, 0 },	/* antipodal in longitude */
+		{ 1, 0.5, 179.9, 1 },
+		{ 1, 0.5, 180, 1 },
+		{ 1, 0.5, -180, 1 },
+		{ 1, 0.5, -179.9, 1 },
+		{ 1, 0.5, 539.9, 1 },
+		{ 1, 0.5, 0, 0 },
+		{ 1, 0.5, 179.4, 0 },
+		{ 1, 0.5, -179.4, 0 },
+		{ 1, 1.5, 180, 0 }
+	};
+	int i, in, wrong;
+
+	wrong = 0;
+	for (i = 0 ; i < (int)(sizeof points / sizeof *points) ; i++) {
+		if (points[i].pacific)
+			in = geo_inside(points[i].lat, points[i].lon, pacific_lats, pacific_lons, 4);
+		else
+			in = geo_inside(points[i].lat, points[i].lon, munich_lats, munich_lons, 6);
+		if (in != points[i].inside) {
+			fprintf(stderr, "geo_inside(%g, %g) is %d\n", points[i].lat, points[i].lon, in);
+			wrong++;
+		}
+	}
+	return wrong;
+}
+
+static const struct {
+	const char *name;		/* name of the check */
+	double (*error)();		/* the largest error of the check */
+	double tolerance;		/* the largest error accepted */
+} CHECKS[] = {
+	{ "geo_haversine", check_haversine, 1e-3 },			/* m */
+	{ "geo_vincenty", check_vincenty, 1e-3 },			/* m */
+	{ "geo_vincenty_azimuth", check_vincenty_azimuth, 1e-5 },	/* degree */
+	{ "geo_destination", check_destination, 1e-9 },			/* degree */
+	{ "geo_enu", check_enu, 1e-3 },					/* m */
+	{ "geo_inside", check_inside, 0 }				/* count */
+};
+
+/*
+ * runs the checks, printing their error
+ * exits with 1 if one exceeds its tolerance
+ */
+int main()
+{
+	double error;
+	int c, rc;
+
+	rc = 0;
+	for (c = 0 ; c < (int)(sizeof CHECKS / sizeof *CHECKS) ; c++) {
+		error = CHECKS[c].error();
+		printf("%-24s %-12g %s\n", CHECKS[c].name, error, error <= CHECKS[c].tolerance ? "ok" : "FAILED");
+		if (!(error <= CHECKS[c].tolerance))
+			rc = 1;
+	}
+	return rc;
+}
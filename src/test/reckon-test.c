@@ -0,0 +1,165 @@
+/*
+ * Copyright (C) 2016 "IoT.bzh"
+ * Author José Bollo <jose.bollo@iot.bzh>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * the replay of a candump log through the dead reckoning
+ *
+ * the binding is compiled in this program against the stub of afb. a
+ * fix heading east at 10 m/s is committed, then the frames of the log
+ * are given to the reckoning with their times and the timer ticks
+ * every period of the log time. the log drives 10 s straight, turns
+ * left by 9 degree/s during 10 s and drives 10 s north at 15 m/s.
+ */
+#define _GNU_SOURCE
+
+#include "../af-gps-binding.c"
+
+#include "afb-stub.h"
+
+/* the signals of the log, as given in AFBGPS_CAN_SPEED and AFBGPS_CAN_YAW */
+#define RECKON_SPEED  "0x3e9:0:2:0.01"
+#define RECKON_YAW    "0x3ea:0:2:0.01"
+
+/* the fix committed before the outage of the log */
+static const char reckon_NMEA[] =
+	"$GPGGA,123519.00,4807.0380,N,01131.0080,E,1,08,0.9,545.4,M,46.9,M,,*61\r\n"
+	"$GPRMC,123519.00,A,4807.0380,N,01131.0080,E,19.438,90.0,181026,,,A*5B\r\n";
+
+/*
+ * the expected reckoned fixes, from the analytic move, the accuracy
+ * growing from 0.9 * RECKON_UERE by RECKON_DRIFT per m travelled
+ */
+static const struct {
+	uint64_t time;		/* time in ms after the first frame */
+	double latitude;	/* expected latitude in degree */
+	double longitude;	/* expected longitude in degree */
+	double accuracy;	/* expected accuracy in m */
+} EXPECTED[] = {
+	{  5000, 48.1173000, 11.5174735,  7.00 },
+	{ 10000, 48.1173000, 11.5181471,  9.50 },
+	{ 15000, 48.1174677, 11.5187535, 12.00 },
+	{ 20000, 48.1178725, 11.5190047, 14.50 },
+	{ 25000, 48.1185470, 11.5190047, 18.25 },
+	{ 30000, 48.1192215, 11.5190047, 22.00 }
+};
+
+#define TOLERANCE_DISTANCE  1.0		/* m, the steps turning at their end */
+#define TOLERANCE_ACCURACY  0.01	/* m */
+
+/*
+ * reads in frame and time the frame of the candump line
+ * returns 1 if read or 0 otherwise
+ */
+static int reckon_read(const char *line, struct can_frame *frame, uint64_t *time)
+{
+	unsigned long long sec, usec;
+	unsigned id, byte;
+	char data[2 * CAN_MAX_DLEN + 1];
+	int n;
+
+	if (sscanf(line, "(%llu.%llu) %*s %x#%16[0-9A-Fa-f]", &sec, &usec, &id, data) != 4)
+		return 0;
+	memset(frame, 0, sizeof *frame);
+	frame->can_id = id;
+	for (n = 0 ; data[2 * n] && data[2 * n + 1] && sscanf(&data[2 * n], "%2x", &byte) == 1 ; n++)
+		frame->data[n] = (uint8_t)byte;
+	frame->can_dlc = (uint8_t)n;
+	*time = (uint64_t)sec * 1000 + (uint64_t)usec / 1000;
+	return 1;
+}
+
+/*
+ * reckons at the tick, ms after the first frame, and checks the
+ * fix when expected
+ * returns 1 if correct or 0 otherwise
+ */
+static int reckon_check(uint64_t now, uint64_t tick)
+{
+	struct fix fix;
+	double distance;
+	unsigned i;
+	int ok;
+
+	reckon_tick(now);
+	for (i = 0 ; i < sizeof EXPECTED / sizeof *EXPECTED && EXPECTED[i].time != tick ; i++);
+	if (i == sizeof EXPECTED / sizeof *EXPECTED)
+		return 1;
+
+	fix_snapshot(&fix);
+	distance = geo_haversine(EXPECTED[i].latitude, EXPECTED[i].longitude, fix.gps.latitude, fix.gps.longitude);
+	ok = fix.reckoned
+		&& distance <= TOLERANCE_DISTANCE
+		&& fabs(fix.accuracy - EXPECTED[i].accuracy) <= TOLERANCE_ACCURACY;
+	printf("reckoned at %-6llu %.7f %.7f distance %-10g accuracy %-8g %s\n",
+		(unsigned long long)tick, fix.gps.latitude, fix.gps.longitude,
+		distance, fix.accuracy, ok ? "ok" : "FAILED");
+	return ok;
+}
+
+/*
+ * replays the candump log given in argument
+ * exits with 1 if a reckoned fix isn't the expected one and 2 on errors
+ */
+int main(int ac, char **av)
+{
+	struct source src;
+	struct can_frame frame;
+	char line[256];
+	uint64_t time, first, tick;
+	FILE *file;
+	int rc;
+
+	if (ac != 2) {
+		fprintf(stderr, "usage: %s candump.log\n", av[0]);
+		return 2;
+	}
+	file = fopen(av[1], "r");
+	if (file == NULL) {
+		fprintf(stderr, "can't read the log %s: %m\n", av[1]);
+		return 2;
+	}
+	afbBindingV2verbosity = -1;
+	if (signal_parse(RECKON_SPEED, &reckon.speed_signal, 0) < 0
+	 || signal_parse(RECKON_YAW, &reckon.yaw_signal, 1) < 0)
+		return 2;
+
+	memset(&src, 0, sizeof src);
+	src.fd = -1;
+	nmea_feed(&src, reckon_NMEA, sizeof reckon_NMEA - 1);
+
+	/* the frames of a time are received before its tick */
+	rc = 0;
+	first = tick = 0;
+	while (fgets(line, sizeof line, file) != NULL) {
+		if (!reckon_read(line, &frame, &time))
+			continue;
+		if (first == 0)
+			first = tick = time;
+		for ( ; tick < time ; tick += reckon.period)
+			if (!reckon_check(tick, tick - first))
+				rc = 1;
+		reckon_frame(&frame, time);
+	}
+	fclose(file);
+	if (first != 0 && !reckon_check(tick, tick - first))
+		rc = 1;
+	if (first == 0 || tick - first < EXPECTED[sizeof EXPECTED / sizeof *EXPECTED - 1].time) {
+		fprintf(stderr, "the log %s ends before the expected fixes\n", av[1]);
+		rc = 2;
+	}
+	return rc;
+}